@@ -7,37 +7,24 @@ namespace BroadCastPacketBuilder
 	class CServerInfo
 	{
 	public:
+		// | channel | address | port |
+		typedef PacketSchema::CMessage< CODE_BROAD_SERVER_INFO, PacketSchema::String8, PacketSchema::String8, PacketSchema::Int16 > Schema;
+
 		static std::string make( const std::string &broadCastChannel, const std::string &addr, int port )
 		{
-			int pos = 0;
-			try
-			{
-				std::string body;
-				pos += CPacketBufferUtil::writeString8( body, pos, broadCastChannel );
-				pos += CPacketBufferUtil::writeString8( body, pos, addr );
-				pos += CPacketBufferUtil::writeInt16( body, pos, port, true );
-
-				return CommonPacketBuilder::makePacket( CODE_BROAD_SERVER_INFO, body );
-			}catch(...)
-			{
-			}
-			return "";
+			return Schema::make( broadCastChannel, addr, port );
 		}
 
-		static bool parse( const std::string &body, std::string &broadCastChannel, std::string &addr, int &port )
+		static bool parse( const CPacketView &body, std::string &broadCastChannel, std::string &addr, int &port )
 		{
-			int pos = 0;
-			try
-			{
-				boost::int16_t temp_port;
-				pos += CPacketBufferUtil::readString8( body, pos, broadCastChannel );
-				pos += CPacketBufferUtil::readString8( body, pos, addr );
-				pos += CPacketBufferUtil::readInt16( body, pos, temp_port, true );
-				port = temp_port;
-			}catch(...)
-			{
+			CPacketView channelView, addrView;
+			boost::int16_t temp_port;
+			if( !Schema::parse( body, channelView, addrView, temp_port ) )
 				return false;
-			}
+
+			broadCastChannel = channelView.str();
+			addr = addrView.str();
+			port = (boost::uint16_t)temp_port;
 			return true;
 		}
 	};
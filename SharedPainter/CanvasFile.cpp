@@ -0,0 +1,526 @@
+#include "StdAfx.h"
+#include "CanvasFile.h"
+#include <set>
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static const char CanvasFileMagic[8] = { 'S', 'P', 'C', 'A', 'N', 'V', 'A', 'S' };
+static const size_t CanvasFileCopySize = 64 * 1024;
+
+static boost::uint64_t alignedSize( boost::uint64_t size )
+{
+	return (size + 7) & ~(boost::uint64_t)7;
+}
+
+// the offset is in the area until the layout is known.
+static SCanvasFileRef appendToArea( std::string &area, const char *data, size_t size )
+{
+	SCanvasFileRef ref;
+	ref.offset = area.size();
+	ref.size = size;
+
+	area.append( data, size );
+	area.resize( (size_t)alignedSize( area.size() ), 0 );
+	return ref;
+}
+
+static SCanvasFileRef appendString( std::string &area, const QString &str )
+{
+	QByteArray a = str.toUtf8();
+	return appendToArea( area, a.constData(), a.size() );
+}
+
+// the index of the owner in the owner table, added once.
+static boost::uint32_t ownerIndexOf( const std::string &owner, std::vector< SCanvasFileRef > &owners, std::map< std::string, boost::uint32_t > &ownerIndex, std::string &strings )
+{
+	std::map< std::string, boost::uint32_t >::iterator it = ownerIndex.find( owner );
+	if( it != ownerIndex.end() )
+		return it->second;
+
+	boost::uint32_t index = (boost::uint32_t)owners.size();
+	ownerIndex.insert( std::make_pair( owner, index ) );
+	owners.push_back( appendToArea( strings, owner.c_str(), owner.size() ) );
+	return index;
+}
+
+// zeros up to the next 8 byte boundary after size bytes.
+static bool writePadding( QFile &f, boost::uint64_t size )
+{
+	static const char zeros[8] = { 0, };
+
+	qint64 pad = (qint64)(alignedSize( size ) - size);
+	return pad == 0 || f.write( zeros, pad ) == pad;
+}
+
+static bool writePadded( QFile &f, const char *data, size_t size )
+{
+	if( size > 0 && f.write( data, size ) != (qint64)size )
+		return false;
+
+	return writePadding( f, size );
+}
+
+// a file of the canvas, copied once under its hash. (an unchanged file is not copied again)
+static bool keepFile( const QString &dir, const QString &name, const QString &path )
+{
+	QString target = dir + name;
+	if( QFile::exists( target ) )
+		return true;
+
+	QString tempPath = target + ".tmp";
+	QFile::remove( tempPath );
+
+	QFile src( path );
+	QFile f( tempPath );
+	if( !src.open( QIODevice::ReadOnly ) || !f.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+		return false;
+
+	std::string buf( CanvasFileCopySize, 0 );
+	qint64 len;
+	bool ok = true;
+	while( ok && (len = src.read( &buf[0], buf.size() )) > 0 )
+		ok = f.write( buf.data(), len ) == len;
+
+	ok = ok && len == 0 && CCanvasFile::syncFile( f );
+	f.close();
+
+	if( ok )
+		ok = QFile::rename( tempPath, target );
+	if( !ok )
+		QFile::remove( tempPath );
+	return ok;
+}
+
+// the files no record of the saved canvas refers to.
+static void removeUnusedFiles( const QString &dir, const std::set< QString > &used )
+{
+	QStringList names = QDir( dir ).entryList( QDir::Files );
+	for( int i = 0; i < names.size(); i++ )
+	{
+		if( used.find( names[i] ) == used.end() )
+			QFile::remove( dir + names[i] );
+	}
+}
+
+bool CCanvasFile::save( const QString &path, const ITEM_LIST &items, boost::shared_ptr<CBackgroundImageItem> background, int windowWidth, int windowHeight )
+{
+	SCanvasFileHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, CanvasFileMagic, sizeof(header.magic) );
+	header.version = Version;
+	header.byteOrder = ByteOrderMark;
+	header.windowWidth = windowWidth;
+	header.windowHeight = windowHeight;
+
+	std::vector< SCanvasFileRef > owners;
+	std::map< std::string, boost::uint32_t > ownerIndex;
+	std::vector< SCanvasFileItem > records;
+	std::map< QString, QString > files;	// | hex content hash | path |
+	std::string strings;
+	std::string points;
+	boost::uint64_t blobSize = 0;
+
+	records.reserve( items.size() );
+
+	// the variable data first, at offsets in its area.
+	for( size_t i = 0; i < items.size() + 1; i++ )
+	{
+		boost::shared_ptr<CPaintItem> item = i < items.size() ? items[i] : background;
+		if( !item )
+			continue;
+
+		boost::uint32_t owner = ownerIndexOf( item->owner(), owners, ownerIndex, strings );
+
+		if( item == background )
+		{
+			QImage pixels = background->image().convertToFormat( QImage::Format_ARGB32 );
+			if( pixels.isNull() )
+				continue;
+
+			header.backgroundWidth = pixels.width();
+			header.backgroundHeight = pixels.height();
+			header.backgroundBytesPerLine = pixels.bytesPerLine();
+			header.backgroundOwner = owner;
+			header.background.offset = blobSize;
+			header.background.size = (boost::uint64_t)pixels.bytesPerLine() * pixels.height();
+			blobSize += alignedSize( header.background.size );
+
+			// the next tile delta of the frame owner goes on this image. (after a restart too)
+			if( background->hasTileFrame() )
+			{
+				header.backgroundFrameOwner = ownerIndexOf( background->tileFrameOwner(), owners, ownerIndex, strings );
+				header.backgroundFrameId = background->tileFrameId();
+			}
+			continue;
+		}
+
+		SCanvasFileItem record;
+		memset( &record, 0, sizeof(record) );
+		record.type = (boost::uint16_t)item->type();
+		record.owner = owner;
+		record.itemId = item->itemId();
+		record.posX = item->data().posX;
+		record.posY = item->data().posY;
+		record.scale = item->data().scale;
+		if( item->data().posSetFlag )
+			record.flags |= FLAG_POS_SET;
+
+		switch( item->type() )
+		{
+		case PT_LINE:
+			{
+				CLineItem *line = static_cast< CLineItem * >( item.get() );
+				record.color = line->color().rgba();
+				record.width = line->width();
+				if( line->isCurve() )
+					record.flags |= FLAG_CURVE;
+
+				std::vector< double > xy;
+				xy.reserve( line->pointSize() * 2 );
+				for( size_t j = 0; j < line->pointSize(); j++ )
+				{
+					xy.push_back( line->point( j )->x() );
+					xy.push_back( line->point( j )->y() );
+				}
+				record.data = appendToArea( points, xy.empty() ? NULL : (const char *)&xy[0], xy.size() * sizeof(double) );
+			}
+			break;
+		case PT_TEXT:
+			{
+				CTextItem *text = static_cast< CTextItem * >( item.get() );
+				record.color = text->color().rgba();
+				record.width = text->font().pixelSize();
+				if( text->font().bold() )
+					record.flags |= FLAG_BOLD;
+
+				record.data = appendString( strings, text->text() );
+				record.name = appendString( strings, text->font().family() );
+			}
+			break;
+		case PT_FILE:
+		case PT_IMAGE_FILE:
+			{
+				CFileItem *file = static_cast< CFileItem * >( item.get() );
+				QFileInfo info( file->path() );
+				if( !info.exists() )
+					continue;
+
+				const QByteArray &hash = file->contentHash();
+				if( hash.isEmpty() )
+					continue;
+
+				record.name = appendString( strings, file->path() );
+				record.hash = appendToArea( strings, hash.constData(), hash.size() );
+				record.data.size = info.size();
+				files.insert( std::make_pair( QString( hash.toHex() ), file->path() ) );
+			}
+			break;
+		default:
+			continue;
+		}
+
+		records.push_back( record );
+	}
+
+	// the layout, then the area offsets become file offsets.
+	header.itemCount = (boost::uint32_t)records.size();
+	header.ownerCount = (boost::uint32_t)owners.size();
+	header.ownerTable = alignedSize( sizeof(header) );
+	header.itemTable = header.ownerTable + owners.size() * sizeof(SCanvasFileRef);
+
+	boost::uint64_t stringArea = header.itemTable + records.size() * sizeof(SCanvasFileItem);
+	boost::uint64_t pointArea = stringArea + strings.size();
+	boost::uint64_t blobArea = pointArea + points.size();
+	header.fileSize = blobArea + blobSize;
+	header.blobArea = blobArea;
+
+	for( size_t i = 0; i < owners.size(); i++ )
+		owners[i].offset += stringArea;
+
+	for( size_t i = 0; i < records.size(); i++ )
+	{
+		SCanvasFileItem &record = records[i];
+		record.name.offset += stringArea;
+		record.hash.offset += stringArea;
+		if( record.type == PT_LINE )
+			record.data.offset += pointArea;
+		else if( record.type == PT_TEXT )
+			record.data.offset += stringArea;
+	}
+	header.background.offset += blobArea;
+
+	// the files first, the canvas file never refers to a file which is not kept.
+	QString fileDir = fileDirPath( path );
+	if( !files.empty() && !QDir().mkpath( fileDir ) )
+		return false;
+
+	std::set< QString > used;
+	for( std::map< QString, QString >::iterator it = files.begin(); it != files.end(); it++ )
+	{
+		if( !keepFile( fileDir, it->first, it->second ) )
+			return false;
+		used.insert( it->first );
+	}
+
+	QString tempPath = path + ".tmp";
+	QFile f( tempPath );
+	if( !f.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+		return false;
+
+	bool ok = writePadded( f, (const char *)&header, sizeof(header) )
+		&& writePadded( f, owners.empty() ? NULL : (const char *)&owners[0], owners.size() * sizeof(SCanvasFileRef) )
+		&& writePadded( f, records.empty() ? NULL : (const char *)&records[0], records.size() * sizeof(SCanvasFileItem) )
+		&& writePadded( f, strings.data(), strings.size() )
+		&& writePadded( f, points.data(), points.size() );
+
+	if( ok && header.backgroundWidth > 0 )
+	{
+		QImage pixels = background->image().convertToFormat( QImage::Format_ARGB32 );
+		ok = writePadded( f, (const char *)pixels.constBits(), (size_t)header.background.size );
+	}
+
+	ok = ok && syncFile( f ) && f.size() == (qint64)header.fileSize;
+	f.close();
+
+	if( ok )
+	{
+		QFile::remove( path );
+		ok = QFile::rename( tempPath, path );
+	}
+	if( !ok )
+	{
+		QFile::remove( tempPath );
+		return false;
+	}
+
+	removeUnusedFiles( fileDir, used );
+	return true;
+}
+
+bool CCanvasFile::syncFile( QFile &f )
+{
+	if( !f.flush() )
+		return false;
+#ifdef Q_OS_WIN
+	return _commit( f.handle() ) == 0;
+#else
+	return fsync( f.handle() ) == 0;
+#endif
+}
+
+bool CCanvasFile::open( const QString &path )
+{
+	close();
+
+	file_.setFileName( path );
+	fileDir_ = fileDirPath( path );
+	if( !file_.open( QIODevice::ReadOnly ) )
+		return false;
+
+	// the blobs are not mapped, a canvas of big images maps its tables only.
+	SCanvasFileHeader check;
+	size_ = file_.size();
+	if( file_.read( (char *)&check, sizeof(check) ) != (qint64)sizeof(check)
+		|| memcmp( check.magic, CanvasFileMagic, sizeof(check.magic) ) != 0
+		|| check.version != Version
+		|| check.byteOrder != ByteOrderMark
+		|| check.fileSize != (boost::uint64_t)size_
+		|| check.blobArea < sizeof(check) || check.blobArea > check.fileSize )
+	{
+		close();
+		return false;
+	}
+
+	mapSize_ = (qint64)check.blobArea;
+	base_ = (const char *)file_.map( 0, mapSize_ );
+	if( !base_ )
+	{
+		close();
+		return false;
+	}
+
+	const SCanvasFileHeader *header = (const SCanvasFileHeader *)base_;
+
+	SCanvasFileRef ownerTable = { header->ownerTable, (boost::uint64_t)header->ownerCount * sizeof(SCanvasFileRef) };
+	SCanvasFileRef itemTable = { header->itemTable, (boost::uint64_t)header->itemCount * sizeof(SCanvasFileItem) };
+	if( !isValidRef( ownerTable, 8 ) || !isValidRef( itemTable, 8 ) )
+	{
+		close();
+		return false;
+	}
+
+	header_ = header;
+	owners_ = (const SCanvasFileRef *)refData( ownerTable );
+	items_ = (const SCanvasFileItem *)refData( itemTable );
+	return true;
+}
+
+void CCanvasFile::close( void )
+{
+	if( base_ )
+		file_.unmap( (uchar *)base_ );
+	file_.close();
+
+	base_ = NULL;
+	size_ = 0;
+	mapSize_ = 0;
+	header_ = NULL;
+	owners_ = NULL;
+	items_ = NULL;
+}
+
+boost::shared_ptr<CPaintItem> CCanvasFile::item( size_t index ) const
+{
+	if( index >= itemCount() )
+		return boost::shared_ptr<CPaintItem>();
+
+	const SCanvasFileItem &record = items_[index];
+
+	struct SPaintData data;
+	if( record.itemId <= 0 || !ownerName( record.owner, data.owner ) )
+		return boost::shared_ptr<CPaintItem>();
+
+	data.itemId = record.itemId;
+	data.posX = record.posX;
+	data.posY = record.posY;
+	data.scale = record.scale;
+	data.posSetFlag = (record.flags & FLAG_POS_SET) != 0;
+
+	boost::shared_ptr<CPaintItem> item;
+	switch( record.type )
+	{
+	case PT_LINE:
+		{
+			if( !isValidRef( record.data, sizeof(double) ) || record.data.size % (2 * sizeof(double)) != 0 )
+				return boost::shared_ptr<CPaintItem>();
+
+			// QPointF is of qreal, so not read in place.
+			const double *xy = (const double *)refData( record.data );
+			size_t count = (size_t)(record.data.size / (2 * sizeof(double)));
+
+			std::vector< QPointF > points;
+			points.reserve( count );
+			for( size_t i = 0; i < count; i++ )
+				points.push_back( QPointF( xy[i * 2], xy[i * 2 + 1] ) );
+
+			boost::shared_ptr<CLineItem> line( new CLineItem( QColor::fromRgba( record.color ), record.width ) );
+			line->setPoints( points, (record.flags & FLAG_CURVE) != 0 );
+			item = line;
+		}
+		break;
+	case PT_TEXT:
+		{
+			QString text, family;
+			if( !refString( record.data, text ) || !refString( record.name, family ) )
+				return boost::shared_ptr<CPaintItem>();
+
+			QFont font;
+			font.setFamily( family );
+			font.setPixelSize( record.width );
+			font.setBold( (record.flags & FLAG_BOLD) != 0 );
+
+			item = boost::shared_ptr<CPaintItem>( new CTextItem( text, font, QColor::fromRgba( record.color ) ) );
+		}
+		break;
+	case PT_FILE:
+	case PT_IMAGE_FILE:
+		{
+			QString path;
+			if( !isValidRef( record.hash ) || !restoreFile( record, path ) )
+				return boost::shared_ptr<CPaintItem>();
+
+			boost::shared_ptr<CFileItem> file( record.type == PT_FILE ? new CFileItem( path ) : new CImageFileItem( path ) );
+			if( record.hash.size > 0 )
+				file->setContentHash( QByteArray( refData( record.hash ), (int)record.hash.size ) );
+			item = file;
+		}
+		break;
+	default:
+		return boost::shared_ptr<CPaintItem>();
+	}
+
+	item->setData( data );
+	return item;
+}
+
+boost::shared_ptr<CBackgroundImageItem> CCanvasFile::background( void ) const
+{
+	if( !header_ || header_->backgroundWidth <= 0 || header_->backgroundHeight <= 0 )
+		return boost::shared_ptr<CBackgroundImageItem>();
+
+	const SCanvasFileHeader &header = *header_;
+	const SCanvasFileRef &ref = header.background;
+	std::string owner;
+	if( ref.offset < header.blobArea || ref.offset > (boost::uint64_t)size_ || ref.size > (boost::uint64_t)size_ - ref.offset
+		|| header.backgroundBytesPerLine < header.backgroundWidth * 4
+		|| (boost::uint64_t)header.backgroundBytesPerLine * header.backgroundHeight != ref.size
+		|| !ownerName( header.backgroundOwner, owner ) )
+		return boost::shared_ptr<CBackgroundImageItem>();
+
+	// read a line at a time into the image. (its lines may be of another length)
+	QImage pixels( header.backgroundWidth, header.backgroundHeight, QImage::Format_ARGB32 );
+	if( pixels.isNull() || !file_.seek( (qint64)ref.offset ) )
+		return boost::shared_ptr<CBackgroundImageItem>();
+
+	std::string line( header.backgroundBytesPerLine, 0 );
+	for( int y = 0; y < header.backgroundHeight; y++ )
+	{
+		if( file_.read( &line[0], line.size() ) != (qint64)line.size() )
+			return boost::shared_ptr<CBackgroundImageItem>();
+		memcpy( pixels.scanLine( y ), line.data(), header.backgroundWidth * 4 );
+	}
+
+	boost::shared_ptr<CBackgroundImageItem> image( new CBackgroundImageItem );
+	image->setImage( pixels );
+	image->setOwner( owner );
+	image->setItemId( 0 );
+
+	std::string frameOwner;
+	if( header.backgroundFrameId != 0 && ownerName( header.backgroundFrameOwner, frameOwner ) )
+		image->setTileFrame( frameOwner, header.backgroundFrameId );
+	return image;
+}
+
+bool CCanvasFile::isValidRef( const SCanvasFileRef &ref, size_t align ) const
+{
+	boost::uint64_t size = (boost::uint64_t)mapSize_;
+	return ref.offset <= size && ref.size <= size - ref.offset && ref.offset % align == 0;
+}
+
+bool CCanvasFile::refString( const SCanvasFileRef &ref, QString &str ) const
+{
+	if( !isValidRef( ref ) )
+		return false;
+
+	str = QString::fromUtf8( refData( ref ), (int)ref.size );
+	return true;
+}
+
+bool CCanvasFile::ownerName( boost::uint32_t index, std::string &owner ) const
+{
+	if( index >= header_->ownerCount || !isValidRef( owners_[index] ) || owners_[index].size == 0 )
+		return false;
+
+	owner.assign( refData( owners_[index] ), (size_t)owners_[index].size );
+	return true;
+}
+
+// the file where it was, or copied out of the kept one.
+bool CCanvasFile::restoreFile( const SCanvasFileItem &record, QString &path ) const
+{
+	if( !refString( record.name, path ) || record.hash.size == 0 )
+		return false;
+
+	QFileInfo info( path );
+	if( info.exists() && (boost::uint64_t)info.size() == record.data.size )
+		return true;
+
+	QString kept = fileDir_ + QString( QByteArray( refData( record.hash ), (int)record.hash.size ).toHex() );
+	path = generateFileDownloadPath() + info.fileName();
+
+	QFile::remove( path );
+	return QFile::copy( kept, path );
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+#include "PaintItem.h"
+
+//---------------------------------------------
+// canvas file : the canvas kept over a restart, read through a memory map
+//---------------------------------------------
+//
+// | header | owner table | item table | string area | point area | blob area |
+//
+// The tables hold fixed size records, so a record is found by its index without reading the others.
+// A record refers to its variable data by the offset from the beginning of the file.
+// Every section, point array and blob starts at an 8 byte boundary, so the file is read in place.
+// The numbers are in the byte order of the writer. A reader of the other order does not load it.
+// The files of the file items are not in the canvas file. They are kept once by content hash beside it,
+// in <canvas file>.files/<hex hash>, so a save copies only the files it has not got yet
+// and removes the ones no record refers to any more.
+//
+// open() maps the file up to the blob area and checks the tables only. item() makes the CPaintItem
+// of a record when it is asked, so a big canvas is made as it is drawn and not before.
+// The background pixels are read from the blob area by offset, they are not mapped.
+//
+
+struct SCanvasFileRef
+{
+	boost::uint64_t offset;
+	boost::uint64_t size;
+};
+
+struct SCanvasFileHeader
+{
+	char magic[8];						// "SPCANVAS"
+	boost::uint32_t version;
+	boost::uint32_t byteOrder;			// CCanvasFile::ByteOrderMark as the writer wrote it
+	boost::uint32_t itemCount;
+	boost::uint32_t ownerCount;
+	boost::int32_t windowWidth;
+	boost::int32_t windowHeight;
+	boost::uint64_t ownerTable;
+	boost::uint64_t itemTable;
+	boost::uint64_t fileSize;
+	boost::int32_t backgroundWidth;		// 0 : no background image
+	boost::int32_t backgroundHeight;
+	boost::int32_t backgroundBytesPerLine;
+	boost::uint32_t backgroundOwner;	// index in the owner table
+	SCanvasFileRef background;			// ARGB32 pixels in the blob area
+	boost::uint32_t backgroundFrameOwner;	// index in the owner table
+	boost::uint32_t backgroundFrameId;	// the tile frame of the background, 0 : none (see CTileCodec)
+	boost::uint64_t blobArea;			// the end of the mapped part
+};
+
+struct SCanvasFileItem
+{
+	boost::uint16_t type;				// PaintItemType
+	boost::uint16_t flags;				// CCanvasFile::ItemFlag
+	boost::uint32_t owner;				// index in the owner table
+	boost::int32_t itemId;
+	boost::uint32_t color;				// QRgb
+	double posX;
+	double posY;
+	double scale;
+	boost::int32_t width;				// line : pen width, text : pixel size
+	boost::uint32_t reserved;
+	SCanvasFileRef data;				// line : x, y pairs of double, text : utf-8 text, file : size only (the file is by hash)
+	SCanvasFileRef name;				// text : utf-8 font family, file : utf-8 path
+	SCanvasFileRef hash;				// file : content hash
+};
+
+BOOST_STATIC_ASSERT( sizeof(SCanvasFileRef) == 16 );
+BOOST_STATIC_ASSERT( sizeof(SCanvasFileHeader) == 104 );
+BOOST_STATIC_ASSERT( sizeof(SCanvasFileItem) == 96 );
+
+class CCanvasFile
+{
+public:
+	static const boost::uint32_t Version = 4;
+	static const boost::uint32_t ByteOrderMark = 0x01020304;
+
+	enum ItemFlag
+	{
+		FLAG_POS_SET = 0x01,
+		FLAG_CURVE = 0x02,
+		FLAG_BOLD = 0x04,
+	};
+
+	CCanvasFile( void ) : base_(NULL), size_(0), mapSize_(0), header_(NULL), owners_(NULL), items_(NULL) { }
+	~CCanvasFile( void )
+	{
+		close();
+	}
+
+	// writes a new file next to path and renames it over, so a failed save keeps the old one.
+	static bool save( const QString &path, const ITEM_LIST &items, boost::shared_ptr<CBackgroundImageItem> background, int windowWidth, int windowHeight );
+
+	// flushed and on the disk. (the journal syncs its log with it too)
+	static bool syncFile( QFile &f );
+
+	// the directory of the files of the canvas file at path.
+	static QString fileDirPath( const QString &path ) { return path + ".files/"; }
+
+	bool open( const QString &path );
+	void close( void );
+
+	size_t itemCount( void ) const { return header_ ? header_->itemCount : 0; }
+	int windowWidth( void ) const { return header_ ? header_->windowWidth : 0; }
+	int windowHeight( void ) const { return header_ ? header_->windowHeight : 0; }
+
+	// made now, null if the record is broken.
+	// a file item gets its file back from the blob if the path is gone. (Download/<file name>)
+	boost::shared_ptr<CPaintItem> item( size_t index ) const;
+	boost::shared_ptr<CBackgroundImageItem> background( void ) const;
+
+private:
+	bool isValidRef( const SCanvasFileRef &ref, size_t align = 1 ) const;	// in the mapped part
+	const char *refData( const SCanvasFileRef &ref ) const { return base_ + ref.offset; }
+	bool refString( const SCanvasFileRef &ref, QString &str ) const;
+	bool ownerName( boost::uint32_t index, std::string &owner ) const;
+	bool restoreFile( const SCanvasFileItem &record, QString &path ) const;
+
+private:
+	mutable QFile file_;	// the background is read from it
+	QString fileDir_;
+	const char *base_;
+	qint64 size_;
+	qint64 mapSize_;
+	const SCanvasFileHeader *header_;
+	const SCanvasFileRef *owners_;
+	const SCanvasFileItem *items_;
+};
@@ -1,19 +1,26 @@
 #pragma once
 
 #include "PacketBuffer.h"
+#include "PacketSchema.h"
+#include "IOBuffer.h"
 
 namespace CommonPacketBuilder
 {
 	static std::string makePacket( boost::int16_t code, const std::string &body )
 	{
-		std::string buf;
+		CPacketWriter writer( code, body.size() );
+		writer.writeBinary( body.c_str(), body.size() );
+		return writer.packet();
+	}
 
-		int pos = 0;
-		pos += CPacketBufferUtil::writeInt8( buf, pos, NET_MAGIC_CODE );
-		pos += CPacketBufferUtil::writeInt16( buf, pos, code, true );
-		pos += CPacketBufferUtil::writeInt32( buf, pos, body.size(), true );
-		buf += body;
+	// the header is prepended to the body slabs, the body is not copied.
+	static CIOBuffer makePacket( boost::int16_t code, const CIOBuffer &body )
+	{
+		char header[CPacketWriter::HeaderSize];
+		CPacketWriter::makeHeader( header, code, body.size() );
 
+		CIOBuffer buf( body );
+		buf.prepend( header, sizeof(header) );
 		return buf;
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,344 @@
+#include "StdAfx.h"
+#include "FileTransfer.h"
+
+bool CFileSender::start( size_t offset )
+{
+	if( !file_.isOpen() )
+	{
+		file_.setFileName( item_->path() );
+		if( !file_.open( QIODevice::ReadOnly ) )
+			return false;
+	}
+
+	totalSize_ = (size_t)file_.size();
+	if( offset > totalSize_ )
+		offset = 0;	// not this file, from the beginning
+
+	digestTaken_ = false;
+
+	nextOffset_ = ackedOffset_ = offset;
+	started_ = true;
+	return true;
+}
+
+void CFileSender::acknowledge( size_t offset )
+{
+	if( offset > ackedOffset_ && offset <= nextOffset_ )
+		ackedOffset_ = offset;
+
+	if( isDone() )
+		file_.close();
+}
+
+bool CFileSender::nextChunk( size_t &offset, std::string &data )
+{
+	if( !started_ || nextOffset_ >= totalSize_ || nextOffset_ - ackedOffset_ >= WindowSize )
+		return false;
+
+	size_t size = std::min( (size_t)ChunkSize, totalSize_ - nextOffset_ );
+	data.resize( size );
+
+	// read on demand, the file is never loaded as a whole.
+	if( !file_.seek( nextOffset_ ) || file_.read( &data[0], size ) != (qint64)size )
+		return false;
+
+	offset = nextOffset_;
+	nextOffset_ += size;
+	return true;
+}
+
+bool CFileSender::takeDigest( QByteArray &digest )
+{
+	if( !started_ || digestTaken_ || nextOffset_ < totalSize_ )
+		return false;
+
+	digest = item_->contentHash();
+	if( digest.isEmpty() )
+		return false;
+
+	digestTaken_ = true;
+	return true;
+}
+
+void CFileStore::setCapacity( qint64 capacity )
+{
+	capacity_ = capacity;
+	if( loaded_ )
+		evict( QString() );
+}
+
+QString CFileStore::find( const QByteArray &hash )
+{
+	if( hash.isEmpty() )
+		return QString();
+
+	load();
+
+	ENTRY_MAP::iterator it = entries_.find( QString( hash.toHex() ) );
+	if( it == entries_.end() )
+		return QString();
+
+	// deleted by the user
+	if( !QFileInfo( it->second.path ).exists() )
+	{
+		remove( it );
+		return QString();
+	}
+
+	touch( it->first, it->second );
+	return it->second.path;
+}
+
+QString CFileStore::partPath( const QByteArray &hash, const std::string &owner, int itemId )
+{
+	load();
+
+	// the owner is a mac address, no name for a file.
+	QByteArray ownerHex = QByteArray( owner.data(), (int)owner.size() ).toHex();
+	return rootPath_ + QString( hash.toHex() ) + "_" + QString( ownerHex ) + "_" + QString::number( itemId ) + ".part";
+}
+
+bool CFileStore::add( const QString &srcPath, const QByteArray &hash, const QString &fileName, QString &path )
+{
+	load();
+
+	QString key( hash.toHex() );
+
+	// the same content by another name
+	ENTRY_MAP::iterator it = entries_.find( key );
+	if( it != entries_.end() && QFileInfo( it->second.path ).exists() )
+	{
+		QFile::remove( srcPath );
+		touch( it->first, it->second );
+		path = it->second.path;
+		return true;
+	}
+
+	if( it != entries_.end() )
+		remove( it );
+
+	QString dirPath = rootPath_ + key;
+	QDir().mkpath( dirPath );
+
+	QString destPath = dirPath + QDir::separator() + fileName;
+	QFile::remove( destPath );
+	if( !QFile::rename( srcPath, destPath ) )
+		return false;
+
+	struct SEntry entry;
+	entry.path = destPath;
+	entry.size = QFileInfo( destPath ).size();
+	touch( key, entry );
+
+	entries_[ key ] = entry;
+	totalSize_ += entry.size;
+
+	evict( key );
+
+	path = destPath;
+	return true;
+}
+
+void CFileStore::load( void )
+{
+	if( loaded_ )
+		return;
+
+	loaded_ = true;
+	rootPath_ = generateFileDownloadPath() + "store" + QDir::separator();
+
+	QDir root( rootPath_ );
+	if( !root.exists() )
+		root.mkpath( rootPath_ );
+
+	QStringList keys = root.entryList( QDir::Dirs | QDir::NoDotAndDotDot );
+	for( int i = 0; i < keys.size(); i++ )
+	{
+		QDir dir( rootPath_ + keys[i] );
+		QFileInfoList files = dir.entryInfoList( QDir::Files );
+		if( files.isEmpty() )
+		{
+			root.rmdir( keys[i] );
+			continue;
+		}
+
+		struct SEntry entry;
+		entry.path = files[0].filePath();
+		entry.size = files[0].size();
+
+		QFileInfo usedInfo( rootPath_ + keys[i] + ".used" );
+		entry.lastUsed = usedInfo.exists() ? usedInfo.lastModified() : files[0].lastModified();
+
+		entries_[ keys[i] ] = entry;
+		totalSize_ += entry.size;
+	}
+
+	evict( QString() );
+}
+
+void CFileStore::touch( const QString &key, struct SEntry &entry )
+{
+	entry.lastUsed = QDateTime::currentDateTime();
+
+	// the modified time of the mark keeps the order for the next run.
+	QFile used( rootPath_ + key + ".used" );
+	if( used.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+		used.write( "1", 1 );
+}
+
+void CFileStore::remove( ENTRY_MAP::iterator it )
+{
+	QFile::remove( it->second.path );
+	QFile::remove( rootPath_ + it->first + ".used" );
+	QDir( rootPath_ ).rmdir( it->first );
+
+	totalSize_ -= it->second.size;
+	entries_.erase( it );
+}
+
+boost::shared_ptr<CFileStore::CPin> CFileStore::pin( const QByteArray &hash )
+{
+	QString key( hash.toHex() );
+
+	boost::mutex::scoped_lock autolock( mutexPin_ );
+	pins_[ key ]++;
+	return boost::shared_ptr<CPin>( new CPin( this, key ) );
+}
+
+void CFileStore::unpin( const QString &key )
+{
+	boost::mutex::scoped_lock autolock( mutexPin_ );
+
+	std::map< QString, int >::iterator it = pins_.find( key );
+	if( it != pins_.end() && --it->second <= 0 )
+		pins_.erase( it );
+}
+
+bool CFileStore::isPinned( const QString &key )
+{
+	boost::mutex::scoped_lock autolock( mutexPin_ );
+	return pins_.find( key ) != pins_.end();
+}
+
+void CFileStore::evict( const QString &keepKey )
+{
+	while( totalSize_ > capacity_ )
+	{
+		ENTRY_MAP::iterator oldest = entries_.end();
+		ENTRY_MAP::iterator it = entries_.begin();
+		for( ; it != entries_.end(); it++ )
+		{
+			if( it->first == keepKey || isPinned( it->first ) )
+				continue;
+			if( oldest == entries_.end() || it->second.lastUsed < oldest->second.lastUsed )
+				oldest = it;
+		}
+
+		if( oldest == entries_.end() )
+			break;
+
+		remove( oldest );
+	}
+}
+
+CFileReceiver::CFileReceiver( boost::shared_ptr<CFileItem> item, const QString &fileName, size_t size, CFileStore *store )
+	: item_(item), store_(store), hash_(QCryptographicHash::Sha1), totalSize_(size), receivedSize_(0), stored_(false)
+{
+	// a name only, never a path of the sender.
+	fileName_ = QFileInfo( fileName ).fileName();
+}
+
+CFileReceiver::~CFileReceiver( void )
+{
+	file_.close();	// the part file stays for a resume
+}
+
+bool CFileReceiver::open( size_t &offset )
+{
+	if( fileName_.isEmpty() || item_->contentHash().isEmpty() )
+		return false;
+
+	// the same content from any item or session is not sent again.
+	QString storedPath = store_->find( item_->contentHash() );
+	if( !storedPath.isEmpty() )
+	{
+		item_->setPath( storedPath );
+		receivedSize_ = totalSize_;
+		stored_ = true;
+		offset = totalSize_;
+		return true;
+	}
+
+	partPath_ = store_->partPath( item_->contentHash(), item_->owner(), item_->itemId() );
+
+	file_.setFileName( partPath_ );
+	if( !file_.open( QIODevice::ReadWrite ) )
+		return false;
+
+	receivedSize_ = (size_t)file_.size();
+	if( receivedSize_ > totalSize_ )
+	{
+		file_.resize( 0 );
+		receivedSize_ = 0;
+	}
+
+	// the bytes of the last try go into the hash first.
+	hash_.reset();
+	std::string data( std::min( (size_t)CFileSender::ChunkSize, receivedSize_ ), 0 );
+	for( size_t hashed = 0; hashed < receivedSize_; )
+	{
+		size_t size = std::min( (size_t)CFileSender::ChunkSize, receivedSize_ - hashed );
+		if( file_.read( &data[0], size ) != (qint64)size )
+			return false;
+		hash_.addData( data.data(), size );
+		hashed += size;
+	}
+
+	if( !file_.seek( receivedSize_ ) )
+		return false;
+
+	offset = receivedSize_;
+	return true;
+}
+
+bool CFileReceiver::write( size_t offset, const char *data, size_t size )
+{
+	if( !file_.isOpen() || offset != receivedSize_ || size > totalSize_ - receivedSize_ )
+		return false;
+
+	if( file_.write( data, size ) != (qint64)size )
+		return false;
+
+	hash_.addData( data, size );
+	receivedSize_ += size;
+	return true;
+}
+
+bool CFileReceiver::finish( const QByteArray &digest )
+{
+	if( !isComplete() )
+		return false;
+
+	if( hash_.result() != digest || digest != item_->contentHash() )
+	{
+		qDebug() << "CFileReceiver::finish hash mismatch" << fileName_;
+		abort();
+		return false;
+	}
+
+	file_.close();
+
+	QString path;
+	if( !store_->add( partPath_, digest, fileName_, path ) )
+		return false;
+
+	item_->setPath( path );
+	return true;
+}
+
+void CFileReceiver::abort( void )
+{
+	file_.close();
+	if( !partPath_.isEmpty() )
+		QFile::remove( partPath_ );
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+#include "PaintItem.h"
+
+//---------------------------------------------
+// chunked file transfer
+//---------------------------------------------
+//
+// sender                                          receiver
+//   CODE_FILE_BEGIN   | item | name | size | hash | ->
+//                                                 <- CODE_FILE_REQUEST | offset |   (what it has already, 0 : nothing, size : all)
+//   CODE_FILE_CHUNK   | offset | data |    ->
+//   CODE_FILE_CHUNK   ...                  ->
+//                                          <- CODE_FILE_ACK | offset |       (written so far)
+//   CODE_FILE_END     | hash |             ->                                 (after the last chunk)
+//
+// The chunks are read from the file when the window has room, so a transfer holds
+// WindowSize bytes at most, and the other packets of the session go in between.
+// A file is known by the SHA-1 of its content. The receiver keeps the files in CFileStore,
+// and a file it has already (ex: dropped twice, the sync data after a reconnect) is requested
+// from its size, so only the item goes. Otherwise it writes a part file named after the hash,
+// and the same content comes again from the size of the part file.
+// The receiver hashes the file as it goes. The part file is moved into the store
+// only if the hash is the same, and the item is added then.
+// The receiver does the disk work on CFileWriter and acknowledges a chunk when it is written,
+// so a slow disk holds back the sender and not the network thread.
+//
+
+class CFileSender
+{
+public:
+	static const size_t ChunkSize = 64 * 1024;
+	static const size_t WindowSize = 4 * ChunkSize;
+
+	CFileSender( boost::shared_ptr<CFileItem> item, int packetId ) : item_(item), packetId_(packetId), totalSize_(0), nextOffset_(0), ackedOffset_(0), started_(false), digestTaken_(false) { }
+
+	boost::shared_ptr<CFileItem> item( void ) { return item_; }
+	int packetId( void ) { return packetId_; }
+
+	size_t totalSize( void ) { return totalSize_; }
+	size_t ackedSize( void ) { return ackedOffset_; }
+	bool isStarted( void ) { return started_; }
+	bool isDone( void ) { return started_ && ackedOffset_ >= totalSize_; }
+
+	// the receiver has the bytes before offset.
+	bool start( size_t offset );
+
+	void acknowledge( size_t offset );
+
+	// the next chunk if the window has room.
+	bool nextChunk( size_t &offset, std::string &data );
+
+	// the content hash, once after the last chunk.
+	bool takeDigest( QByteArray &digest );
+
+private:
+	boost::shared_ptr<CFileItem> item_;
+	int packetId_;
+	QFile file_;
+	size_t totalSize_;
+	size_t nextOffset_;
+	size_t ackedOffset_;
+	bool started_;
+	bool digestTaken_;
+};
+
+// content-addressed store of the received files. (Download/store/<hash>/<file name>)
+// over the capacity, the least recently used ones are deleted, but not a pinned one.
+// the items on the canvas point to their stored files, the manager pins them.
+// the methods run on the writer thread. (see CFileWriter)
+class CFileStore
+{
+public:
+	static const qint64 DefaultCapacity = 1024 * 1024 * 1024;
+
+	CFileStore( void ) : capacity_(DefaultCapacity), totalSize_(0), loaded_(false) { }
+
+	void setCapacity( qint64 capacity );
+
+	// the path of the content, empty if it is not here. the found one is used most recently.
+	QString find( const QByteArray &hash );
+
+	// the part file of the content for one item. (resume)
+	// two items of the same content are received at once into their own part files, the first one finished is kept.
+	QString partPath( const QByteArray &hash, const std::string &owner, int itemId );
+
+	// move the file into the store. path : the stored file.
+	bool add( const QString &srcPath, const QByteArray &hash, const QString &fileName, QString &path );
+
+	// the content is not evicted while a pin of it lives. (any thread)
+	class CPin
+	{
+	public:
+		CPin( CFileStore *store, const QString &key ) : store_(store), key_(key) { }
+		~CPin( void ) { store_->unpin( key_ ); }
+
+	private:
+		CFileStore *store_;
+		QString key_;
+	};
+	boost::shared_ptr<CPin> pin( const QByteArray &hash );
+
+private:
+	struct SEntry
+	{
+		QString path;
+		qint64 size;
+		QDateTime lastUsed;
+	};
+	typedef std::map< QString, struct SEntry > ENTRY_MAP;	// hex hash
+
+	void load( void );
+	void touch( const QString &key, struct SEntry &entry );
+	void remove( ENTRY_MAP::iterator it );
+	void evict( const QString &keepKey );
+	void unpin( const QString &key );
+	bool isPinned( const QString &key );
+
+private:
+	QString rootPath_;
+	qint64 capacity_;
+	qint64 totalSize_;
+	bool loaded_;
+	ENTRY_MAP entries_;
+
+	std::map< QString, int > pins_;	// hex hash : the pins
+	boost::mutex mutexPin_;
+};
+
+// the methods run on the writer thread. (see CFileWriter)
+class CFileReceiver
+{
+public:
+	CFileReceiver( boost::shared_ptr<CFileItem> item, const QString &fileName, size_t size, CFileStore *store );
+	~CFileReceiver( void );
+
+	boost::shared_ptr<CFileItem> item( void ) { return item_; }
+
+	size_t totalSize( void ) { return totalSize_; }
+	size_t receivedSize( void ) { return receivedSize_; }
+	bool isComplete( void ) { return receivedSize_ >= totalSize_; }
+	bool isStored( void ) { return stored_; }
+
+	// open the part file. offset : the bytes already received. (resume)
+	// the content in the store is not received again, the item gets the stored path. (isStored)
+	bool open( size_t &offset );
+
+	// false on a chunk out of order or a write error.
+	bool write( size_t offset, const char *data, size_t size );
+
+	// move the part file into the store if the hash is the same, the item gets the path.
+	// a different file is deleted.
+	bool finish( const QByteArray &digest );
+
+	// close and delete the part file.
+	void abort( void );
+
+private:
+	boost::shared_ptr<CFileItem> item_;
+	CFileStore *store_;
+	QString fileName_;
+	QString partPath_;
+	QFile file_;
+	QCryptographicHash hash_;
+	size_t totalSize_;
+	size_t receivedSize_;
+	bool stored_;
+};
+
+// one thread for the disk writes of all the receivers, the jobs run in order.
+// (a big file never stalls the network or the main thread)
+class CFileWriter
+{
+public:
+	typedef boost::function< void () > job_t;
+
+	CFileWriter( void ) : work_( new boost::asio::io_service::work( io_service_ ) )
+	{
+		thread_ = boost::thread( boost::bind( &CFileWriter::_threadMain, this ) );
+	}
+
+	~CFileWriter( void )
+	{
+		close();
+	}
+
+	void post( job_t job )
+	{
+		io_service_.post( job );
+	}
+
+	// the queued jobs are done before it returns.
+	void close( void )
+	{
+		work_.reset();
+		if( thread_.joinable() )
+			thread_.join();
+	}
+
+private:
+	void _threadMain( void )
+	{
+		io_service_.run();
+	}
+
+private:
+	boost::asio::io_service io_service_;
+	boost::scoped_ptr< boost::asio::io_service::work > work_;
+	boost::thread thread_;
+};
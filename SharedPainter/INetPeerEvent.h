@@ -1,5 +1,7 @@
 #pragma once
 
+#include "IOBuffer.h"
+
 class CNetPeerSession;
 class CNetBroadCastSession;
 class CNetPeerServer;
@@ -15,8 +17,12 @@ class INetPeerSessionEvent
 public:
 	virtual void onINetPeerSessionEvent_Connected( CNetPeerSession *session ) = 0;
 	virtual void onINetPeerSessionEvent_ConnectFailed( CNetPeerSession *session ) = 0;
-	virtual void onINetPeerSessionEvent_Received( CNetPeerSession *session, const std::string buffer ) = 0;
+	// the space the next read is received into. (an empty segment : the received bytes are dropped)
+	virtual CIOBuffer::Segment onINetPeerSessionEvent_PrepareReceive( CNetPeerSession *session ) = 0;
+	virtual void onINetPeerSessionEvent_Received( CNetPeerSession *session, const CIOBuffer::Segment &prepared, size_t bytes ) = 0;
 	virtual void onINetPeerSessionEvent_Sending( CNetPeerSession *session, boost::shared_ptr<CNetPacketData> packet ) = 0;
+	// the send queue went over its congestion mark, or back under. (see CNetPeerSession::setSendQueueLimit)
+	virtual void onINetPeerSessionEvent_SendQueue( CNetPeerSession *session, bool congested ) = 0;
 	virtual void onINetPeerSessionEvent_Disconnected( CNetPeerSession *session ) = 0;
 };
 
@@ -0,0 +1,280 @@
+#include "StdAfx.h"
+#include "IOBuffer.h"
+
+void CIOBuffer::pushSlab( const boost::shared_ptr<CIOSlab> &slab, size_t offset, size_t length, bool front )
+{
+	if( length <= 0 )
+		return;
+
+	Segment seg;
+	seg.slab = slab;
+	seg.offset = offset;
+	seg.length = length;
+
+	if( front )
+		segments_.push_front( seg );
+	else
+		segments_.push_back( seg );
+	size_ += length;
+}
+
+size_t CIOBuffer::tailSpare( void ) const
+{
+	if( !writeSlab_ || segments_.empty() )
+		return 0;
+
+	const Segment &tail = segments_.back();
+	if( tail.slab != writeSlab_ || tail.offset + tail.length != writeEnd_ )
+		return 0;
+
+	return writeSlab_->capacity() - writeEnd_;
+}
+
+void CIOBuffer::append( const void *ptr, size_t size )
+{
+	if( size <= 0 )
+		return;
+
+	const char *src = (const char *)ptr;
+
+	// fill the spare area of the tail slab if this buffer is the one appending to it.
+	size_t spare = tailSpare();
+	if( spare > 0 )
+	{
+		size_t n = spare < size ? spare : size;
+		memcpy( writeSlab_->data() + writeEnd_, src, n );
+		writeEnd_ += n;
+		segments_.back().length += n;
+		size_ += n;
+		src += n;
+		size -= n;
+	}
+
+	if( size <= 0 )
+		return;
+
+	boost::shared_ptr<CIOSlab> slab( new CIOSlab( size > DefaultSlabSize ? size : DefaultSlabSize ) );
+	memcpy( slab->data(), src, size );
+	pushSlab( slab, 0, size, false );
+	writeSlab_ = slab;
+	writeEnd_ = size;
+}
+
+void CIOBuffer::append( const CIOBuffer &other )
+{
+	if( &other == this )
+	{
+		CIOBuffer temp( other );
+		append( temp );
+		return;
+	}
+
+	std::deque< Segment >::const_iterator it = other.segments_.begin();
+	for( ; it != other.segments_.end(); it++ )
+		pushSlab( it->slab, it->offset, it->length, false );
+}
+
+void CIOBuffer::adopt( std::string &data )
+{
+	if( data.empty() )
+		return;
+
+	boost::shared_ptr<CIOSlab> slab( new CIOSlab( data ) );
+	pushSlab( slab, 0, slab->capacity(), false );
+}
+
+void CIOBuffer::prepend( const void *ptr, size_t size )
+{
+	if( size <= 0 )
+		return;
+
+	boost::shared_ptr<CIOSlab> slab( new CIOSlab( size ) );
+	memcpy( slab->data(), ptr, size );
+	pushSlab( slab, 0, size, true );
+}
+
+void CIOBuffer::prepend( const CIOBuffer &other )
+{
+	if( &other == this )
+	{
+		CIOBuffer temp( other );
+		prepend( temp );
+		return;
+	}
+
+	std::deque< Segment >::const_reverse_iterator it = other.segments_.rbegin();
+	for( ; it != other.segments_.rend(); it++ )
+		pushSlab( it->slab, it->offset, it->length, true );
+}
+
+CIOBuffer::Segment CIOBuffer::prepare( size_t minSize )
+{
+	Segment prepared;
+
+	size_t spare = tailSpare();
+	if( spare >= minSize && spare > 0 )
+	{
+		prepared.slab = writeSlab_;
+		prepared.offset = writeEnd_;
+	}
+	else
+	{
+		prepared.slab = boost::shared_ptr<CIOSlab>( new CIOSlab( minSize > DefaultSlabSize ? minSize : DefaultSlabSize ) );
+		prepared.offset = 0;
+	}
+	prepared.length = prepared.slab->capacity() - prepared.offset;
+
+	// reserved : append() must not write into the spare area while it is being filled.
+	writeSlab_.reset();
+	writeEnd_ = 0;
+	return prepared;
+}
+
+void CIOBuffer::commit( const Segment &prepared, size_t size )
+{
+	if( !prepared.slab )
+		return;
+
+	assert( size <= prepared.length );
+	if( size > prepared.length )
+		size = prepared.length;
+
+	writeSlab_ = prepared.slab;
+	writeEnd_ = prepared.offset + size;
+
+	if( size <= 0 )
+		return;
+
+	if( !segments_.empty() )
+	{
+		Segment &tail = segments_.back();
+		if( tail.slab == prepared.slab && tail.offset + tail.length == prepared.offset )
+		{
+			tail.length += size;
+			size_ += size;
+			return;
+		}
+	}
+
+	pushSlab( prepared.slab, prepared.offset, size, false );
+}
+
+void CIOBuffer::reserve( size_t capacity )
+{
+	if( size_ <= 0 || capacity <= size_ )
+		return;
+
+	if( segments_.size() == 1 && segments_.back().length + tailSpare() >= capacity )
+		return;
+
+	boost::shared_ptr<CIOSlab> slab( new CIOSlab( capacity ) );
+	size_t size = copyOut( 0, slab->data(), size_ );
+
+	clear();
+	pushSlab( slab, 0, size, false );
+	writeSlab_ = slab;
+	writeEnd_ = size;
+}
+
+size_t CIOBuffer::copyOut( size_t pos, void *ptr, size_t size ) const
+{
+	char *dst = (char *)ptr;
+	size_t copied = 0;
+
+	std::deque< Segment >::const_iterator it = segments_.begin();
+	for( ; it != segments_.end() && copied < size; it++ )
+	{
+		if( pos >= it->length )
+		{
+			pos -= it->length;
+			continue;
+		}
+
+		size_t n = it->length - pos;
+		if( n > size - copied )
+			n = size - copied;
+
+		memcpy( dst + copied, it->data() + pos, n );
+		copied += n;
+		pos = 0;
+	}
+	return copied;
+}
+
+std::string CIOBuffer::toString( void ) const
+{
+	std::string res;
+	res.reserve( size_ );
+
+	std::deque< Segment >::const_iterator it = segments_.begin();
+	for( ; it != segments_.end(); it++ )
+		res.append( it->data(), it->length );
+	return res;
+}
+
+const char * CIOBuffer::coalesce( void )
+{
+	if( segments_.empty() )
+		return NULL;
+
+	if( segments_.size() == 1 )
+		return segments_.front().data();
+
+	std::string all = toString();
+	clear();
+	adopt( all );
+	return segments_.front().data();
+}
+
+void CIOBuffer::trimFront( size_t size )
+{
+	if( size > size_ )
+		size = size_;
+
+	while( size > 0 )
+	{
+		Segment &head = segments_.front();
+		if( head.length <= size )
+		{
+			size -= head.length;
+			size_ -= head.length;
+			segments_.pop_front();
+		}
+		else
+		{
+			head.offset += size;
+			head.length -= size;
+			size_ -= size;
+			size = 0;
+		}
+	}
+}
+
+CIOBuffer CIOBuffer::splitAt( size_t pos )
+{
+	CIOBuffer front;
+
+	if( pos > size_ )
+		pos = size_;
+
+	while( pos > 0 )
+	{
+		Segment &head = segments_.front();
+		if( head.length <= pos )
+		{
+			front.pushSlab( head.slab, head.offset, head.length, false );
+			pos -= head.length;
+			size_ -= head.length;
+			segments_.pop_front();
+		}
+		else
+		{
+			front.pushSlab( head.slab, head.offset, pos, false );
+			head.offset += pos;
+			head.length -= pos;
+			size_ -= pos;
+			pos = 0;
+		}
+	}
+	return front;
+}
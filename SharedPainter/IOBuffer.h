@@ -0,0 +1,139 @@
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <deque>
+
+//---------------------------------------------
+// CIOBuffer : a chain of ref-counted slabs
+//---------------------------------------------
+//
+// | slab #1 [off, len] | slab #2 [off, len] | ... |
+//
+// Copying a CIOBuffer or splitting it only copies the segment list, never the bytes.
+// Slab bytes are immutable once committed, so the same slab may be shared by
+// buffers living on different threads. (boost::shared_ptr reference counting is atomic)
+// Only the buffer which made a slab writes into its spare area. The buffer keeps that
+// state itself (writeSlab_, writeEnd_), copies and splits never get it, so the bytes
+// a shared slab hands out are never written again. One CIOBuffer is used by one thread.
+//
+
+class CIOSlab
+{
+public:
+	explicit CIOSlab( size_t capacity )
+	{
+		storage_.resize( capacity );
+	}
+
+	// take the storage of the string without copying it.
+	explicit CIOSlab( std::string &adopt )
+	{
+		storage_.swap( adopt );
+	}
+
+	char * data( void ) { return storage_.empty() ? NULL : &storage_[0]; }
+	size_t capacity( void ) const { return storage_.size(); }
+
+private:
+	std::string storage_;
+};
+
+class CIOBuffer
+{
+public:
+	static const size_t DefaultSlabSize = 16 * 1024;
+
+	struct Segment
+	{
+		boost::shared_ptr<CIOSlab> slab;
+		size_t offset;
+		size_t length;
+
+		Segment( void ) : offset(0), length(0) { }
+
+		const char * data( void ) const { return slab->data() + offset; }
+	};
+
+	CIOBuffer( void ) : size_(0), writeEnd_(0) { }
+	explicit CIOBuffer( const std::string &data ) : size_(0), writeEnd_(0) { append( data ); }
+	CIOBuffer( const CIOBuffer &other ) : segments_(other.segments_), size_(other.size_), writeEnd_(0) { }
+	~CIOBuffer( void ) { }
+
+	// the copy never appends into the slabs of the other one.
+	CIOBuffer & operator = ( const CIOBuffer &other )
+	{
+		segments_ = other.segments_;
+		size_ = other.size_;
+		writeSlab_.reset();
+		writeEnd_ = 0;
+		return *this;
+	}
+
+	size_t size( void ) const { return size_; }
+	bool empty( void ) const { return size_ <= 0; }
+
+	size_t segmentCount( void ) const { return segments_.size(); }
+	const Segment & segment( size_t index ) const { return segments_[index]; }
+
+	void clear( void )
+	{
+		segments_.clear();
+		size_ = 0;
+		writeSlab_.reset();
+		writeEnd_ = 0;
+	}
+
+	void swap( CIOBuffer &other )
+	{
+		segments_.swap( other.segments_ );
+		std::swap( size_, other.size_ );
+		writeSlab_.swap( other.writeSlab_ );
+		std::swap( writeEnd_, other.writeEnd_ );
+	}
+
+	// Writing
+public:
+	void append( const void *ptr, size_t size );
+	void append( const std::string &data ) { append( data.c_str(), data.size() ); }
+	void append( const CIOBuffer &other );
+	void adopt( std::string &data );
+
+	void prepend( const void *ptr, size_t size );
+	void prepend( const std::string &data ) { prepend( data.c_str(), data.size() ); }
+	void prepend( const CIOBuffer &other );
+
+	// hand out at least minSize writable bytes at the end, to be filled in place. (ex: a socket read)
+	// the returned segment keeps the memory alive by itself, and nothing else is appended into it
+	// until commit() adds the filled bytes to the buffer.
+	Segment prepare( size_t minSize );
+	void commit( const Segment &prepared, size_t size );
+
+	// make the buffer one slab that can grow to capacity bytes without another slab.
+	void reserve( size_t capacity );
+
+	// Reading
+public:
+	size_t copyOut( size_t pos, void *ptr, size_t size ) const;
+	std::string toString( void ) const;
+
+	// make the whole buffer one segment and return its pointer. (no copy if it already is)
+	const char * coalesce( void );
+
+	void trimFront( size_t size );
+	CIOBuffer splitAt( size_t pos );
+
+private:
+	void pushSlab( const boost::shared_ptr<CIOSlab> &slab, size_t offset, size_t length, bool front );
+
+	// the bytes append() may write right after the tail segment. (0 : a new slab is needed)
+	size_t tailSpare( void ) const;
+
+private:
+	std::deque< Segment > segments_;
+	size_t size_;
+
+	// the slab this buffer made and the end of the bytes written into it.
+	// not set while a prepare()d area is being filled.
+	boost::shared_ptr<CIOSlab> writeSlab_;
+	size_t writeEnd_;
+};
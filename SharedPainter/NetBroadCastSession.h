@@ -8,7 +8,7 @@ public:
 	static const int DEFAULT_SEND_SEC = 3;
 
 	CNetBroadCastSession( boost::asio::io_service& io_service ) 
-		: socket_(io_service), evtTarget_(NULL)
+		: strand_(io_service), socket_(io_service), evtTarget_(NULL)
 		, broadCastPort_(0), sendMsgSecond_(DEFAULT_SEND_SEC), stopBroadCastMsgFlag_(true), broadcast_timer_(io_service)
 	{
 		qDebug() << "CNetBroadCastSession" << this;
@@ -96,9 +96,9 @@ public:
 	{
 		socket_.async_receive_from( 
 			boost::asio::buffer(read_buffer_, _BUF_SIZE), sender_endpoint_, 
-			boost::bind(&CNetBroadCastSession::_handle_receive_from, shared_from_this(), 
+			strand_.wrap( boost::bind(&CNetBroadCastSession::_handle_receive_from, shared_from_this(), 
 			boost::asio::placeholders::error, 
-			boost::asio::placeholders::bytes_transferred)); 
+			boost::asio::placeholders::bytes_transferred) )); 
 	}
 
 	void _handle_receive_from(const boost::system::error_code& error, size_t bytes_recvd) 
@@ -117,7 +117,7 @@ public:
 		sendMsgSecond_ = second;
 
 		broadcast_timer_.expires_from_now(boost::posix_time::seconds(second));
-		broadcast_timer_.async_wait( boost::bind(&CNetBroadCastSession::_handle_broadcast_timer, shared_from_this()) );
+		broadcast_timer_.async_wait( strand_.wrap( boost::bind(&CNetBroadCastSession::_handle_broadcast_timer, shared_from_this()) ) );
 	}
 
 	void _handle_broadcast_timer( void )
@@ -149,6 +149,7 @@ private:
 private:
 	static const int _BUF_SIZE = 4096;
 
+	boost::asio::io_service::strand strand_;	// the receive and the timer handlers share the socket
 	bool stopBroadCastMsgFlag_;
 	boost::asio::deadline_timer broadcast_timer_;
 	int broadCastPort_;
@@ -1,18 +1,169 @@
 #pragma once
 
+#include "IOBuffer.h"
+
+// an outgoing message. immutable once created, so one payload is shared by every session sending it.
+typedef boost::shared_ptr<const CIOBuffer> PAYLOAD_PTR;
+
+static PAYLOAD_PTR makePayload( const std::string &data )
+{
+	// one exact-size slab.
+	std::string temp( data );
+	boost::shared_ptr<CIOBuffer> payload( new CIOBuffer );
+	payload->adopt( temp );
+	return payload;
+}
+
+static PAYLOAD_PTR makePayload( const CIOBuffer &data )
+{
+	return PAYLOAD_PTR( new CIOBuffer( data ) );
+}
+
+//---------------------------------------------
+// CNetPacketData : a payload queued on one session
+//---------------------------------------------
+//
+// Holds a reference to the shared payload and the write cursor of the session.
+// The session may put other bytes on the wire for it (ex: stream compression),
+// the sizes are still counted in the bytes of the payload.
+// A packet with a supersede key is a state. A later packet of the same key replaces it,
+// so the session may drop it while it waits in the queue. (see CNetPeerSession::setSendQueueLimit)
+//
+
 class CNetPacketData
 {
 public:
-	CNetPacketData( boost::int32_t packetId, const std::string &body ) : packetId_(packetId)
+	CNetPacketData( boost::int32_t packetId, const std::string &body ) : packetId_(packetId), payload_(makePayload(body))
+	{
+		init();
+	}
+
+	CNetPacketData( boost::int32_t packetId, const PAYLOAD_PTR &payload ) : packetId_(packetId), payload_(payload)
 	{
-		writeBuffer_.write( body.c_str(), body.size() );
+		init();
 	}
 
 	int packetId( void ) { return packetId_; }
-		
-	CPacketBuffer &buffer( void ) { return writeBuffer_; }
+
+	const CIOBuffer &payload( void ) { return *payload_; }
+
+	// send these bytes instead of the payload. (before anything is sent)
+	void setWirePayload( const PAYLOAD_PTR &wire )
+	{
+		assert( wireSent_ == 0 );
+		wire_ = wire;
+		wireSize_ = wire_->size();
+		compressPending_ = false;
+	}
+
+	// the session compresses it when it is written, so it is never compressed if it is dropped.
+	void setCompressPending( bool pending ) { compressPending_ = pending; }
+	bool isCompressPending( void ) { return compressPending_; }
+
+	// empty : not a state, never dropped.
+	void setSupersedeKey( const std::string &key ) { supersedeKey_ = key; }
+	const std::string &supersedeKey( void ) { return supersedeKey_; }
+
+	// a byte of it is on the wire, it goes out as a whole.
+	bool isSending( void ) { return wireSent_ > 0; }
+
+	// given up before a byte is sent. it counts as sent, the sender of the packet is done with it.
+	void drop( void )
+	{
+		assert( wireSent_ == 0 );
+		wireSent_ = wireSize_;
+		segmentIndex_ = wire_->segmentCount();
+		segmentOffset_ = 0;
+	}
+
+	size_t totalSize( void ) { return totalSize_; }
+	size_t sentSize( void )
+	{
+		if( wireSent_ >= wireSize_ )
+			return totalSize_;
+		return (size_t)( (boost::uint64_t)wireSent_ * totalSize_ / wireSize_ );
+	}
+	size_t remainingSize( void ) { return totalSize_ - sentSize(); }
+
+	// add the unsent bytes to a buffer sequence without copying them,
+	// up to maxBytes and maxBuffers entries. returns the number of bytes added.
+	// the payload is not consumed until consume() is called.
+	template< class BufferList >
+	size_t gather( BufferList &buffers, size_t maxBytes, size_t maxBuffers )
+	{
+		size_t gathered = 0;
+		size_t offset = segmentOffset_;
+
+		for( size_t i = segmentIndex_; i < wire_->segmentCount(); i++ )
+		{
+			if( gathered >= maxBytes || buffers.size() >= maxBuffers )
+				break;
+
+			const CIOBuffer::Segment &seg = wire_->segment( i );
+			size_t len = seg.length - offset;
+			if( len > maxBytes - gathered )
+				len = maxBytes - gathered;
+
+			buffers.push_back( typename BufferList::value_type( seg.data() + offset, len ) );
+			gathered += len;
+			offset = 0;
+		}
+		return gathered;
+	}
+
+	// mark size bytes as sent. returns the number of bytes taken from size.
+	size_t consume( size_t size )
+	{
+		size_t consumed = 0;
+		while( consumed < size && segmentIndex_ < wire_->segmentCount() )
+		{
+			const CIOBuffer::Segment &seg = wire_->segment( segmentIndex_ );
+			size_t len = seg.length - segmentOffset_;
+			if( len > size - consumed )
+			{
+				segmentOffset_ += size - consumed;
+				consumed = size;
+				break;
+			}
+
+			consumed += len;
+			segmentIndex_++;
+			segmentOffset_ = 0;
+		}
+		wireSent_ += consumed;
+		return consumed;
+	}
+
+	// the sent bytes reported by the last sending event. (used by the sender to throttle the event)
+	size_t notifiedSize( void ) { return notifiedSize_; }
+	void setNotifiedSize( size_t size ) { notifiedSize_ = size; }
+
+private:
+	void init( void )
+	{
+		wire_ = payload_;
+		totalSize_ = payload_->size();
+		wireSize_ = totalSize_;
+		wireSent_ = 0;
+		notifiedSize_ = 0;
+		segmentIndex_ = 0;
+		segmentOffset_ = 0;
+		compressPending_ = false;
+	}
 
 private:
 	boost::int32_t packetId_;
-	CPacketBuffer writeBuffer_;
+	size_t totalSize_;
+	size_t notifiedSize_;
+	PAYLOAD_PTR payload_;
+
+	// send cursor
+	PAYLOAD_PTR wire_;
+	size_t wireSize_;
+	size_t wireSent_;
+	size_t segmentIndex_;
+	size_t segmentOffset_;
+	bool compressPending_;
+
+	std::string supersedeKey_;
 };
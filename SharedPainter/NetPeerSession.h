@@ -6,8 +6,10 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <iostream>
 #include <deque>
+#include <set>
 #include "DefferedCaller.h"
 #include "INetPeerEvent.h"
+#include "StreamCompressor.h"
 
 using boost::asio::deadline_timer;
 using boost::asio::ip::tcp;
@@ -15,8 +17,30 @@ using boost::asio::ip::tcp;
 class CNetPeerSession : public boost::enable_shared_from_this<CNetPeerSession>
 {
 public:
+	static const size_t DefaultWriteBatchSize = 256 * 1024;
+	static const size_t DefaultSendingEventGranularity = 64 * 1024;
+	static const int DefaultWriteDelayMs = 0;	// the end of the handler turn
+	static const size_t DefaultSendQueueBytes = 64 * 1024 * 1024;
+	static const size_t DefaultSendQueuePackets = 16 * 1024;
+	static const size_t CongestionDivisor = 16;	// congested over 1/16 of the limit, drained under half of that
+
+	// what a slow peer costs. over the limit the session is closed whatever the policy is.
+	// nothing connects again, the user joins again and gets the whole canvas then. (the sync data)
+	// the packet being written and a packet bigger than the limit by itself are not counted,
+	// so a big file or a screen shot goes however slow the peer is.
+	enum SendQueuePolicy
+	{
+		POLICY_DISCONNECT = 0x00,
+		POLICY_DROP_SUPERSEDED = 0x01,	// a state waiting in the queue is dropped for a later one of its key
+		POLICY_PAUSE_BULK = 0x02,		// the owner holds the bulk data while the queue is congested (isBulkPaused)
+	};
+
 	CNetPeerSession( boost::asio::io_service& io_service, int sessionId ) 
-		: io_service_(io_service), sessionId_(sessionId), stopped_(true), connected_(false), evtTarget_(NULL), clientsocket_(io_service), deadline_(io_service) 
+		: io_service_(io_service), strand_(io_service), sessionId_(sessionId), stopped_(true), connected_(false), evtTarget_(NULL), clientsocket_(io_service), deadline_(io_service) 
+		, flush_timer_(io_service), writing_(false), flushPending_(false), writeDelayMs_(DefaultWriteDelayMs)
+		, writeBatchSize_(DefaultWriteBatchSize), sendingEventGranularity_(DefaultSendingEventGranularity)
+		, sendQueueBytes_(DefaultSendQueueBytes), sendQueuePackets_(DefaultSendQueuePackets), sendQueuePolicy_(POLICY_DROP_SUPERSEDED | POLICY_PAUSE_BULK)
+		, queuedBytes_(0), oversizedBytes_(0), inflightCount_(0), congested_(false)
 	{ 
 		qDebug() << "CNetPeerSession(void) " << this;
 	}
@@ -34,6 +58,64 @@ public:
 
 	int sessionId( void ) { return sessionId_; }
 
+	// the maximum bytes handed to one async_write. queued packets are gathered up to this size.
+	void setWriteBatchSize( size_t size )
+	{
+		writeBatchSize_ = DefaultWriteBatchSize;
+		if( size > 0 )
+			writeBatchSize_ = size;
+	}
+	size_t writeBatchSize( void ) { return writeBatchSize_; }
+
+	// the packets sent while no write is in progress wait this long for the others, and go in one write.
+	// 0 : until the handlers queued on the io_service so far have run. (a relay sends all the packets of a read at once)
+	// a write batch size of packets goes at once.
+	void setWriteDelay( int ms ) { writeDelayMs_ = ms > 0 ? ms : 0; }
+	int writeDelay( void ) { return writeDelayMs_; }
+
+	// the sending event of a packet is fired after at least this many bytes are sent, and when it is done.
+	// 0 : fire on every completed write.
+	void setSendingEventGranularity( size_t size ) { sendingEventGranularity_ = size; }
+	size_t sendingEventGranularity( void ) { return sendingEventGranularity_; }
+
+	// the bytes (of the payloads) and the packets the queue may hold. policy : SendQueuePolicy flags
+	void setSendQueueLimit( size_t maxBytes, size_t maxPackets, int policy )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+
+		sendQueueBytes_ = maxBytes > 0 ? maxBytes : DefaultSendQueueBytes;
+		sendQueuePackets_ = maxPackets > 0 ? maxPackets : DefaultSendQueuePackets;
+		sendQueuePolicy_ = policy;
+
+		oversizedBytes_ = 0;
+		for( size_t i = 0; i < write_buffer_list_.size(); i++ )
+		{
+			if( isOversized( write_buffer_list_[i] ) )
+				oversizedBytes_ += write_buffer_list_[i]->totalSize();
+		}
+	}
+
+	size_t queuedBytes( void )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+		return queuedBytes_;
+	}
+	size_t queuedPackets( void )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+		return write_buffer_list_.size();
+	}
+	bool isCongested( void )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+		return congested_;
+	}
+	bool isBulkPaused( void )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+		return congested_ && (sendQueuePolicy_ & POLICY_PAUSE_BULK);
+	}
+
 	tcp::socket& socket() {
 		return clientsocket_;
 	}
@@ -59,7 +141,7 @@ public:
 
 			_start_connect( iterator );
 
-			deadline_.async_wait( boost::bind(&CNetPeerSession::_handle_check_deadline, shared_from_this()) );
+			deadline_.async_wait( strand_.wrap( boost::bind(&CNetPeerSession::_handle_check_deadline, shared_from_this()) ) );
 			return true;
 		}
 		catch(...)
@@ -72,19 +154,20 @@ public:
 	void close( void )
 	{
 		// safe close for thread race condition..
+		// (a handler of the strand and the main thread may close at the same time, one of them fires)
+		bool wasConnected = false;
 		{
 			boost::recursive_mutex::scoped_lock autolock(mutex_);
 
 			if( clientsocket_.is_open() )
 				clientsocket_.close();
-		}
 
-		if( connected_ )
-		{
+			wasConnected = connected_;
 			connected_ = false;
+		}
 
+		if( wasConnected )
 			fireDisconnectedEvent();
-		}
 	}
 
 	void start()
@@ -100,23 +183,89 @@ public:
 	
 	void sendData( boost::shared_ptr<CNetPacketData> packet )
 	{
-		if( packet->buffer().totalSize() <= 0 )
+		if( packet->totalSize() <= 0 )
 			return;
 
+		std::vector< boost::shared_ptr<CNetPacketData> > droppedList;
+		bool failed = false;
+		bool congestionChanged = false;
+		bool congested = false;
+		{
+			boost::recursive_mutex::scoped_lock autolock(mutex_);
+
+			// compressed in the queue order when it is written. (see _start_write)
+			packet->setCompressPending( compressor_ ? true : false );
+
+			// a congested queue keeps the last state of a key only.
+			if( congested_ && (sendQueuePolicy_ & POLICY_DROP_SUPERSEDED) && !packet->supersedeKey().empty() )
+				dropSuperseded( packet->supersedeKey(), droppedList );
+
+			write_buffer_list_.push_back( packet ); // store in write buffer
+			queuedBytes_ += packet->totalSize();
+			if( isOversized( packet ) )
+				oversizedBytes_ += packet->totalSize();
+
+			if( isOverLimit() && (sendQueuePolicy_ & POLICY_DROP_SUPERSEDED) )
+				dropSuperseded( std::string(), droppedList );
+
+			if( isOverLimit() )
+			{
+				qDebug() << "CNetPeerSession : the send queue is over the limit" << this << queuedBytes_ << write_buffer_list_.size();
+				failed = true;
+			}
+			else if( !writing_ )	// the packets wait for the flush, a full batch goes now.
+			{
+				if( queuedBytes_ >= writeBatchSize_ )
+					failed = !_start_write();
+				else
+					_schedule_flush();
+			}
+
+			congestionChanged = updateCongestion();
+			congested = congested_;
+		}
+
+		for( size_t i = 0; i < droppedList.size(); i++ )
+			fireSendingEvent( droppedList[i] );
+
+		if( congestionChanged )
+			fireSendQueueEvent( congested );
+
+		if( failed )
+			close();
+	}
+
+	// send switchPacket, then deflate every byte sent after it. (see CStreamCompressor)
+	// the peer must know the switch packet.
+	bool startStreamCompression( const std::string &switchPacket )
+	{
 		boost::recursive_mutex::scoped_lock autolock(mutex_);
 
-		bool write_in_progress = !write_buffer_list_.empty(); // is there anything currently being written?
+		if( compressor_ )
+			return true;
 
-		write_buffer_list_.push_back( packet ); // store in write buffer
+		boost::shared_ptr<CStreamCompressor> compressor( new CStreamCompressor );
+		if( !compressor->isValid() )
+			return false;
 
-		if ( !write_in_progress ) // if nothing is currently being written, then start
-			_start_write();
+		sendData( switchPacket );
+		compressor_ = compressor;
+		return true;
 	}
 
+	bool isStreamCompressed( void ) { return compressor_ ? true : false; }
+
 public:
 	void _connect_complete( void )
 	{
+		mutex_.lock();
 		connected_ = true;
+
+		// the packets are batched here (see setWriteDelay), nagle would delay a single action.
+		boost::system::error_code ec;
+		clientsocket_.set_option( tcp::no_delay( true ), ec );
+		mutex_.unlock();
+
 		deadline_.cancel();
 		fireConnectSuccessEvent();
 		// Start the input actor.
@@ -130,12 +279,10 @@ public:
 			// Set a deadline for the connect operation.
 			deadline_.expires_from_now(boost::posix_time::seconds(60));
 
-			//clientsocket_.set_option( boost::asio::ip::tcp::no_delay option(true) );
-
 			// Start the asynchronous connect operation.
 			clientsocket_.async_connect(endpoint_iter->endpoint(),
-				boost::bind(&CNetPeerSession::_handle_connect,
-				shared_from_this(), _1, endpoint_iter));
+				strand_.wrap( boost::bind(&CNetPeerSession::_handle_connect,
+				shared_from_this(), _1, endpoint_iter) ));
 
 		}
 		else
@@ -149,30 +296,104 @@ public:
 
 	void _start_read()
 	{
-		clientsocket_.async_receive(boost::asio::buffer(read_buffer_, _BUF_SIZE),
-			boost::bind(&CNetPeerSession::_handle_read,
+		// read straight into the space of the event target. (the packet slicer)
+		// read_target_ holds the memory until the read completes, even if the target is gone by then.
+		read_target_ = CIOBuffer::Segment();
+		if( evtTarget_ )
+			read_target_ = evtTarget_->onINetPeerSessionEvent_PrepareReceive( this );
+
+		char *ptr = read_buffer_;
+		size_t size = _BUF_SIZE;
+		if( read_target_.slab && read_target_.length > 0 )
+		{
+			ptr = read_target_.slab->data() + read_target_.offset;
+			size = read_target_.length;
+		}
+
+		// the socket is shared with sendData() of the other threads.
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+
+		clientsocket_.async_receive(boost::asio::buffer(ptr, size),
+			strand_.wrap( boost::bind(&CNetPeerSession::_handle_read,
 			shared_from_this(),
 			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred));
+			boost::asio::placeholders::bytes_transferred) ));
+	}
+
+	// (under mutex_)
+	void _schedule_flush()
+	{
+		if( flushPending_ )
+			return;
+		flushPending_ = true;
+
+		if( writeDelayMs_ <= 0 )
+		{
+			strand_.post( boost::bind(&CNetPeerSession::_handle_flush, shared_from_this()) );
+			return;
+		}
+
+		flush_timer_.expires_from_now( boost::posix_time::milliseconds( writeDelayMs_ ) );
+		flush_timer_.async_wait( strand_.wrap( boost::bind(&CNetPeerSession::_handle_flush, shared_from_this()) ) );
+	}
+
+	void _handle_flush()
+	{
+		bool failed = false;
+		{
+			boost::recursive_mutex::scoped_lock autolock(mutex_);
+
+			flushPending_ = false;
+			if( !writing_ )
+				failed = !_start_write();
+		}
+
+		if( failed )
+			close();
 	}
 
-	void _start_write()
+	// false : the stream compression failed
+	bool _start_write()
 	{
 		boost::recursive_mutex::scoped_lock autolock(mutex_);
 
 		if( write_buffer_list_.empty() )
-			return;
+			return true;
 
-		boost::shared_ptr<CNetPacketData> packet = write_buffer_list_.front();
+		// gather the queued packets into one buffer sequence. (writev, no staging copy)
+		// the packets stay in the queue until they are sent, so the gathered memory is alive during the write.
+		curr_write_buffers_.clear();
 
-		int readSize = packet->buffer().read( curr_write_buffer_, _BUF_SIZE );
-		assert( readSize > 0 );
+		size_t batchSize = 0;
+		inflightCount_ = 0;
+		std::deque< boost::shared_ptr<CNetPacketData> >::iterator it = write_buffer_list_.begin();
+		for( ; it != write_buffer_list_.end(); it++ )
+		{
+			if( batchSize >= writeBatchSize_ || curr_write_buffers_.size() >= _MAX_WRITE_BUFFERS )
+				break;
+
+			// into the deflate stream in the queue order, once it can not be dropped anymore.
+			if( (*it)->isCompressPending() )
+			{
+				PAYLOAD_PTR wire = compressor_->compress( (*it)->payload() );
+				if( !wire )
+					return false;
+				(*it)->setWirePayload( wire );
+			}
+
+			batchSize += (*it)->gather( curr_write_buffers_, writeBatchSize_ - batchSize, _MAX_WRITE_BUFFERS );
+			inflightCount_++;
+		}
+		assert( batchSize > 0 );
 
+		writing_ = true;
 		boost::asio::async_write(clientsocket_,
-			boost::asio::buffer(curr_write_buffer_, readSize),
-			boost::bind(&CNetPeerSession::_handle_write,
+			curr_write_buffers_,
+			strand_.wrap( boost::bind(&CNetPeerSession::_handle_write,
 			shared_from_this(),
-			boost::asio::placeholders::error));
+			boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred) ));
+		return true;
 	}
 
 	void _handle_connect(const boost::system::error_code& ec,
@@ -215,7 +436,7 @@ public:
 		// the asynchronous read operation has now completed or failed and returned an error
 		if( !error )
 		{ 
-			fireReceivedEvent( read_buffer_, bytes_transferred );
+			fireReceivedEvent( bytes_transferred );
 
 			// read completed, so process the data
 			_start_read(); // start waiting for another asynchronous read again
@@ -224,23 +445,57 @@ public:
 			close();
 	}
 
-	void _handle_write( const boost::system::error_code& ec )
+	void _handle_write( const boost::system::error_code& ec, size_t bytes_transferred )
 	{
 		// the asynchronous read operation has now completed or failed and returned an error
 		if(!ec)
 		{
-			boost::shared_ptr<CNetPacketData> packet = write_buffer_list_.front();
-
-			fireSendingEvent( packet );
+			std::vector< boost::shared_ptr<CNetPacketData> > progressList;
+			bool failed = false;
+			bool congestionChanged = false;
+			bool congested = false;
 
 			mutex_.lock();
-			if(packet->buffer().remainingSize() <= 0)
+			writing_ = false;
+
+			// a batch may finish several packets and stop in the middle of the last one.
+			while( bytes_transferred > 0 && !write_buffer_list_.empty() )
+			{
+				boost::shared_ptr<CNetPacketData> packet = write_buffer_list_.front();
+				bytes_transferred -= packet->consume( bytes_transferred );
+
+				bool done = packet->remainingSize() <= 0;
+				if( done || packet->sentSize() - packet->notifiedSize() >= sendingEventGranularity_ )
+				{
+					packet->setNotifiedSize( packet->sentSize() );
+					progressList.push_back( packet );
+				}
+
+				if( !done )
+					break;
 				write_buffer_list_.pop_front();
+				queuedBytes_ -= packet->totalSize();
+				if( isOversized( packet ) )
+					oversizedBytes_ -= packet->totalSize();
+			}
+			inflightCount_ = 0;
 			
-			// write completed, so send next write data
+			// write completed, so send next write data. (the packets queued during the write are a batch already)
 			if( !write_buffer_list_.empty() ) // if there is anthing left to be written
-				_start_write(); // then start sending the next item in the buffer
+				failed = !_start_write(); // then start sending the next item in the buffer
+
+			congestionChanged = updateCongestion();
+			congested = congested_;
 			mutex_.unlock();
+
+			for( size_t i = 0; i < progressList.size(); i++ )
+				fireSendingEvent( progressList[i] );
+
+			if( congestionChanged )
+				fireSendQueueEvent( congested );
+
+			if( failed )
+				close();
 		}
 		else
 			close();
@@ -268,6 +523,75 @@ public:
 	}
 
 private:
+	// (under mutex_)
+	bool isOversized( const boost::shared_ptr<CNetPacketData> &packet )
+	{
+		return packet->totalSize() > sendQueueBytes_;
+	}
+
+	// the bytes waiting behind the head packet, without the oversized ones.
+	bool isOverLimit( void )
+	{
+		if( write_buffer_list_.size() <= 1 )
+			return false;
+
+		size_t waitingBytes = queuedBytes_ - oversizedBytes_;
+		const boost::shared_ptr<CNetPacketData> &head = write_buffer_list_.front();
+		if( !isOversized( head ) )
+			waitingBytes -= head->totalSize();
+
+		return waitingBytes > sendQueueBytes_ || write_buffer_list_.size() > sendQueuePackets_;
+	}
+
+	// true : congested_ changed
+	bool updateCongestion( void )
+	{
+		size_t packets = write_buffer_list_.size();
+		bool congested = congested_;
+
+		if( !congested_ )
+			congested = queuedBytes_ >= sendQueueBytes_ / CongestionDivisor || packets >= sendQueuePackets_ / CongestionDivisor;
+		else
+			congested = queuedBytes_ >= sendQueueBytes_ / CongestionDivisor / 2 || packets >= sendQueuePackets_ / CongestionDivisor / 2;
+
+		if( congested == congested_ )
+			return false;
+
+		congested_ = congested;
+		return true;
+	}
+
+	// drop the queued states a later packet of the same key replaces. (key empty : of every key)
+	// with a key, the packet of the key is not queued yet, every queued one of the key goes.
+	// the packets of the current write and a partly sent one stay.
+	void dropSuperseded( const std::string &key, std::vector< boost::shared_ptr<CNetPacketData> > &droppedList )
+	{
+		std::set< std::string > later;
+		if( !key.empty() )
+			later.insert( key );
+
+		std::deque< boost::shared_ptr<CNetPacketData> > kept;
+		for( size_t i = write_buffer_list_.size(); i > 0; i-- )
+		{
+			boost::shared_ptr<CNetPacketData> packet = write_buffer_list_[i - 1];
+			const std::string &packetKey = packet->supersedeKey();
+
+			bool droppable = i - 1 >= inflightCount_ && !packet->isSending() && !packetKey.empty()
+				&& ( key.empty() || packetKey == key );
+			if( droppable && !later.insert( packetKey ).second )
+			{
+				packet->drop();
+				queuedBytes_ -= packet->totalSize();
+				if( isOversized( packet ) )
+					oversizedBytes_ -= packet->totalSize();
+				droppedList.push_back( packet );
+				continue;
+			}
+			kept.push_front( packet );
+		}
+		write_buffer_list_.swap( kept );
+	}
+
 	void fireDisconnectedEvent( void )
 	{
 		if( evtTarget_ )
@@ -292,12 +616,11 @@ private:
 		}
 	}
 
-	void fireReceivedEvent( const char * buffer, size_t len )
+	void fireReceivedEvent( size_t len )
 	{
-		if( evtTarget_ )
+		if( evtTarget_ && read_target_.slab )
 		{
-			std::string tempbuffer( buffer, len );
-			evtTarget_->onINetPeerSessionEvent_Received( this, tempbuffer );
+			evtTarget_->onINetPeerSessionEvent_Received( this, read_target_, len );
 		}
 	}
 
@@ -309,10 +632,20 @@ private:
 		}
 	}
 
+	void fireSendQueueEvent( bool congested )
+	{
+		if( evtTarget_ )
+		{
+			evtTarget_->onINetPeerSessionEvent_SendQueue( this, congested );
+		}
+	}
+
 private:
 	static const int _BUF_SIZE = 4096;
+	static const size_t _MAX_WRITE_BUFFERS = 64;	// keep a batch under IOV_MAX
 
 	boost::asio::io_service& io_service_;
+	boost::asio::io_service::strand strand_;	// the handlers of this session, one at a time
 	int sessionId_;
 	bool stopped_;
 	bool connected_;
@@ -321,9 +654,28 @@ private:
 	boost::asio::ip::tcp::socket clientsocket_;
 	boost::asio::deadline_timer deadline_;
 
-	char read_buffer_[_BUF_SIZE];
+	// write batching (under mutex_)
+	boost::asio::deadline_timer flush_timer_;
+	bool writing_;			// an async_write is in progress
+	bool flushPending_;
+	int writeDelayMs_;
+
+	char read_buffer_[_BUF_SIZE];	// used only when there is no read target
+	CIOBuffer::Segment read_target_;
 	std::deque< boost::shared_ptr<CNetPacketData> > write_buffer_list_;
 
-	char curr_write_buffer_[_BUF_SIZE];
+	std::vector< boost::asio::const_buffer > curr_write_buffers_;
+	size_t writeBatchSize_;
+	size_t sendingEventGranularity_;
+
+	// send queue limit (under mutex_)
+	size_t sendQueueBytes_;
+	size_t sendQueuePackets_;
+	int sendQueuePolicy_;
+	size_t queuedBytes_;
+	size_t oversizedBytes_;	// of the packets bigger than sendQueueBytes_ (isOversized)
+	size_t inflightCount_;	// the packets in the current write
+	bool congested_;
+	boost::shared_ptr<CStreamCompressor> compressor_;
 	boost::recursive_mutex mutex_;
 };
@@ -0,0 +1,35 @@
+#include "StdAfx.h"
+#include "NetServiceRunner.h"
+#ifdef Q_OS_WIN
+#include <windows.h>
+#elif defined(Q_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static boost::mutex sessionIdMutex;
+static int sessionIdPool = 0;
+
+int CNetServiceRunner::newSessionId( void )
+{
+	// the accept handlers of the pool threads ask at the same time.
+	boost::mutex::scoped_lock autolock( sessionIdMutex );
+	return sessionIdPool++;
+}
+
+void CNetServiceRunner::pinCurrentThread( int core )
+{
+	if( core < 0 )
+		return;
+
+#ifdef Q_OS_WIN
+	if( core < (int)sizeof(DWORD_PTR) * 8 )
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)1 << core );
+#elif defined(Q_OS_LINUX)
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	CPU_SET( core, &cpus );
+	pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus );
+#endif
+	// no affinity elsewhere, the thread runs on any core.
+}
@@ -1,57 +1,80 @@
 #pragma once
 
-#include <boost/thread.hpp>  
+#include <boost/thread.hpp>
 #include <boost/asio.hpp>
 
+//---------------------------------------------
+// CNetServiceRunner : the io_service of all the sockets, run by a pool of threads
+//---------------------------------------------
+//
+// any thread of the pool runs any handler. the handlers of one session run one at a time
+// on the strand of the session (see CNetPeerSession), so the sessions run in parallel.
+// the pool starts with the first socket, setThreadCount() is read then.
+//
+
 class CNetServiceRunner
 {
 public:
+	static const int MaxThreadCount = 32;
 
-	CNetServiceRunner(void) : stopped_(true), threadStarted_(false), idle_timer_(io_service_)
+	CNetServiceRunner(void) : threadCount_(0), pinThreads_(false), threadStarted_(false)
 	{
-		startIdleTimer();
 	}
 
 	~CNetServiceRunner(void)
 	{
+		close();
 	}
 
-	boost::asio::io_service& io_service( void ) { return io_service_; }
-
-	boost::shared_ptr<CNetPeerSession> newSession( void )
+	// count 0 : one thread per core.
+	// pinThreads : the n-th thread runs on the n-th core only. (a relay server which owns the machine)
+	void setThreadCount( int count, bool pinThreads = false )
 	{
-		boost::shared_ptr<CNetPeerSession> session = boost::shared_ptr<CNetPeerSession>(new CNetPeerSession( io_service_, newSessionId() ));
-		
-		return session;
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+
+		threadCount_ = count;
+		pinThreads_ = pinThreads;
 	}
 
-	void close( void )
+	int threadCount( void )
 	{
-		mutex_.lock();
-		stopped_ = true;
-		mutex_.unlock();
-
-		io_service_.stop();
-		idle_timer_.cancel();
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
 
-		_stop_thread();
+		int count = threadCount_;
+		if( count <= 0 )
+			count = (int)boost::thread::hardware_concurrency();
+		if( count < 1 )
+			count = 1;
+		if( count > MaxThreadCount )
+			count = MaxThreadCount;
+		return count;
 	}
 
-	void startIdleTimer( void )
+	boost::asio::io_service& io_service( void )
 	{
-		idle_timer_.expires_from_now(boost::posix_time::seconds(1));
-		idle_timer_.async_wait( boost::bind(&CNetServiceRunner::_handle_idle_timer, this) );
-		
 		_start_thread();
+		return io_service_;
 	}
-public:
-	static int newSessionId( void )
+
+	boost::shared_ptr<CNetPeerSession> newSession( void )
+	{
+		boost::shared_ptr<CNetPeerSession> session = boost::shared_ptr<CNetPeerSession>(new CNetPeerSession( io_service(), newSessionId() ));
+
+		return session;
+	}
+
+	void close( void )
 	{
-		static int sessionIdPool = 0;
-		return sessionIdPool++;
+		_stop_thread();
 	}
 
+public:
+	static int newSessionId( void );
+
 private:
+	// core < 0 : any core
+	static void pinCurrentThread( int core );
+
 	void _start_thread( void )
 	{
 		boost::recursive_mutex::scoped_lock autolock(mutex_);
@@ -59,55 +82,54 @@ private:
 		if( threadStarted_ )
 			return;
 
-		stopped_ = false;
 		threadStarted_ = true;
 
-		thread_ = boost::thread(boost::bind(&CNetServiceRunner::_threadMain, this));
+		// the pool runs until close(), with or without sockets.
+		io_service_.reset();
+		work_.reset( new boost::asio::io_service::work( io_service_ ) );
+
+		int count = threadCount();
+		int cores = (int)boost::thread::hardware_concurrency();
+		for( int i = 0; i < count; i++ )
+		{
+			int core = ( pinThreads_ && cores > 0 ) ? i % cores : -1;
+			threads_.create_thread( boost::bind(&CNetServiceRunner::_threadMain, this, core) );
+		}
 	}
 
 	void _stop_thread( void )
 	{
+		boost::recursive_mutex::scoped_lock autolock(mutex_);
+
 		if( !threadStarted_ )
 			return;
 
-		thread_.join();
+		work_.reset();
+		io_service_.stop();
+
+		threads_.join_all();
 
-		mutex_.lock();
 		threadStarted_ = false;
-		mutex_.unlock();
 	}
 
-	void _threadMain( void )
+	void _threadMain( int core )
 	{
-		if( stopped_ )
-			return;
+		pinCurrentThread( core );
+
+		qDebug() << "IO Thread Started" << core;
 
-		qDebug() << "IO Thread Started";
-	
 		io_service_.run();
 
 		qDebug() << "IO Thread Finished";
-
-		mutex_.lock();
-		threadStarted_ = false;
-		mutex_.unlock();
 	}
 
-	void _handle_idle_timer()
-	{
-		if( stopped_ )
-			return;
-
-		startIdleTimer();
-	}
-
-
 private:
-	volatile bool stopped_;
-	volatile bool threadStarted_;
+	int threadCount_;
+	bool pinThreads_;
+	bool threadStarted_;
 
-	boost::thread thread_;
+	boost::thread_group threads_;
 	boost::asio::io_service io_service_;
-	boost::asio::deadline_timer idle_timer_;
+	boost::scoped_ptr< boost::asio::io_service::work > work_;
 	boost::recursive_mutex mutex_;
 };
@@ -110,6 +110,18 @@ void CPacketBuffer::clear() {
 	buffer_.clear();
 }
 
+// drop the already read bytes from the front of the buffer.
+void CPacketBuffer::compact() {
+	boost::recursive_mutex::scoped_lock autolock( lock_ );
+	if(readPos_ <= 0)
+		return;
+	if(readPos_ >= (int)buffer_.size())
+		buffer_.clear();
+	else
+		buffer_.erase(0, readPos_);
+	readPos_ = 0;
+}
+
 void CPacketBuffer::rewind(size_t size) {
 	boost::recursive_mutex::scoped_lock autolock( lock_ );
 	int temp = readPos_ - size;
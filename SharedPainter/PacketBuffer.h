@@ -274,6 +274,251 @@ public:
 };
 
 
+//---------------------------------------------
+// CPacketWriter : exact-size, append-only packet writer
+//---------------------------------------------
+//
+// The caller computes the encoded size first (sizeXXX helpers),
+// the whole packet is allocated once and every field is appended in place.
+// Always little endian like the rest of the packet code.
+//
+
+class CPacketWriter
+{
+public:
+	static const int HeaderSize = 7;	// | 1byte magic | 2byte code | 4byte bodylen |
+
+	// header + body packet
+	CPacketWriter( boost::int16_t code, size_t bodySize ) : pos_(0), failed_(false)
+	{
+		buf_.resize( HeaderSize + bodySize );
+		makeHeader( claim( HeaderSize ), code, bodySize );
+	}
+
+	// body only
+	explicit CPacketWriter( size_t size ) : pos_(0), failed_(false)
+	{
+		buf_.resize( size );
+	}
+
+	static void makeHeader( char *out, boost::int16_t code, size_t bodySize )
+	{
+		boost::int32_t len = (boost::int32_t)bodySize;
+		out[0] = (char)NET_MAGIC_CODE;
+		memcpy( out + 1, &code, 2 );
+		memcpy( out + 3, &len, 4 );
+	}
+
+	static size_t sizeString8( const std::string &value ) { return 1 + value.size(); }
+	static size_t sizeString16( const std::string &value ) { return 2 + value.size(); }
+	static size_t sizeString32( const std::string &value ) { return 4 + value.size(); }
+	static size_t sizeString32( size_t size ) { return 4 + size; }
+
+	void writeInt8( boost::int8_t value ) { append( &value, 1 ); }
+	void writeInt16( boost::int16_t value ) { append( &value, 2 ); }
+	void writeInt32( boost::int32_t value ) { append( &value, 4 ); }
+	void writeDouble( double value ) { append( &value, 8 ); }
+	void writeBinary( const void *data, size_t size ) { append( data, size ); }
+
+	void writeString8( const std::string &value )
+	{
+		if( value.size() > 0xff )
+			throw CPacketException("the string size is bigger than 1byte length..");
+		writeInt8( (boost::int8_t)value.size() );
+		append( value.c_str(), value.size() );
+	}
+
+	void writeString16( const std::string &value )
+	{
+		if( value.size() > 0xffff )
+			throw CPacketException("the string size is bigger than 2byte length..");
+		writeInt16( (boost::int16_t)value.size() );
+		append( value.c_str(), value.size() );
+	}
+
+	void writeString32( const std::string &value )
+	{
+		writeString32( value.c_str(), value.size() );
+	}
+
+	void writeString32( const void *data, size_t size )
+	{
+		writeInt32( (boost::int32_t)size );
+		append( data, size );
+	}
+
+	// hand out the next size bytes to be filled directly. (e.g. QIODevice::read)
+	char * claim( size_t size )
+	{
+		if( pos_ + size > buf_.size() )
+			throw CPacketException("packet writer overflow..");
+		char *ptr = &buf_[pos_];
+		pos_ += size;
+		return ptr;
+	}
+
+	// mark the packet broken. detach() gives an empty string.
+	void setFailed( void ) { failed_ = true; }
+	bool failed( void ) const { return failed_; }
+
+	size_t size( void ) const { return pos_; }
+
+	// give the buffer away without copying it.
+	void detach( std::string &out )
+	{
+		assert( failed_ || pos_ == buf_.size() );
+		out.clear();
+		if( !failed_ )
+			out.swap( buf_ );
+		buf_.clear();
+		pos_ = 0;
+	}
+
+	std::string packet( void )
+	{
+		std::string res;
+		detach( res );
+		return res;
+	}
+
+private:
+	void append( const void *data, size_t size )
+	{
+		if( size <= 0 )
+			return;
+		memcpy( claim( size ), data, size );
+	}
+
+private:
+	std::string buf_;
+	size_t pos_;
+	bool failed_;
+};
+
+
+//---------------------------------------------
+// CPacketView : read-only view of packet bytes
+//---------------------------------------------
+//
+// Does not own the bytes. The viewed buffer must outlive the view.
+//
+
+class CPacketView
+{
+public:
+	CPacketView( void ) : data_(NULL), size_(0) { }
+	CPacketView( const char *data, size_t size ) : data_(data), size_(size) { }
+	CPacketView( const std::string &str ) : data_(str.c_str()), size_(str.size()) { }
+
+	const char * data( void ) const { return data_; }
+	size_t size( void ) const { return size_; }
+	bool empty( void ) const { return size_ <= 0; }
+
+	std::string str( void ) const { return std::string( data_, size_ ); }
+
+private:
+	const char *data_;
+	size_t size_;
+};
+
+
+//---------------------------------------------
+// CPacketReader : bounds-checked packet reader
+//---------------------------------------------
+//
+// Never throws. The first short read marks the reader failed and every
+// read after it fails too, so a decoder can read all fields in a row
+// and check failed() once at the end.
+// Strings are returned as views into the packet, not copied.
+//
+
+class CPacketReader
+{
+public:
+	explicit CPacketReader( const CPacketView &packet ) : data_(packet.data()), size_(packet.size()), pos_(0), failed_(false) { }
+
+	bool readInt8( boost::int8_t &value ) { return load( &value, 1 ); }
+	bool readInt16( boost::int16_t &value ) { return load( &value, 2 ); }
+	bool readInt32( boost::int32_t &value ) { return load( &value, 4 ); }
+	bool readDouble( double &value ) { return load( &value, 8 ); }
+
+	bool readString8( CPacketView &value )
+	{
+		boost::uint8_t len = 0;
+		if( !load( &len, 1 ) )
+			return false;
+		return readBinary( len, value );
+	}
+
+	bool readString16( CPacketView &value )
+	{
+		boost::uint16_t len = 0;
+		if( !load( &len, 2 ) )
+			return false;
+		return readBinary( len, value );
+	}
+
+	bool readString32( CPacketView &value )
+	{
+		boost::uint32_t len = 0;
+		if( !load( &len, 4 ) )
+			return false;
+		return readBinary( len, value );
+	}
+
+	bool readBinary( size_t size, CPacketView &value )
+	{
+		if( !require( size ) )
+			return false;
+		value = CPacketView( data_ + pos_, size );
+		pos_ += size;
+		return true;
+	}
+
+	bool skip( size_t size )
+	{
+		if( !require( size ) )
+			return false;
+		pos_ += size;
+		return true;
+	}
+
+	// fail now if less than size bytes are left. (ex: before a counted array)
+	bool require( size_t size )
+	{
+		if( failed_ || size_ - pos_ < size )
+		{
+			failed_ = true;
+			return false;
+		}
+		return true;
+	}
+
+	void setFailed( void ) { failed_ = true; }
+	bool failed( void ) const { return failed_; }
+
+	size_t position( void ) const { return pos_; }
+	size_t remaining( void ) const { return size_ - pos_; }
+	CPacketView rest( void ) const { return CPacketView( data_ + pos_, size_ - pos_ ); }
+
+private:
+	bool load( void *value, size_t size )
+	{
+		if( !require( size ) )
+			return false;
+		memcpy( value, data_ + pos_, size );
+		pos_ += size;
+		return true;
+	}
+
+private:
+	const char *data_;
+	size_t size_;
+	size_t pos_;
+	bool failed_;
+};
+
+
 class CPacketBuffer 
 {
 public:
@@ -509,6 +754,7 @@ public:
 	std::string toStringFromCurrentPtr();
 
 	void clear();
+	void compact();
 	void rewind(size_t size);
 	void fastforward(size_t size);
 
@@ -12,5 +12,38 @@ enum SharedPaintCodeType {
 	CODE_SYSTEM_JOIN,
 	CODE_SYSTEM_LEFT,
 	CODE_BROAD_SERVER_INFO,
+	CODE_PAINT_ADD_LINE_COMPACT,	// new codes are appended, the old values must not move.
+	CODE_PAINT_STROKE_BEGIN,
+	CODE_PAINT_STROKE_APPEND,
+	CODE_PAINT_STROKE_END,
+	CODE_SYSTEM_STREAM_COMPRESSION,
+	CODE_PAINT_SET_BG_IMAGE_DELTA,
+	CODE_FILE_BEGIN,
+	CODE_FILE_REQUEST,
+	CODE_FILE_CHUNK,
+	CODE_FILE_ACK,
+	CODE_FILE_END,
 	CODE_MAX,
 };
+
+// set on the code of a packet whose body is compressed. (see CPacketCompressor)
+#define CODE_FLAG_COMPRESSED	0x4000
+
+// a code below it is a packet. one this peer does not know (from a newer peer) is skipped,
+// and a server relays it as it is. an old peer, which announces no capability, takes any code
+// over its CODE_MAX for a broken stream, the server does not relay such a code to it.
+#define CODE_LIMIT				0x1000
+
+// the features a peer announces in CODE_SYSTEM_JOIN.
+// an old peer announces nothing and gets the legacy packets only.
+enum SharedPaintCapability {
+	CAPABILITY_COMPACT_STROKE = 0x01,
+	CAPABILITY_CURVE_STROKE = 0x02,	// a compact line may be a bezier curve
+	CAPABILITY_LIVE_STROKE = 0x04,	// in-progress strokes (CODE_PAINT_STROKE_*)
+	CAPABILITY_COMPRESSION = 0x08,	// CODE_FLAG_COMPRESSED
+	CAPABILITY_STREAM_COMPRESSION = 0x10,	// CODE_SYSTEM_STREAM_COMPRESSION
+	CAPABILITY_BG_IMAGE_DELTA = 0x20,	// CODE_PAINT_SET_BG_IMAGE_DELTA
+	CAPABILITY_FILE_STREAM = 0x40,	// CODE_FILE_* (see FileTransfer.h)
+};
+
+#define SUPPORTED_CAPABILITIES	(CAPABILITY_COMPACT_STROKE | CAPABILITY_CURVE_STROKE | CAPABILITY_LIVE_STROKE | CAPABILITY_COMPRESSION | CAPABILITY_STREAM_COMPRESSION | CAPABILITY_BG_IMAGE_DELTA | CAPABILITY_FILE_STREAM)
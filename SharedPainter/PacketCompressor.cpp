@@ -0,0 +1,138 @@
+#include "StdAfx.h"
+#include "PacketCompressor.h"
+#include "PacketCodeDefine.h"
+
+#define SIGNATURE_SCAN_SIZE		512		// the item fields before a file body are shorter than this
+
+struct SSignature
+{
+	const char *bytes;
+	size_t size;
+};
+
+static const SSignature COMPRESSED_SIGNATURES[] = {
+	{ "\x89PNG\r\n\x1a\n", 8 },
+	{ "\xff\xd8\xff", 3 },			// jpeg
+	{ "GIF8", 4 },
+	{ "PK\x03\x04", 4 },			// zip, docx, jar ...
+	{ "\x1f\x8b\x08", 3 },			// gzip
+	{ "7z\xbc\xaf\x27\x1c", 6 },
+	{ "Rar!\x1a\x07", 6 },
+};
+
+bool CPacketCompressor::looksCompressed( const char *data, size_t size )
+{
+	if( size > SIGNATURE_SCAN_SIZE )
+		size = SIGNATURE_SCAN_SIZE;
+
+	for( size_t i = 0; i < sizeof(COMPRESSED_SIGNATURES) / sizeof(COMPRESSED_SIGNATURES[0]); i++ )
+	{
+		const SSignature &sig = COMPRESSED_SIGNATURES[i];
+		for( size_t pos = 0; pos + sig.size <= size; pos++ )
+		{
+			const char *found = (const char *)memchr( data + pos, sig.bytes[0], size - pos - sig.size + 1 );
+			if( !found )
+				break;
+
+			pos = found - data;
+			if( memcmp( found, sig.bytes, sig.size ) == 0 )
+				return true;
+		}
+	}
+	return false;
+}
+
+struct SCompressedPacket
+{
+	size_t offset;
+	size_t bodySize;
+	boost::int16_t code;
+	QByteArray body;
+};
+
+PAYLOAD_PTR CPacketCompressor::compress( const CIOBuffer &packets, size_t threshold )
+{
+	std::vector<SCompressedPacket> compressedList;
+
+	// 1st : compress the large bodies
+	size_t offset = 0;
+	std::string body;
+	while( offset + CPacketWriter::HeaderSize <= packets.size() )
+	{
+		char header[CPacketWriter::HeaderSize];
+		packets.copyOut( offset, header, sizeof(header) );
+
+		boost::int16_t code;
+		boost::int32_t bodyLen;
+		memcpy( &code, header + 1, 2 );
+		memcpy( &bodyLen, header + 3, 4 );
+		if( (boost::uint8_t)header[0] != NET_MAGIC_CODE || bodyLen < 0 || offset + CPacketWriter::HeaderSize + bodyLen > packets.size() )
+			return PAYLOAD_PTR();	// not a packet list
+
+		size_t bodyOffset = offset + CPacketWriter::HeaderSize;
+		offset = bodyOffset + bodyLen;
+
+		if( (size_t)bodyLen < threshold || (code & CODE_FLAG_COMPRESSED) )
+			continue;
+
+		body.resize( bodyLen );
+		packets.copyOut( bodyOffset, &body[0], bodyLen );
+		if( looksCompressed( body.data(), body.size() ) )
+			continue;
+
+		SCompressedPacket c;
+		c.offset = bodyOffset - CPacketWriter::HeaderSize;
+		c.bodySize = bodyLen;
+		c.code = code;
+		c.body = qCompress( (const uchar *)body.data(), bodyLen, CompressLevel );
+		if( c.body.isEmpty() || (size_t)c.body.size() > c.bodySize - c.bodySize / 8 )
+			continue;
+
+		compressedList.push_back( c );
+	}
+
+	if( compressedList.empty() )
+		return PAYLOAD_PTR();
+
+	// 2nd : the untouched ranges share the slabs of the original, the compressed bodies are appended.
+	boost::shared_ptr<CIOBuffer> res( new CIOBuffer );
+	size_t copied = 0;
+	for( size_t i = 0; i < compressedList.size(); i++ )
+	{
+		const SCompressedPacket &c = compressedList[i];
+
+		CIOBuffer rest( packets );
+		rest.trimFront( copied );
+		res->append( rest.splitAt( c.offset - copied ) );
+
+		char header[CPacketWriter::HeaderSize];
+		CPacketWriter::makeHeader( header, c.code | CODE_FLAG_COMPRESSED, c.body.size() );
+		res->append( header, sizeof(header) );
+		res->append( c.body.constData(), c.body.size() );
+
+		copied = c.offset + CPacketWriter::HeaderSize + c.bodySize;
+	}
+
+	CIOBuffer rest( packets );
+	rest.trimFront( copied );
+	res->append( rest );
+	return res;
+}
+
+bool CPacketCompressor::decompress( const char *body, size_t size, size_t maxSize, std::string &res )
+{
+	if( size < 4 )
+		return false;
+
+	const boost::uint8_t *p = (const boost::uint8_t *)body;
+	size_t rawSize = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+	if( rawSize > maxSize )
+		return false;
+
+	QByteArray raw = qUncompress( (const uchar *)body, (int)size );
+	if( (size_t)raw.size() != rawSize )
+		return false;
+
+	res.assign( raw.constData(), raw.size() );
+	return true;
+}
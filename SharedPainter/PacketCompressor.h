@@ -0,0 +1,34 @@
+#pragma once
+
+#include "PacketBuffer.h"
+#include "NetPacketData.h"
+
+//---------------------------------------------
+// per packet body compression
+//---------------------------------------------
+//
+// | magic | code | CODE_FLAG_COMPRESSED | bodylen | qCompress( body ) |
+//
+// qCompress() output is a 4byte big endian raw size and a zlib stream (level 1, fast).
+// Only a body bigger than the threshold is tried, a body which already holds
+// compressed data (png, jpeg, zip ...) is skipped, and a body is sent raw unless
+// the compression saves 1/8 of it at least.
+// Sent only to the peers with CAPABILITY_COMPRESSION. CPacketSlicer restores the body.
+//
+
+class CPacketCompressor
+{
+public:
+	static const size_t DefaultThreshold = 4 * 1024;
+	static const int CompressLevel = 1;
+
+	// the packets (one or more) with the large bodies compressed.
+	// returns NULL if no packet got smaller, so the caller keeps the original.
+	static PAYLOAD_PTR compress( const CIOBuffer &packets, size_t threshold = DefaultThreshold );
+
+	// the raw body of a compressed body. a raw size bigger than maxSize is rejected before decoding.
+	static bool decompress( const char *body, size_t size, size_t maxSize, std::string &res );
+
+	// an image or an archive near the front of the data.
+	static bool looksCompressed( const char *data, size_t size );
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "PacketBuffer.h"
+
+//---------------------------------------------
+// packet schema
+//---------------------------------------------
+//
+// A message is declared once as a list of field types.
+// The encoder and the decoder are generated from the same list.
+//
+// typedef PacketSchema::CMessage< CODE_PAINT_REMOVE_ITEM, PacketSchema::String8, PacketSchema::Int32 > Schema;
+//
+// Schema::make( owner, itemId );			// exact-size packet, "" on failure
+// Schema::parse( body, ownerView, itemId );	// bounds-checked, no exception
+//
+// Field sizes are compile-time constants (MinSize), so a truncated body
+// is rejected by one length check before any field is read.
+// Decoded strings are CPacketView, pointing into the body.
+// Trailing bytes after the last field are ignored, so a field can be
+// appended to a message without breaking older peers.
+//
+
+namespace PacketSchema
+{
+	// an unused field slot
+	struct Nil
+	{
+		typedef Nil arg_type;
+		typedef Nil value_type;
+		enum { MinSize = 0 };
+
+		static size_t size( const Nil & ) { return 0; }
+		static void write( CPacketWriter &, const Nil & ) { }
+		static bool read( CPacketReader &, Nil & ) { return true; }
+
+		static Nil & none( void ) { static Nil n; return n; }
+	};
+
+	struct Int8
+	{
+		typedef boost::int8_t arg_type;
+		typedef boost::int8_t value_type;
+		enum { MinSize = 1 };
+
+		static size_t size( arg_type ) { return MinSize; }
+		static void write( CPacketWriter &writer, arg_type value ) { writer.writeInt8( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readInt8( value ); }
+	};
+
+	struct Int16
+	{
+		typedef boost::int16_t arg_type;
+		typedef boost::int16_t value_type;
+		enum { MinSize = 2 };
+
+		static size_t size( arg_type ) { return MinSize; }
+		static void write( CPacketWriter &writer, arg_type value ) { writer.writeInt16( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readInt16( value ); }
+	};
+
+	struct Int32
+	{
+		typedef boost::int32_t arg_type;
+		typedef boost::int32_t value_type;
+		enum { MinSize = 4 };
+
+		static size_t size( arg_type ) { return MinSize; }
+		static void write( CPacketWriter &writer, arg_type value ) { writer.writeInt32( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readInt32( value ); }
+	};
+
+	struct Double
+	{
+		typedef double arg_type;
+		typedef double value_type;
+		enum { MinSize = 8 };
+
+		static size_t size( arg_type ) { return MinSize; }
+		static void write( CPacketWriter &writer, arg_type value ) { writer.writeDouble( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readDouble( value ); }
+	};
+
+	struct String8
+	{
+		typedef std::string arg_type;
+		typedef CPacketView value_type;
+		enum { MinSize = 1 };
+
+		static size_t size( const arg_type &value ) { return CPacketWriter::sizeString8( value ); }
+		static void write( CPacketWriter &writer, const arg_type &value ) { writer.writeString8( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readString8( value ); }
+	};
+
+	struct String16
+	{
+		typedef std::string arg_type;
+		typedef CPacketView value_type;
+		enum { MinSize = 2 };
+
+		static size_t size( const arg_type &value ) { return CPacketWriter::sizeString16( value ); }
+		static void write( CPacketWriter &writer, const arg_type &value ) { writer.writeString16( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readString16( value ); }
+	};
+
+	struct String32
+	{
+		typedef std::string arg_type;
+		typedef CPacketView value_type;
+		enum { MinSize = 4 };
+
+		static size_t size( const arg_type &value ) { return CPacketWriter::sizeString32( value ); }
+		static void write( CPacketWriter &writer, const arg_type &value ) { writer.writeString32( value ); }
+		static bool read( CPacketReader &reader, value_type &value ) { return reader.readString32( value ); }
+	};
+
+
+	// field list without a header. (ex: a part of a bigger body)
+	// unused trailing arguments default to Nil::none().
+	template< class F1 = Nil, class F2 = Nil, class F3 = Nil, class F4 = Nil, class F5 = Nil, class F6 = Nil >
+	class CFields
+	{
+	public:
+		enum { MinSize = F1::MinSize + F2::MinSize + F3::MinSize + F4::MinSize + F5::MinSize + F6::MinSize };
+
+		static size_t size(
+			const typename F1::arg_type &a1 = F1::none(), const typename F2::arg_type &a2 = F2::none(),
+			const typename F3::arg_type &a3 = F3::none(), const typename F4::arg_type &a4 = F4::none(),
+			const typename F5::arg_type &a5 = F5::none(), const typename F6::arg_type &a6 = F6::none() )
+		{
+			return F1::size( a1 ) + F2::size( a2 ) + F3::size( a3 ) + F4::size( a4 ) + F5::size( a5 ) + F6::size( a6 );
+		}
+
+		static void write( CPacketWriter &writer,
+			const typename F1::arg_type &a1 = F1::none(), const typename F2::arg_type &a2 = F2::none(),
+			const typename F3::arg_type &a3 = F3::none(), const typename F4::arg_type &a4 = F4::none(),
+			const typename F5::arg_type &a5 = F5::none(), const typename F6::arg_type &a6 = F6::none() )
+		{
+			F1::write( writer, a1 );
+			F2::write( writer, a2 );
+			F3::write( writer, a3 );
+			F4::write( writer, a4 );
+			F5::write( writer, a5 );
+			F6::write( writer, a6 );
+		}
+
+		// the reader is sticky on failure, so the fields are read in a row and checked once.
+		static bool read( CPacketReader &reader,
+			typename F1::value_type &v1 = F1::none(), typename F2::value_type &v2 = F2::none(),
+			typename F3::value_type &v3 = F3::none(), typename F4::value_type &v4 = F4::none(),
+			typename F5::value_type &v5 = F5::none(), typename F6::value_type &v6 = F6::none() )
+		{
+			if( !reader.require( MinSize ) )
+				return false;
+
+			F1::read( reader, v1 );
+			F2::read( reader, v2 );
+			F3::read( reader, v3 );
+			F4::read( reader, v4 );
+			F5::read( reader, v5 );
+			F6::read( reader, v6 );
+			return !reader.failed();
+		}
+	};
+
+
+	// header + field list
+	template< boost::int16_t Code, class F1 = Nil, class F2 = Nil, class F3 = Nil, class F4 = Nil, class F5 = Nil, class F6 = Nil >
+	class CMessage : public CFields< F1, F2, F3, F4, F5, F6 >
+	{
+	public:
+		typedef CFields< F1, F2, F3, F4, F5, F6 > fields_type;
+
+		static std::string make(
+			const typename F1::arg_type &a1 = F1::none(), const typename F2::arg_type &a2 = F2::none(),
+			const typename F3::arg_type &a3 = F3::none(), const typename F4::arg_type &a4 = F4::none(),
+			const typename F5::arg_type &a5 = F5::none(), const typename F6::arg_type &a6 = F6::none() )
+		{
+			try
+			{
+				CPacketWriter writer( Code, fields_type::size( a1, a2, a3, a4, a5, a6 ) );
+				fields_type::write( writer, a1, a2, a3, a4, a5, a6 );
+				return writer.packet();
+			}catch(...)
+			{
+				// a string too long for its length field
+			}
+			return "";
+		}
+
+		static bool parse( const CPacketView &body,
+			typename F1::value_type &v1 = F1::none(), typename F2::value_type &v2 = F2::none(),
+			typename F3::value_type &v3 = F3::none(), typename F4::value_type &v4 = F4::none(),
+			typename F5::value_type &v5 = F5::none(), typename F6::value_type &v6 = F6::none() )
+		{
+			CPacketReader reader( body );
+			return fields_type::read( reader, v1, v2, v3, v4, v5, v6 );
+		}
+	};
+};
@@ -1,7 +1,171 @@
 #include "StdAfx.h"
 #include "PacketSlicer.h"
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2_MAGIC_SCAN 1
+#endif
+
+// find the first NET_MAGIC_CODE byte in [begin, end). returns end if not found.
+static const char * findMagicByte( const char *begin, const char *end )
+{
+#ifdef USE_SSE2_MAGIC_SCAN
+	const __m128i magic = _mm_set1_epi8( (char)NET_MAGIC_CODE );
+	while( end - begin >= 16 )
+	{
+		__m128i chunk = _mm_loadu_si128( (const __m128i *)begin );
+		int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, magic ) );
+		if( mask != 0 )
+		{
+			int i = 0;
+			while( (mask & (1 << i)) == 0 )
+				i++;
+			return begin + i;
+		}
+		begin += 16;
+	}
+#endif
+	const char *found = (const char *)memchr( begin, NET_MAGIC_CODE, end - begin );
+	return found ? found : end;
+}
+
 CPacketSlicer::~CPacketSlicer(void)
 {
 }
 
+CPacketSlicer::HeaderCheckResult CPacketSlicer::checkHeader( const char *ptr, size_t size, boost::int16_t &code, boost::int32_t &bodyLen )
+{
+	// check the header fields as soon as each of them is available,
+	// so that a broken stream is detected without waiting for the whole header.
+	if( size < 1 )
+		return HEADER_NEED_MORE;
+
+	if( (boost::uint8_t)ptr[0] != NET_MAGIC_CODE )
+		return HEADER_BROKEN;
+
+	if( size < 3 )
+		return HEADER_NEED_MORE;
+
+	memcpy( &code, ptr + 1, 2 );
+	if( code < 0 || (code & ~CODE_FLAG_COMPRESSED) >= CODE_LIMIT )
+		return HEADER_BROKEN;
+
+	if( size < (size_t)HeaderSize )
+		return HEADER_NEED_MORE;
+
+	memcpy( &bodyLen, ptr + 3, 4 );
+	if( bodyLen < 0 || (size_t)bodyLen > maxBodySize_ )
+		return HEADER_BROKEN;
+
+	return HEADER_OK;
+}
+
+bool CPacketSlicer::resync( void )
+{
+	// skip the broken magic byte and jump to the next candidate.
+	// the candidate is verified again by checkHeader() in the parsing loop.
+	size_t consumed = 0;
+	for( size_t i = 0; i < buffer_.segmentCount(); i++ )
+	{
+		const CIOBuffer::Segment &seg = buffer_.segment( i );
+		const char *begin = seg.data();
+		const char *end = begin + seg.length;
+
+		const char *next = findMagicByte( i == 0 ? begin + 1 : begin, end );
+		if( next != end )
+		{
+			buffer_.trimFront( consumed + (next - begin) );
+			return true;
+		}
+		consumed += seg.length;
+	}
+
+	buffer_.clear();
+	return false;
+}
+
+CIOBuffer::Segment CPacketSlicer::prepareBuffer( void )
+{
+	size_t readSize = DefaultReadSize;
+
+	char header[HeaderSize];
+	size_t headerLen = buffer_.copyOut( 0, header, HeaderSize );
+
+	boost::int16_t code = 0;
+	boost::int32_t bodyLen = 0;
+
+	if( checkHeader( header, headerLen, code, bodyLen ) == HEADER_OK )
+	{
+		size_t packetSize = HeaderSize + bodyLen;
+		if( packetSize > buffer_.size() + readSize )
+		{
+			// only the head of this packet is buffered here (parse() took the complete ones),
+			// so moving it costs at most one small read.
+			buffer_.reserve( packetSize );
+			readSize = packetSize - buffer_.size();
+		}
+	}
+
+	return buffer_.prepare( readSize );
+}
+
+bool CPacketSlicer::parse( void )
+{
+	parsedItems_.clear();
+
+	while( true )
+	{
+		char header[HeaderSize];
+		size_t headerLen = buffer_.copyOut( 0, header, HeaderSize );
+
+		boost::int16_t code = 0;
+		boost::int32_t bodyLen = 0;
+
+		HeaderCheckResult res = checkHeader( header, headerLen, code, bodyLen );
+		if( res == HEADER_NEED_MORE )
+			break;
+
+		if( res == HEADER_BROKEN )
+		{
+			if( !resyncMode_ )
+			{
+				init();
+				return false;
+			}
+
+			if( !resync() )
+				break;
+			continue;
+		}
+
+		if( buffer_.size() < (size_t)(HeaderSize + bodyLen) )
+			break;
+
+		boost::shared_ptr<CPacketData> data = boost::shared_ptr<CPacketData>(new CPacketData);
+		data->code = code & ~CODE_FLAG_COMPRESSED;
+		data->compressed = (code & CODE_FLAG_COMPRESSED) != 0;
+
+		// the body shares the slabs of the frame.
+		data->frame = buffer_.splitAt( HeaderSize + bodyLen );
+		data->body = data->frame;
+		data->body.trimFront( HeaderSize );
+
+		if( data->compressed )
+		{
+			// the raw size is limited by maxBodySize too. a broken one is dropped, the stream is still in sync.
+			std::string raw;
+			if( !CPacketCompressor::decompress( data->body.coalesce(), data->body.size(), maxBodySize_, raw ) )
+				continue;
+
+			data->body.clear();
+			data->body.adopt( raw );
+		}
+
+		parsedItems_.push_back( data );
+
+		if( data->code == boundaryCode_ )
+			break;
+	}
+
+	return parsedItems_.size() > 0 ? true : false;
+}
@@ -4,7 +4,9 @@
 #include "PacketCodeDefine.h"
 #include "PaintItem.h"
 #include "PacketBuffer.h"
+#include "IOBuffer.h"
 #include "NetPacketData.h"
+#include "PacketCompressor.h"
 
 //---------------------------------------------
 // packet format
@@ -13,12 +15,20 @@
 // | 1byte magic | 2byte code | 4byte bodylen ||| (2byte paint type ) | body string ... |
 // <----------------- HEADER ------------------> <----------------- BODY ---------------->
 //
+// A body with CODE_FLAG_COMPRESSED in the code is restored here,
+// the parsed packet has the plain code and the raw body.
+// The packet as it came is kept too, so a server relays it without making it again.
+//
 
 class CPacketData
 {
 public:
+	CPacketData( void ) : code(0), compressed(false) { }
+
 	boost::int16_t code;
-	std::string body;
+	CIOBuffer body;		// shares the received slabs, not copied
+	CIOBuffer frame;	// | header | body | as received. (the compressed body if compressed)
+	bool compressed;
 };
 
 
@@ -26,53 +36,67 @@ class CPacketSlicer
 {
 public:
 	static const int HeaderSize = 7;
+	static const size_t DefaultMaxBodySize = 0x1312D00;	// 20MB
+	static const size_t DefaultReadSize = 16 * 1024;
 
-	enum ParsingState {
-		STATE_INIT,
-		STATE_HEADER_MAGIC,
-		STATE_HEADER_CODE,
-		STATE_HEADER_BLEN,
-		STATE_BODY
-	};
-
-	CPacketSlicer( void ) { init(); }
+	CPacketSlicer( size_t maxBodySize = DefaultMaxBodySize ) : maxBodySize_(maxBodySize), resyncMode_(true), boundaryCode_(-1) { init(); }
 
 	~CPacketSlicer(void);
 
 	void init( void )
 	{
-		state_ = STATE_HEADER_MAGIC;
 		buffer_.clear();
 		parsedItems_.clear();
 	}
 
-	const char * buffer_str( void )
+	// the body length of a header bigger than this is treated as a broken packet.
+	void setMaxBodySize( size_t size ) { maxBodySize_ = size; }
+	size_t maxBodySize( void ) { return maxBodySize_; }
+
+	// resync mode : on a broken header, skip to the next plausible header instead of dropping the whole stream.
+	void setResyncMode( bool enable ) { resyncMode_ = enable; }
+	bool isResyncMode( void ) { return resyncMode_; }
+
+	// parse() stops after a packet with this code, the bytes after it stay in the buffer.
+	// (they may be in another encoding, see takeBuffer) -1 : none
+	void setBoundaryCode( int code ) { boundaryCode_ = code; }
+	int boundaryCode( void ) { return boundaryCode_; }
+
+	// hand out the unparsed bytes.
+	CIOBuffer takeBuffer( void )
 	{
-		return (char *)buffer_.currentPtr();
+		CIOBuffer res;
+		res.swap( buffer_ );
+		return res;
 	}
 
 	size_t buffer_size( void )
 	{
-		return buffer_.totalSize();
+		return buffer_.size();
 	}
 
 	void addBuffer( const std::string & buffer )
 	{
-		buffer_.write( buffer.c_str(), buffer.size() );
+		buffer_.append( buffer );
 	}
 
 	void addBuffer( const char * buffer, size_t len )
 	{
-		std::string temp( buffer, len );
-		addBuffer( temp );
+		buffer_.append( buffer, len );
 	}
 
-	bool parse( void )
+	// the space for the next socket read, inside the slicer buffer. (received without a copy)
+	// once the header of a big packet is in, the rest of the packet is read in one piece
+	// right after the bytes received so far, so its body stays contiguous.
+	CIOBuffer::Segment prepareBuffer( void );
+
+	void commitBuffer( const CIOBuffer::Segment &prepared, size_t len )
 	{
-		parsedItems_.clear();
-		return doParse();
+		buffer_.commit( prepared, len );
 	}
 
+	bool parse( void );
+
 	size_t parsedItemCount( void )
 	{
 		return parsedItems_.size();
@@ -87,84 +111,20 @@ public:
 	}
 
 private:
-	
-	bool doParse( void )
-	{
-		try{
-			switch( state_ )
-			{
-			case STATE_INIT:
-				init();
-				state_ = STATE_HEADER_MAGIC;
-			case STATE_HEADER_MAGIC:
-				{
-					if( buffer_.remainingSize() < 1 )
-						return parsedItems_.size() > 0 ? true : false;
-
-					boost::int8_t magic = 0x0;
-					buffer_.readInt8( magic );
-
-					if( (boost::uint8_t)magic != NET_MAGIC_CODE )
-					{
-						init();
-						return false;
-					}
-				}
-				state_ = STATE_HEADER_CODE;
-			case STATE_HEADER_CODE:
-				if( buffer_.remainingSize() < 2 )
-					return parsedItems_.size() > 0 ? true : false;
-
-				buffer_.readInt16( currCode_ );
-				if( currCode_ < 0 || currCode_ >= CODE_MAX )
-				{
-					init();
-					return false;
-				}
-				state_ = STATE_HEADER_BLEN;
-			case STATE_HEADER_BLEN:
-				if( buffer_.remainingSize() < 4 )
-					return parsedItems_.size() > 0 ? true : false;
-				buffer_.readInt32( currBodyLen_ );
-
-				if( currBodyLen_ > 0x1312D00 )	// 20MB
-				{
-					init();
-					return false;
-				}
-				state_ = STATE_BODY;
-			case STATE_BODY:
-				if( buffer_.remainingSize() < currBodyLen_ )
-				{
-					return parsedItems_.size() > 0 ? true : false;
-				}
-				
-				boost::shared_ptr<CPacketData> data = boost::shared_ptr<CPacketData>(new CPacketData);
-				data->code = currCode_;
-				data->body.assign( (const char *)buffer_.basePtr() + HeaderSize, currBodyLen_ );
-
-				parsedItems_.push_back( data );
-
-				// read buffer init..
-				buffer_.erase( 0, HeaderSize + currBodyLen_ );
-				buffer_.setReadPos( 0 );
-
-				state_ = STATE_HEADER_MAGIC;
-				return doParse();
-			}
-		} catch(CPacketException &e) {
-			(void)e;
-			// nothing to do
-		}
-
-		return parsedItems_.size() > 0 ? true : false;
-	}
+	enum HeaderCheckResult {
+		HEADER_OK,
+		HEADER_NEED_MORE,
+		HEADER_BROKEN
+	};
+
+	HeaderCheckResult checkHeader( const char *ptr, size_t size, boost::int16_t &code, boost::int32_t &bodyLen );
+	bool resync( void );
 
 private:
-	CPacketBuffer buffer_;
+	CIOBuffer buffer_;
 	std::vector< boost::shared_ptr<CPacketData> > parsedItems_;
 
-	ParsingState state_;
-	boost::int16_t currCode_;
-	boost::int32_t currBodyLen_;
+	size_t maxBodySize_;
+	bool resyncMode_;
+	int boundaryCode_;
 };
@@ -1,6 +1,9 @@
 #pragma once
 
-#include "PacketBuffer.h"
+#include "PacketSchema.h"
+#include "StrokeCodec.h"
+#include "StrokeProcessor.h"
+#include "TileCodec.h"
 #include <boost/enable_shared_from_this.hpp>
 
 class CPaintItem;
@@ -91,7 +94,12 @@ public:
 	virtual void moveItem( boost::shared_ptr<CPaintItem> item, double x, double y ) = 0;
 	virtual void updateItem( boost::shared_ptr<CPaintItem> item ) = 0;
 	virtual void clearBackgroundImage( void ) = 0;
+	virtual void drawBackgroundImageTiles( boost::shared_ptr<CBackgroundImageItem> image, const std::vector<QRect> &rects ) = 0;	// the rest is unchanged
 	virtual void clearScreen( void ) = 0;
+
+	// in-progress stroke of other user. (a preview, removed when the stroke ends)
+	virtual void drawLiveStroke( const std::string &owner, int itemId, const QColor &clr, int width, const std::vector<QPointF> &points ) = 0;
+	virtual void removeLiveStroke( const std::string &owner, int itemId ) = 0;
 };
 
 struct SPaintData
@@ -109,7 +117,7 @@ class CPaintItem : public boost::enable_shared_from_this<CPaintItem>
 public:
 	CPaintItem( void ) : canvas_(NULL)
 		, object_(NULL), mine_(false)
-		, packetId_(-1), wroteBytes_(0), totalBytes_(0) 
+		, packetId_(-1), wroteBytes_(0), totalBytes_(0), encodingVersion_(0) 
 	{
 		data_.posX = 0.f;
 		data_.posY = 0.f;
@@ -133,7 +141,7 @@ public:
 	struct SPaintData &data( void) { return data_; }
 	struct SPaintData &prevData( void) { return prevData_; }
 	
-	void setData( const struct SPaintData &data ) { prevData_ = data_; data_ = data; }
+	void setData( const struct SPaintData &data ) { prevData_ = data_; data_ = data; invalidateEncoding(); }
 
 	bool isAvailablePosition( void ) { return data_.posSetFlag; }
 	double posX( void ) { return data_.posX; }
@@ -147,14 +155,15 @@ public:
 		data_.posX = x;
 		data_.posY = y;
 		data_.posSetFlag = true;
+		invalidateEncoding();
 	}
-	void setScale( double scale ) { prevData_.scale = data_.scale; data_.scale = scale; }
+	void setScale( double scale ) { prevData_.scale = data_.scale; data_.scale = scale; invalidateEncoding(); }
 	double scale( void ) { return data_.scale; }
 
-	void setOwner( const std::string &owner ) { data_.owner = prevData_.owner = owner; }
+	void setOwner( const std::string &owner ) { data_.owner = prevData_.owner = owner; invalidateEncoding(); }
 	const std::string & owner() const { return data_.owner; }
 
-	void setItemId( int itemId ) { data_.itemId = prevData_.itemId = itemId; }
+	void setItemId( int itemId ) { data_.itemId = prevData_.itemId = itemId; invalidateEncoding(); }
 	int itemId() const { return data_.itemId; }
 	void setMyItem( void ) { mine_ = true; }
 	bool isMyItem( void ) { return mine_; }
@@ -164,57 +173,89 @@ public:
 	size_t wroteBytes( void ) { return wroteBytes_; }
 	size_t totalBytes( void ) { return totalBytes_; }
 
-	static bool loadBasicPaintData( const std::string & data, struct SPaintData &res, int *readPos = NULL ) 
+	// the packets of this item by encoding, so a late join or a relay does not encode it again.
+	// cleared when the item changes. a packet encoded before a change is not kept. (version)
+	static const size_t MaxCachedEncodingSize = 1024 * 1024;
+
+	int encodingVersion( void ) const { return encodingVersion_; }
+
+	bool hasCachedEncoding( int encoding ) const
 	{
-		try
-		{
-			boost::int8_t f;
-			int pos = readPos ? *readPos : 0;
-
-			pos += CPacketBufferUtil::readString8( data, pos, res.owner );
-			pos += CPacketBufferUtil::readInt32( data, pos, res.itemId, true );
-			pos += CPacketBufferUtil::readInt8( data, pos, f );
-			pos += CPacketBufferUtil::readDouble( data, pos, res.posX, true );
-			pos += CPacketBufferUtil::readDouble( data, pos, res.posY, true );
-			pos += CPacketBufferUtil::readDouble( data, pos, res.scale, true );
-			res.posSetFlag = (f == 1 ? true : false);
-
-			if( readPos )
-				*readPos = pos;
-		} catch(...)
-		{
+		return encodings_.find( encoding ) != encodings_.end();
+	}
+
+	bool cachedEncoding( int encoding, std::string &packet ) const
+	{
+		std::map< int, std::string >::const_iterator it = encodings_.find( encoding );
+		if( it == encodings_.end() )
 			return false;
-		}
+
+		packet = it->second;
 		return true;
 	}
 
-	static std::string generateBasicData( const struct SPaintData &data, int *writePos = NULL )
+	void setCachedEncoding( int encoding, const std::string &packet, int version )
 	{
-		int pos = writePos ? *writePos : 0;
-		std::string buf;
+		if( version != encodingVersion_ || packet.empty() || packet.size() > MaxCachedEncodingSize )
+			return;
 
-		pos += CPacketBufferUtil::writeString8( buf, pos, data.owner );
-		pos += CPacketBufferUtil::writeInt32( buf, pos, data.itemId, true );
-		pos += CPacketBufferUtil::writeInt8( buf, pos, data.posSetFlag ? 1 : 0 );
-		pos += CPacketBufferUtil::writeDouble( buf, pos, data.posX, true );
-		pos += CPacketBufferUtil::writeDouble( buf, pos, data.posY, true );
-		pos += CPacketBufferUtil::writeDouble( buf, pos, data.scale, true );
+		encodings_[ encoding ] = packet;
+	}
+
+	// | owner | itemId | posSetFlag | posX | posY | scale |
+	typedef PacketSchema::CFields< PacketSchema::String8, PacketSchema::Int32, PacketSchema::Int8, 
+		PacketSchema::Double, PacketSchema::Double, PacketSchema::Double > BasicDataSchema;
 
-		if( writePos )
-			*writePos = pos;
-		return buf;
+	static bool loadBasicPaintData( CPacketReader &reader, struct SPaintData &res ) 
+	{
+		CPacketView owner;
+		boost::int32_t itemId;
+		boost::int8_t f;
+
+		if( !BasicDataSchema::read( reader, owner, itemId, f, res.posX, res.posY, res.scale ) )
+			return false;
+
+		res.owner = owner.str();
+		res.itemId = itemId;
+		res.posSetFlag = (f == 1 ? true : false);
+		return true;
+	}
+
+	static size_t basicDataSize( const struct SPaintData &data )
+	{
+		return BasicDataSchema::size( data.owner, data.itemId, data.posSetFlag ? 1 : 0, data.posX, data.posY, data.scale );
+	}
+
+	static void writeBasicData( CPacketWriter &writer, const struct SPaintData &data )
+	{
+		BasicDataSchema::write( writer, data.owner, data.itemId, data.posSetFlag ? 1 : 0, data.posX, data.posY, data.scale );
+	}
+
+	// the item data encoded in a buffer allocated at once.
+	std::string generateData( void ) const
+	{
+		CPacketWriter writer( dataSize() );
+		writeData( writer );
+		return writer.packet();
 	}
 
 	// virtual methods
 public:
-	virtual bool loadData( const std::string & data, int *readPos = NULL ) 
+	// never throws. returns false on a truncated or broken body.
+	virtual bool loadData( CPacketReader &reader ) 
+	{
+		return loadBasicPaintData( reader, data_ );
+	}
+
+	// dataSize() must be the exact number of bytes writeData() writes.
+	virtual size_t dataSize( void ) const
 	{
-		return loadBasicPaintData( data, data_, readPos );
+		return basicDataSize( data_ );
 	}
 
-	virtual std::string generateData( int *writePos = NULL ) const
+	virtual void writeData( CPacketWriter &writer ) const
 	{
-		return generateBasicData( data_, writePos );
+		writeBasicData( writer, data_ );
 	}
 
 	virtual PaintItemType type( void ) const = 0;
@@ -255,38 +296,87 @@ protected:
 
 	struct SPaintData data_;
 	struct SPaintData prevData_;
+
+	void invalidateEncoding( void )
+	{
+		encodings_.clear();
+		encodingVersion_++;
+	}
+
+private:
+	std::map< int, std::string > encodings_;
+	int encodingVersion_;
 };
 
 
 class CBackgroundImageItem : public CPaintItem
 {
 public:
-	CBackgroundImageItem( void ) : CPaintItem() { }
+	CBackgroundImageItem( void ) : CPaintItem(), hasTileFrame_(false), tileFrameId_(0) { }
 	virtual ~CBackgroundImageItem( void ) 
 	{ 
 		qDebug() << "CBackgroundImageItem deleted.. " << this; 
 	}
 	void setPixmap( const QPixmap &pixmap ) 
 	{ 
+		setImage( pixmap.toImage() );
+	}
+
+	// the stream bytes are made when the item is sent. (a peer getting the tiles only never needs them)
+	void setImage( const QImage &image )
+	{
+		image_ = image;
 		byteArray_.clear();
-		QDataStream pixmapStream(&byteArray_, QIODevice::WriteOnly);
-		pixmapStream << pixmap;
-		pixmapStream.setByteOrder( QDataStream::LittleEndian ); 
-		qDebug() << "########## setPixmap : " << pixmapStream << byteArray_.size();
+		hasTileFrame_ = false;
+	}
+
+	const QImage &image( void ) const
+	{
+		if( image_.isNull() && !byteArray_.isEmpty() )
+		{
+			QDataStream imageStream( byteArray_ );
+			imageStream.setByteOrder( QDataStream::LittleEndian ); 
+			imageStream >> image_;
+		}
+		return image_;
 	}
 	
 	QPixmap createPixmap() 
 	{ 
-		QPixmap pixmap;
-		
-		QDataStream pixmapStream(&byteArray_, QIODevice::ReadOnly);
-		pixmapStream.setByteOrder( QDataStream::LittleEndian ); 
-
 		qDebug() << "########## createPixmap : "  << byteArray_.size();
 
-		pixmapStream >> pixmap;
+		// QDataStream writes a pixmap as its image, so the bytes are read back the same.
+		return QPixmap::fromImage( image() ); 
+	}
+
+	// patch the changed tiles in place. false : not the base of the delta (see CTileCodec)
+	bool applyDelta( const STileDelta &delta, std::vector<QRect> &rects )
+	{
+		if( !delta.keyframe && !isTileFrame( delta.owner, delta.baseId ) )
+			return false;
 
-		return pixmap; 
+		image();
+		if( !CTileCodec::apply( image_, delta, rects ) )
+			return false;
+
+		byteArray_.clear();
+		setTileFrame( delta.owner, delta.frameId );
+		return true;
+	}
+
+	// the frame of the tile codec this image is. (a whole image from the stream is none)
+	void setTileFrame( const std::string &owner, boost::uint32_t frameId )
+	{
+		hasTileFrame_ = true;
+		tileFrameOwner_ = owner;
+		tileFrameId_ = frameId;
+	}
+	bool hasTileFrame( void ) const { return hasTileFrame_; }
+	const std::string &tileFrameOwner( void ) const { return tileFrameOwner_; }
+	boost::uint32_t tileFrameId( void ) const { return tileFrameId_; }
+	bool isTileFrame( const std::string &owner, boost::uint32_t frameId ) const
+	{
+		return hasTileFrame_ && tileFrameOwner_ == owner && tileFrameId_ == frameId;
 	}
 
 	virtual PaintItemType type( void ) const
@@ -309,59 +399,66 @@ public:
 			canvas_->drawBackgroundImage(  boost::static_pointer_cast<CBackgroundImageItem>(shared_from_this()) );		
 	}
 
-	virtual bool loadData( const std::string & data, int *readPos = NULL )
+	virtual bool loadData( CPacketReader &reader )
 	{
-		try
-		{
-			int pos = 0;
-			std::string pixmapBuf;
-			QImage::Format format;
+		CPacketView pixmapBuf;
 
-			if( ! CPaintItem::loadData( data, &pos ) )
-				return false;
+		if( ! CPaintItem::loadData( reader ) )
+			return false;
 
-			pos += CPacketBufferUtil::readString32( data, pos, pixmapBuf, true );
+		if( ! reader.readString32( pixmapBuf ) )
+			return false;
 			
-			QByteArray temp( pixmapBuf.c_str(), pixmapBuf.size() );
-			byteArray_ = temp;
-
-			qDebug() << "########## !!!!!!!!!!!!! loadData : " << byteArray_.size() << pixmapBuf.size() ;
+		byteArray_ = QByteArray( pixmapBuf.data(), pixmapBuf.size() );
+		image_ = QImage();
+		hasTileFrame_ = false;
 
-			HexDump(  pixmapBuf.c_str() + 10000, 50 );
-			HexDump(  byteArray_.data() + 10000, 50 );
-
-		} catch(CPacketException &e) {
-			(void)e;
-			// nothing to do
-			return false;
-		}
+		qDebug() << "########## !!!!!!!!!!!!! loadData : " << byteArray_.size() << pixmapBuf.size() ;
 		return true;
 	}
 
-	std::string generateData( int *writePos = NULL ) const
+	virtual size_t dataSize( void ) const
+	{
+		return CPaintItem::dataSize() + CPacketWriter::sizeString32( streamBytes().size() );
+	}
+
+	virtual void writeData( CPacketWriter &writer ) const
 	{
-		int pos = 0;
-		std::string data;
+		CPaintItem::writeData( writer );
 
-		data = CPaintItem::generateData( &pos );
+		const QByteArray &bytes = streamBytes();
+		writer.writeString32( bytes.data(), bytes.size() );
 
-		std::string pixmapBuf( byteArray_.data(), byteArray_.size() );
-		pos += CPacketBufferUtil::writeString32( data, pos, pixmapBuf, true );
+		qDebug() << "########## writeData pixmap : "<<  data_.owner.c_str() << data_.itemId << bytes.size();
+	}
 
-		qDebug() << "########## generateData pixmap : "<<  data_.owner.c_str() << data_.itemId << pixmapBuf.size();
-		return data;
+private:
+	const QByteArray &streamBytes( void ) const
+	{
+		if( byteArray_.isEmpty() && !image_.isNull() )
+		{
+			// the default byte order, as the old peers wrote it.
+			QDataStream imageStream( &byteArray_, QIODevice::WriteOnly );
+			imageStream << image_;
+		}
+		return byteArray_;
 	}
 
 private:
-	QByteArray byteArray_;
+	mutable QByteArray byteArray_;	// QDataStream of the image
+	mutable QImage image_;
+
+	bool hasTileFrame_;
+	std::string tileFrameOwner_;
+	boost::uint32_t tileFrameId_;
 };
 
 
 class CLineItem : public CPaintItem
 {
 public:
-	CLineItem( void ) : CPaintItem() { }
-	CLineItem( const QColor &color, int width ) : CPaintItem(), clr_(color), w_(width) { }
+	CLineItem( void ) : CPaintItem(), curve_(false) { }
+	CLineItem( const QColor &color, int width ) : CPaintItem(), clr_(color), w_(width), curve_(false) { }
 
 	size_t pointSize( void) const { return listList_.size(); }
 	const QPointF *point( size_t index ) const 
@@ -373,9 +470,27 @@ public:
 	const QColor &color() const { return clr_; }
 	int width() const { return w_; }
 
+	const std::vector< QPointF > &points( void ) const { return listList_; }
+
+	// a curve holds cubic bezier control points. | p0 | c1 | c2 | p1 | c1 | c2 | p2 ...
+	bool isCurve( void ) const { return curve_; }
+
+	// the polyline for a peer without curves. (the points themselves unless this is a curve)
+	const std::vector< QPointF > &polylinePoints( void ) const { return curve_ ? flattenedList_ : listList_; }
+
 	void addPoint( const QPointF &pt ) 
 	{
 		listList_.push_back( pt );
+		invalidateEncoding();
+	}
+
+	// takes the points. (swapped, no copy)
+	void setPoints( std::vector< QPointF > &points, bool curve )
+	{
+		listList_.swap( points );
+		curve_ = curve;
+		updatePolyline();
+		invalidateEncoding();
 	}
 
 	virtual PaintItemType type( void ) const
@@ -389,69 +504,131 @@ public:
 			canvas_->drawLine(  boost::static_pointer_cast<CLineItem>(shared_from_this()) );
 	}
 
-	virtual bool loadData( const std::string & data, int *readPos = NULL )
+	// | r | g | b | a | width | point count | (x, y) ... |
+	typedef PacketSchema::CFields< PacketSchema::Int16, PacketSchema::Int16, PacketSchema::Int16, 
+		PacketSchema::Int16, PacketSchema::Int16, PacketSchema::Int16 > LineSchema;
+
+	virtual bool loadData( CPacketReader &reader )
 	{
-		try
-		{
-			double x1, y1, x2, y2;
-			boost::int16_t r, g, b, a, w, ptCnt;
-			int pos = 0;
-
-			if( ! CPaintItem::loadData( data, &pos ) )
-				return false;
-
-			pos += CPacketBufferUtil::readInt16( data, pos, r, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, g, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, b, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, a, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, w, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, ptCnt, true );
-			for( boost::int16_t i = 0; i < ptCnt; i++ )
-			{
-				double x, y;
-				pos += CPacketBufferUtil::readDouble( data, pos, x, true );
-				pos += CPacketBufferUtil::readDouble( data, pos, y, true );
-	
-				listList_.push_back( QPointF( x, y ) );
-			}
-
-			clr_ = QColor( r, g, b, a );
-			w_ = w;
-		} catch(CPacketException &e) {
-			(void)e;
-			// nothing to do
+		boost::int16_t r, g, b, a, w, ptCnt;
+
+		if( ! CPaintItem::loadData( reader ) )
+			return false;
+
+		if( ! LineSchema::read( reader, r, g, b, a, w, ptCnt ) )
 			return false;
+
+		// the whole point array is checked at once, the loop below can not run short.
+		if( ptCnt < 0 || ! reader.require( ptCnt * 16 ) )
+			return false;
+
+		listList_.reserve( listList_.size() + ptCnt );
+		for( boost::int16_t i = 0; i < ptCnt; i++ )
+		{
+			double x, y;
+			reader.readDouble( x );
+			reader.readDouble( y );
+
+			listList_.push_back( QPointF( x, y ) );
 		}
 
+		clr_ = QColor( r, g, b, a );
+		w_ = w;
 		return true;
 	}
 
-	std::string generateData( int *writePos = NULL ) const
+	// the legacy encoding has no curve, a curve is sent flattened.
+	virtual size_t dataSize( void ) const
+	{
+		return CPaintItem::dataSize() + LineSchema::MinSize + (polylinePoints().size() * 16);
+	}
+
+	virtual void writeData( CPacketWriter &writer ) const
 	{
-		int pos = 0;
-		std::string data;
+		const std::vector< QPointF > &points = polylinePoints();
 
-		data = CPaintItem::generateData( &pos );
+		CPaintItem::writeData( writer );
 
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.red(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.green(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.blue(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.alpha(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, w_, true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, listList_.size(), true );
-		for( size_t i = 0; i < listList_.size(); i++ )
+		LineSchema::write( writer, clr_.red(), clr_.green(), clr_.blue(), clr_.alpha(), w_, points.size() );
+		for( size_t i = 0; i < points.size(); i++ )
 		{
-			pos += CPacketBufferUtil::writeDouble( data, pos, listList_[i].x(), true );
-			pos += CPacketBufferUtil::writeDouble( data, pos, listList_[i].y(), true );
+			writer.writeDouble( points[i].x() );
+			writer.writeDouble( points[i].y() );
 		}
-		return data;
+	}
+
+	// compact encoding (CODE_PAINT_ADD_LINE_COMPACT, for peers with CAPABILITY_COMPACT_STROKE)
+	// | basic data | r | g | b | a | width | fracBits | point count | packed points | (curve flag) |
+	// the curve flag is written only for a curve sent to a peer with CAPABILITY_CURVE_STROKE.
+	typedef PacketSchema::CFields< PacketSchema::Int8, PacketSchema::Int8, PacketSchema::Int8, 
+		PacketSchema::Int8, PacketSchema::Int16, PacketSchema::Int8 > CompactLineSchema;
+
+	// the points are packed first, so the data size is exact before writing.
+	std::string packPoints( int fracBits, bool curve ) const
+	{
+		return CStrokeCodec::encodePoints( compactPoints( curve ), fracBits );
+	}
+
+	size_t compactDataSize( const std::string &packed, bool curve ) const
+	{
+		return CPaintItem::dataSize() + CompactLineSchema::MinSize + CStrokeCodec::pointsSize( packed ) + (curve && curve_ ? 1 : 0);
+	}
+
+	void writeCompactData( CPacketWriter &writer, int fracBits, const std::string &packed, bool curve ) const
+	{
+		CPaintItem::writeData( writer );
+
+		CompactLineSchema::write( writer, clr_.red(), clr_.green(), clr_.blue(), clr_.alpha(), w_, fracBits );
+		CStrokeCodec::writePoints( writer, compactPoints( curve ).size(), packed );
+		if( curve && curve_ )
+			writer.writeInt8( 1 );
+	}
+
+	bool loadCompactData( CPacketReader &reader )
+	{
+		boost::int8_t r, g, b, a, fracBits;
+		boost::int16_t w;
+
+		if( ! CPaintItem::loadData( reader ) )
+			return false;
+
+		if( ! CompactLineSchema::read( reader, r, g, b, a, w, fracBits ) )
+			return false;
+
+		if( ! CStrokeCodec::readPoints( reader, fracBits, listList_ ) )
+			return false;
+
+		boost::int8_t curveFlag = 0;
+		if( reader.remaining() >= 1 )
+			reader.readInt8( curveFlag );
+
+		curve_ = (curveFlag == 1);
+		if( curve_ && (listList_.empty() || (listList_.size() - 1) % 3 != 0) )
+			return false;
+		updatePolyline();
+
+		clr_ = QColor( (boost::uint8_t)r, (boost::uint8_t)g, (boost::uint8_t)b, (boost::uint8_t)a );
+		w_ = w;
+		return true;
+	}
+
+private:
+	const std::vector< QPointF > &compactPoints( bool curve ) const { return curve ? listList_ : polylinePoints(); }
+
+	void updatePolyline( void )
+	{
+		flattenedList_.clear();
+		if( curve_ )
+			CStrokeProcessor::flattenCurve( listList_, 0.25, flattenedList_ );
 	}
 
 private:
 	
 	std::vector< QPointF > listList_;
+	std::vector< QPointF > flattenedList_;
 	QColor clr_;
 	int w_;
+	bool curve_;
 };
 
 
@@ -489,68 +666,165 @@ public:
 			canvas_->drawSendingStatus( shared_from_this() );
 	}
 
-	virtual bool loadData( const std::string & data, int *readPos = NULL )
+	// | file name | file data |
+	typedef PacketSchema::CFields< PacketSchema::String16, PacketSchema::String32 > FileSchema;
+
+	virtual bool loadData( CPacketReader &reader )
 	{
-		try
+		CPacketView tempName;
+		CPacketView fileData;
+
+		if( ! CPaintItem::loadData( reader ) )
+			return false;
+
+		if( ! FileSchema::read( reader, tempName, fileData ) )
+			return false;
+
+		QString fileName = QString::fromUtf8( tempName.data(), tempName.size() );
+		path_ = generateFileDownloadPath() + fileName;
+
+		QFile f(path_);
+		if( !f.open( QIODevice::WriteOnly ) )
+		{
+			return false;
+		}
+
+		QDataStream out(&f);
+		int ret = out.writeRawData( fileData.data(), fileData.size() );
+		if( ret != (int)fileData.size() )
 		{
-			std::string tempName;
-			std::string fileData;
-
-			int pos = 0;
-
-			if( ! CPaintItem::loadData( data, &pos ) )
-				return false;
-
-			pos += CPacketBufferUtil::readString16( data, pos, tempName, true );
-			pos += CPacketBufferUtil::readString32( data, pos, fileData, true );
-
-			QString fileName = QString::fromUtf8( tempName.c_str(), tempName.size() );
-			path_ = generateFileDownloadPath() + fileName;
-
-			QFile f(path_);
-			if( !f.open( QIODevice::WriteOnly ) )
-			{
-				return false;
-			}
-
-			QDataStream out(&f);
-			int ret = out.writeRawData( fileData.c_str(), fileData.size() );
-			if( ret != fileData.size() )
-			{
-				return false;
-			}
-		} catch(CPacketException &e) {
-			(void)e;
-			// nothing to do
 			return false;
 		}
 		return true;
 	}
 
-	std::string generateData( int *writePos = NULL ) const
+	// the file as it is encoded. taken once by the caller and given to the size and the write step,
+	// so a file which changes in between fails the packet instead of overflowing it.
+	struct SFileSnapshot
+	{
+		std::string fileName;
+		qint64 size;
+	};
+
+	SFileSnapshot snapshot( void ) const
 	{
 		QFileInfo pathInfo( path_ );
-		QString fileName( pathInfo.fileName() );
+
+		SFileSnapshot file;
+		file.fileName = toUtf8StdString( pathInfo.fileName() );
+		file.size = pathInfo.size();
+		return file;
+	}
+
+	size_t dataSize( const SFileSnapshot &file ) const
+	{
+		return CPaintItem::dataSize()
+			+ CPacketWriter::sizeString16( file.fileName )
+			+ CPacketWriter::sizeString32( (size_t)file.size );
+	}
+
+	void writeData( CPacketWriter &writer, const SFileSnapshot &file ) const
+	{
+		size_t fileSize = (size_t)file.size;
+
+		CPaintItem::writeData( writer );
+
+		writer.writeString16( file.fileName );
+		writer.writeInt32( fileSize );
+
+		// read the file straight into the packet buffer.
+		char *ptr = writer.claim( fileSize );
 
 		QFile f( path_ );
-		if( !f.open( QIODevice::ReadOnly ) )
-			return "";
+		if( !f.open( QIODevice::ReadOnly ) || f.size() != file.size || f.read( ptr, fileSize ) != (qint64)fileSize )
+			writer.setFailed();
+	}
 
-		QByteArray byteArray;
-		byteArray = f.readAll();
+	// each takes its own snapshot. (CAddItem::make uses one for both)
+	virtual size_t dataSize( void ) const
+	{
+		return dataSize( snapshot() );
+	}
 
-		int pos = 0;
-		std::string data;
-		data = CPaintItem::generateData( &pos );
-	
-		pos += CPacketBufferUtil::writeString16( data, pos, toUtf8StdString(fileName), true );
-		pos += CPacketBufferUtil::writeInt32( data, pos, byteArray.size(), true );
-		pos += CPacketBufferUtil::writeBinary( data, pos, byteArray.data(), byteArray.size() );
-		return data;
+	virtual void writeData( CPacketWriter &writer ) const
+	{
+		writeData( writer, snapshot() );
+	}
+
+	// the item without the file data. (CODE_FILE_BEGIN, the data follows in chunks)
+	// | item data | file name | file size | content hash |
+	typedef PacketSchema::CFields< PacketSchema::String16, PacketSchema::Int32, PacketSchema::String8 > MetaSchema;
+
+	void setPath( const QString &path ) { path_ = path; invalidateEncoding(); }
+
+	size_t fileSize( void ) const
+	{
+		return (size_t)QFileInfo( path_ ).size();
+	}
+
+	// SHA-1 of the file, the address in CFileStore. read in pieces once and kept.
+	const QByteArray &contentHash( void ) const
+	{
+		if( contentHash_.isEmpty() )
+		{
+			QFile f( path_ );
+			if( !f.open( QIODevice::ReadOnly ) )
+				return contentHash_;
+
+			QCryptographicHash hash( QCryptographicHash::Sha1 );
+			std::string buf( 64 * 1024, 0 );
+			qint64 len;
+			while( (len = f.read( &buf[0], buf.size() )) > 0 )
+				hash.addData( buf.data(), (int)len );
+
+			if( len == 0 )
+				contentHash_ = hash.result();
+		}
+		return contentHash_;
+	}
+
+	bool hasContentHash( void ) const { return !contentHash_.isEmpty(); }
+	void setContentHash( const QByteArray &hash ) { contentHash_ = hash; invalidateEncoding(); }
+
+	size_t metaDataSize( const SFileSnapshot &file ) const
+	{
+		return CPaintItem::dataSize() + MetaSchema::size( file.fileName, (boost::int32_t)file.size, contentHashString() );
+	}
+
+	void writeMetaData( CPacketWriter &writer, const SFileSnapshot &file ) const
+	{
+		CPaintItem::writeData( writer );
+		MetaSchema::write( writer, file.fileName, (boost::int32_t)file.size, contentHashString() );
+	}
+
+	bool loadMetaData( CPacketReader &reader, QString &fileName, size_t &size )
+	{
+		CPacketView tempName;
+		boost::int32_t tempSize;
+		CPacketView tempHash;
+
+		if( ! CPaintItem::loadData( reader ) )
+			return false;
+
+		if( ! MetaSchema::read( reader, tempName, tempSize, tempHash ) || tempSize < 0 || tempHash.size() == 0 )
+			return false;
+
+		fileName = QString::fromUtf8( tempName.data(), tempName.size() );
+		size = (size_t)tempSize;
+		contentHash_ = QByteArray( tempHash.data(), (int)tempHash.size() );
+		return true;
+	}
+
+private:
+	std::string contentHashString( void ) const
+	{
+		const QByteArray &hash = contentHash();
+		return std::string( hash.constData(), hash.size() );
 	}
 
 protected:
 	QString path_;
+	mutable QByteArray contentHash_;
 };
 
 
@@ -601,61 +875,49 @@ public:
 			canvas_->drawText(  boost::static_pointer_cast<CTextItem>(shared_from_this()) );		
 	}
 
-	virtual bool loadData( const std::string & data, int *readPos = NULL )
+	// | r | g | b | a | pixel size | text | font family | bold |
+	typedef PacketSchema::CFields< PacketSchema::Int16, PacketSchema::Int16, PacketSchema::Int16, 
+		PacketSchema::Int16, PacketSchema::Int16 > ColorSizeSchema;
+	typedef PacketSchema::CFields< PacketSchema::String16, PacketSchema::String16, PacketSchema::Int8 > TextFontSchema;
+
+	virtual bool loadData( CPacketReader &reader )
 	{
-		try
-		{
-			boost::int8_t bold;
-			boost::int16_t r, g, b, a, s;
-			std::string text, fontFamily;
-			int pos = 0;
-
-			if( ! CPaintItem::loadData( data, &pos ) )
-				return false;
-
-			pos += CPacketBufferUtil::readInt16( data, pos, r, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, g, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, b, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, a, true );
-			pos += CPacketBufferUtil::readInt16( data, pos, s, true );
-			pos += CPacketBufferUtil::readString16( data, pos, text, true );
-			pos += CPacketBufferUtil::readString16( data, pos, fontFamily, true );
-			pos += CPacketBufferUtil::readInt8( data, pos, bold );
-
-			// text 
-			text_ = QString::fromUtf8( text.c_str(), text.size() );
-
-			// font setting
-			clr_ = QColor( r, g, b, a );
-			QString n = QString::fromUtf8( fontFamily.c_str(), fontFamily.size() );
-			font_.setFamily( n );
-			font_.setPixelSize( s );
-			font_.setBold( bold == 1 ? true : false );
-		} catch(CPacketException &e) {
-			(void)e;
-			// nothing to do
+		boost::int8_t bold;
+		boost::int16_t r, g, b, a, s;
+		CPacketView text, fontFamily;
+
+		if( ! CPaintItem::loadData( reader ) )
 			return false;
-		}
+
+		if( ! ColorSizeSchema::read( reader, r, g, b, a, s ) )
+			return false;
+		if( ! TextFontSchema::read( reader, text, fontFamily, bold ) )
+			return false;
+
+		// text 
+		text_ = QString::fromUtf8( text.data(), text.size() );
+
+		// font setting
+		clr_ = QColor( r, g, b, a );
+		QString n = QString::fromUtf8( fontFamily.data(), fontFamily.size() );
+		font_.setFamily( n );
+		font_.setPixelSize( s );
+		font_.setBold( bold == 1 ? true : false );
 		return true;
 	}
 
-	std::string generateData( int *writePos = NULL ) const
+	virtual size_t dataSize( void ) const
 	{
-		int pos = 0;
-		std::string data;
+		return CPaintItem::dataSize() + ColorSizeSchema::MinSize
+			+ TextFontSchema::size( toUtf8StdString(text_), toUtf8StdString(font_.family()), font_.bold() ? 1 : 0 );
+	}
 
-		data = CPaintItem::generateData( &pos );
+	virtual void writeData( CPacketWriter &writer ) const
+	{
+		CPaintItem::writeData( writer );
 
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.red(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.green(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.blue(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, clr_.alpha(), true );
-		pos += CPacketBufferUtil::writeInt16( data, pos, font_.pixelSize(), true );
-		pos += CPacketBufferUtil::writeString16( data, pos, toUtf8StdString(text_), true );
-		pos += CPacketBufferUtil::writeString16( data, pos, toUtf8StdString(font_.family()), true );
-		pos += CPacketBufferUtil::writeInt8( data, pos, font_.bold() ? 1 : 0 );
-	
-		return data;
+		ColorSizeSchema::write( writer, clr_.red(), clr_.green(), clr_.blue(), clr_.alpha(), font_.pixelSize() );
+		TextFontSchema::write( writer, toUtf8StdString(text_), toUtf8StdString(font_.family()), font_.bold() ? 1 : 0 );
 	}
 
 private:
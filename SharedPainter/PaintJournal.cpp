@@ -0,0 +1,475 @@
+#include "StdAfx.h"
+#include "PaintJournal.h"
+#include "CanvasFile.h"
+#include "PaintPacketBuilder.h"
+#include "WindowPacketBuilder.h"
+
+void CPaintJournal::open( const QString &logPath, const QString &canvasPath, callback_t recovered, bool fresh )
+{
+	close();
+
+	logPath_ = logPath;
+	canvasPath_ = canvasPath;
+
+	{
+		boost::mutex::scoped_lock autolock( mutex_ );
+		running_ = true;
+		closing_ = false;
+		checkpointOnClose_ = false;
+	}
+
+	thread_ = boost::thread( boost::bind( &CPaintJournal::_threadMain, this, recovered, fresh ) );
+}
+
+void CPaintJournal::close( bool checkpoint )
+{
+	{
+		boost::mutex::scoped_lock autolock( mutex_ );
+		if( !running_ )
+			return;
+
+		running_ = false;
+		closing_ = true;
+		checkpointOnClose_ = checkpoint;
+		queued_.notify_one();
+	}
+
+	if( thread_.joinable() )
+		thread_.join();
+}
+
+void CPaintJournal::append( const std::string &packet )
+{
+	if( packet.size() < (size_t)CPacketWriter::HeaderSize || !isOpen() )
+		return;
+
+	struct SRecord record;
+	memcpy( &record.code, packet.data() + 1, 2 );
+	record.body.append( packet.data() + CPacketWriter::HeaderSize, packet.size() - CPacketWriter::HeaderSize );
+	push( record );
+}
+
+void CPaintJournal::append( boost::int16_t code, const CIOBuffer &body )
+{
+	struct SRecord record;
+	record.code = code;
+	record.body = body;	// the slabs are shared, not copied
+	push( record );
+}
+
+void CPaintJournal::appendFileItem( boost::shared_ptr<CFileItem> item )
+{
+	if( !isOpen() )
+		return;
+
+	std::string path = toUtf8StdString( item->path() );
+	std::string hash;
+	if( item->hasContentHash() )
+		hash.assign( item->contentHash().constData(), item->contentHash().size() );
+
+	CPacketWriter writer( CPaintItem::basicDataSize( item->data() ) + FileItemSchema::size( (boost::int16_t)item->type(), path, hash ) );
+	CPaintItem::writeBasicData( writer, item->data() );
+	FileItemSchema::write( writer, (boost::int16_t)item->type(), path, hash );
+
+	struct SRecord record;
+	record.code = CODE_JOURNAL_FILE_ITEM;
+	record.body.append( writer.packet() );
+	push( record );
+}
+
+void CPaintJournal::appendBackgroundImage( boost::shared_ptr<CBackgroundImageItem> image )
+{
+	if( !image || !isOpen() )
+		return;
+
+	// a copy, the tiles of the others patch the image in place. (QImage is shared until then)
+	struct SRecord record;
+	record.code = CODE_JOURNAL_BG_IMAGE;
+	record.image = boost::shared_ptr<CBackgroundImageItem>( new CBackgroundImageItem );
+	record.image->setImage( image->image() );
+	record.image->setOwner( image->owner() );
+	record.image->setItemId( image->itemId() );
+	if( image->hasTileFrame() )
+		record.image->setTileFrame( image->tileFrameOwner(), image->tileFrameId() );
+	push( record );
+}
+
+void CPaintJournal::push( const struct SRecord &record )
+{
+	boost::mutex::scoped_lock autolock( mutex_ );
+	if( !running_ )
+		return;
+
+	queue_.push_back( record );
+	queued_.notify_one();
+}
+
+void CPaintJournal::_threadMain( callback_t recovered, bool fresh )
+{
+	if( fresh )
+		startFresh();
+	else
+		recover( recovered );
+
+	boost::system_time nextCheckpoint = boost::get_system_time() + boost::posix_time::seconds( CheckpointIntervalSec );
+	while( true )
+	{
+		std::deque< struct SRecord > records;
+		bool closing, checkpointOnClose;
+		{
+			boost::mutex::scoped_lock autolock( mutex_ );
+			while( queue_.empty() && !closing_ )
+			{
+				if( !queued_.timed_wait( autolock, nextCheckpoint ) )
+					break;
+			}
+			records.swap( queue_ );
+			closing = closing_;
+			checkpointOnClose = checkpointOnClose_;
+		}
+
+		// all the queued records in one write and one sync. (group commit)
+		if( !records.empty() )
+		{
+			writeRecords( records );
+
+			for( size_t i = 0; i < records.size(); i++ )
+			{
+				CIOBuffer &body = records[i].body;
+				apply( records[i].code, CPacketView( body.empty() ? "" : body.coalesce(), body.size() ) );
+			}
+		}
+
+		if( closing )
+		{
+			if( checkpointOnClose && dirty_ )
+				checkpoint();
+			break;
+		}
+
+		boost::system_time now = boost::get_system_time();
+		if( dirty_ && (logSize_ >= CheckpointLogSize || now >= nextCheckpoint) )
+			checkpoint();
+
+		if( now >= nextCheckpoint )
+			nextCheckpoint = now + boost::posix_time::seconds( CheckpointIntervalSec );
+	}
+
+	log_.close();
+	items_.clear();
+	background_ = boost::shared_ptr<CBackgroundImageItem>();
+}
+
+void CPaintJournal::recover( callback_t recovered )
+{
+	items_.clear();
+	background_ = boost::shared_ptr<CBackgroundImageItem>();
+	windowWidth_ = windowHeight_ = 0;
+
+	log_.setFileName( logPath_ );
+	if( !log_.open( QIODevice::ReadWrite ) )
+		qDebug() << "CPaintJournal : can't open the log" << logPath_;
+
+	// the good records, up to a torn write at the end of the last run.
+	QByteArray bytes = log_.isOpen() ? log_.readAll() : QByteArray();
+	size_t end = 0;
+	size_t count = 0;
+	while( bytes.size() - end >= RecordHeaderSize )
+	{
+		const char *ptr = bytes.constData() + end;
+		boost::uint32_t len;
+		quint16 crc;
+		memcpy( &len, ptr + 2, 4 );
+		memcpy( &crc, ptr + 6, 2 );
+
+		if( len > bytes.size() - end - RecordHeaderSize || qChecksum( ptr + RecordHeaderSize, len ) != crc )
+			break;
+
+		end += RecordHeaderSize + len;
+		count++;
+	}
+
+	// no record : the canvas file is the canvas, the owner restores it at once.
+	if( count == 0 && recovered )
+	{
+		recovered();
+		recovered = callback_t();
+	}
+
+	CCanvasFile canvas;
+	if( canvas.open( canvasPath_ ) )
+	{
+		for( size_t i = 0; i < canvas.itemCount(); i++ )
+			addItem( canvas.item( i ) );
+
+		background_ = canvas.background();
+		windowWidth_ = canvas.windowWidth();
+		windowHeight_ = canvas.windowHeight();
+		canvas.close();
+	}
+
+	size_t pos = 0;
+	while( pos < end )
+	{
+		const char *ptr = bytes.constData() + pos;
+		boost::int16_t code;
+		boost::uint32_t len;
+		memcpy( &code, ptr, 2 );
+		memcpy( &len, ptr + 2, 4 );
+
+		apply( code, CPacketView( ptr + RecordHeaderSize, len ) );
+		pos += RecordHeaderSize + len;
+	}
+
+	// the next records go after the last good one.
+	if( log_.isOpen() )
+	{
+		log_.resize( end );
+		log_.seek( end );
+	}
+	logSize_ = end;
+
+	qDebug() << "CPaintJournal : recovered" << items_.size() << "items," << count << "records";
+
+	dirty_ = count > 0;
+	if( dirty_ )
+		checkpoint();
+
+	if( recovered )
+		recovered();
+}
+
+void CPaintJournal::startFresh( void )
+{
+	items_.clear();
+	background_ = boost::shared_ptr<CBackgroundImageItem>();
+	windowWidth_ = windowHeight_ = 0;
+
+	// a crash before the first checkpoint recovers the records of this run only.
+	QFile::remove( canvasPath_ );
+
+	log_.setFileName( logPath_ );
+	if( !log_.open( QIODevice::ReadWrite | QIODevice::Truncate ) )
+		qDebug() << "CPaintJournal : can't open the log" << logPath_;
+
+	logSize_ = 0;
+	dirty_ = false;
+}
+
+bool CPaintJournal::writeRecords( std::deque< struct SRecord > &records )
+{
+	std::string buf;
+	for( size_t i = 0; i < records.size(); i++ )
+	{
+		struct SRecord &record = records[i];
+		if( record.image )
+		{
+			std::string packet = PaintPacketBuilder::CSetBackgroundImage::make( record.image );
+			if( packet.size() > (size_t)CPacketWriter::HeaderSize )
+			{
+				std::string frameOwner = record.image->hasTileFrame() ? record.image->tileFrameOwner() : std::string();
+				boost::int32_t frameId = record.image->hasTileFrame() ? (boost::int32_t)record.image->tileFrameId() : 0;
+
+				CPacketWriter writer( TileFrameSchema::size( frameOwner, frameId ) );
+				TileFrameSchema::write( writer, frameOwner, frameId );
+				record.body.append( writer.packet() );
+				record.body.append( packet.data() + CPacketWriter::HeaderSize, packet.size() - CPacketWriter::HeaderSize );
+			}
+			record.image = boost::shared_ptr<CBackgroundImageItem>();
+		}
+
+		boost::uint32_t len = (boost::uint32_t)record.body.size();
+		const char *body = len > 0 ? record.body.coalesce() : "";
+		quint16 crc = qChecksum( body, len );
+
+		char header[RecordHeaderSize];
+		memcpy( header, &record.code, 2 );
+		memcpy( header + 2, &len, 4 );
+		memcpy( header + 6, &crc, 2 );
+
+		buf.append( header, sizeof(header) );
+		buf.append( body, len );
+	}
+
+	if( !log_.isOpen() || log_.write( buf.data(), buf.size() ) != (qint64)buf.size() || !CCanvasFile::syncFile( log_ ) )
+	{
+		qDebug() << "CPaintJournal : write failed" << logPath_;
+		return false;
+	}
+
+	logSize_ += buf.size();
+	return true;
+}
+
+void CPaintJournal::apply( boost::int16_t code, const CPacketView &body )
+{
+	switch( code )
+	{
+	case CODE_PAINT_ADD_ITEM:
+		{
+			// a file item writes its file as it is read, a file comes as CODE_JOURNAL_FILE_ITEM.
+			CPacketReader reader( body );
+			boost::int16_t type;
+			if( !reader.readInt16( type ) || type == PT_FILE || type == PT_IMAGE_FILE )
+				return;
+
+			addItem( PaintPacketBuilder::CAddItem::parse( body ) );
+		}
+		break;
+	case CODE_PAINT_ADD_LINE_COMPACT:
+		addItem( PaintPacketBuilder::CAddCompactLine::parse( body ) );
+		break;
+	case CODE_JOURNAL_FILE_ITEM:
+		{
+			CPacketReader reader( body );
+			struct SPaintData data;
+			boost::int16_t type;
+			CPacketView path, hash;
+			if( !CPaintItem::loadBasicPaintData( reader, data ) || !FileItemSchema::read( reader, type, path, hash ) )
+				return;
+			if( type != PT_FILE && type != PT_IMAGE_FILE )
+				return;
+
+			boost::shared_ptr<CFileItem> item = boost::static_pointer_cast<CFileItem>( CPaintItemFactory::createItem( (PaintItemType)type ) );
+			item->setData( data );
+			item->setPath( QString::fromUtf8( path.data(), path.size() ) );
+			if( !hash.empty() )
+				item->setContentHash( QByteArray( hash.data(), (int)hash.size() ) );
+			addItem( item );
+		}
+		break;
+	case CODE_PAINT_UPDATE_ITEM:
+		{
+			struct SPaintData data;
+			if( !PaintPacketBuilder::CUpdateItem::parse( body, data ) )
+				return;
+
+			ITEM_MAP::iterator it = items_.find( ITEM_KEY( data.owner, data.itemId ) );
+			if( it != items_.end() )
+				it->second->setData( data );
+		}
+		break;
+	case CODE_PAINT_MOVE_ITEM:
+		{
+			std::string owner;
+			int itemId;
+			double x, y;
+			if( !PaintPacketBuilder::CMoveItem::parse( body, owner, itemId, x, y ) )
+				return;
+
+			ITEM_MAP::iterator it = items_.find( ITEM_KEY( owner, itemId ) );
+			if( it != items_.end() )
+				it->second->setPos( x, y );
+		}
+		break;
+	case CODE_PAINT_REMOVE_ITEM:
+		{
+			std::string owner;
+			int itemId;
+			if( !PaintPacketBuilder::CRemoveItem::parse( body, owner, itemId ) )
+				return;
+
+			items_.erase( ITEM_KEY( owner, itemId ) );
+		}
+		break;
+	case CODE_PAINT_CLEAR_SCREEN:
+		items_.clear();
+		background_ = boost::shared_ptr<CBackgroundImageItem>();
+		break;
+	case CODE_PAINT_CLEAR_BG_IMAGE:
+		background_ = boost::shared_ptr<CBackgroundImageItem>();
+		break;
+	case CODE_PAINT_SET_BG_IMAGE:
+		{
+			boost::shared_ptr<CBackgroundImageItem> image = PaintPacketBuilder::CSetBackgroundImage::parse( body );
+			if( !image )
+				return;
+			background_ = image;
+		}
+		break;
+	case CODE_JOURNAL_BG_IMAGE:
+		{
+			CPacketReader reader( body );
+			CPacketView frameOwner;
+			boost::int32_t frameId;
+			if( !TileFrameSchema::read( reader, frameOwner, frameId ) )
+				return;
+
+			boost::shared_ptr<CBackgroundImageItem> image = PaintPacketBuilder::CSetBackgroundImage::parse( reader.rest() );
+			if( !image )
+				return;
+
+			if( frameId != 0 )
+				image->setTileFrame( frameOwner.str(), (boost::uint32_t)frameId );
+			background_ = image;
+		}
+		break;
+	case CODE_PAINT_SET_BG_IMAGE_DELTA:
+		{
+			boost::shared_ptr<STileDelta> delta = PaintPacketBuilder::CSetBackgroundImageDelta::parse( body );
+			if( !delta )
+				return;
+
+			boost::shared_ptr<CBackgroundImageItem> image = background_;
+			if( !image )
+			{
+				if( !delta->keyframe )
+					return;
+				image = boost::shared_ptr<CBackgroundImageItem>( new CBackgroundImageItem );
+			}
+
+			std::vector<QRect> rects;
+			if( !image->applyDelta( *delta, rects ) )
+				return;
+
+			image->setOwner( delta->owner );
+			background_ = image;
+		}
+		break;
+	case CODE_WINDOW_RESIZE_MAIN_WND:
+		{
+			int width, height;
+			if( !WindowPacketBuilder::CResizeMainWindow::parse( body, width, height ) || width <= 0 || height <= 0 )
+				return;
+
+			windowWidth_ = width;
+			windowHeight_ = height;
+		}
+		break;
+	default:
+		return;
+	}
+
+	dirty_ = true;
+}
+
+void CPaintJournal::addItem( boost::shared_ptr<CPaintItem> item )
+{
+	if( item )
+		items_[ ITEM_KEY( item->owner(), item->itemId() ) ] = item;
+}
+
+void CPaintJournal::checkpoint( void )
+{
+	ITEM_LIST items;
+	items.reserve( items_.size() );
+	for( ITEM_MAP::iterator it = items_.begin(); it != items_.end(); it++ )
+		items.push_back( it->second );
+
+	// the log stays if the canvas file is not saved, the next checkpoint tries again.
+	if( !CCanvasFile::save( canvasPath_, items, background_, windowWidth_, windowHeight_ ) )
+	{
+		qDebug() << "CPaintJournal : checkpoint failed" << canvasPath_;
+		return;
+	}
+
+	// the records are in the canvas file now.
+	if( log_.isOpen() )
+	{
+		log_.resize( 0 );
+		log_.seek( 0 );
+		CCanvasFile::syncFile( log_ );
+	}
+	logSize_ = 0;
+	dirty_ = false;
+}
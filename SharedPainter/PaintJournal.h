@@ -0,0 +1,114 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include "PaintItem.h"
+#include "IOBuffer.h"
+
+//---------------------------------------------
+// CPaintJournal : the changes of the canvas in a log, so a server comes back after a crash
+//---------------------------------------------
+//
+// record : | 2byte code | 4byte body length | 2byte crc16 of the body | body |
+//
+// A record is the body of the packet that made the change, the local changes and the received
+// ones alike. A file item is CODE_JOURNAL_FILE_ITEM with its path, the file goes in at the checkpoint.
+// append() queues the record and returns, from any thread. The writer thread writes all the queued
+// records at once and syncs the log once for them. (group commit)
+// The writer thread applies the records to a canvas of its own. The checkpoint saves that canvas
+// in the canvas file (see CCanvasFile) and empties the log, every CheckpointInterval or when the log
+// is over CheckpointLogSize. A record applied twice leaves the same canvas, so a crash between
+// the two steps only replays the records again. (a tile delta whose base is not the replayed
+// background is dropped, the background is already past it)
+// open() recovers first : the canvas file, then the log records over it, then a checkpoint.
+// The owner restores from the canvas file after that, or at once if the log has no record. (a clean stop)
+// close( true ) makes the last checkpoint on the writer thread, so the canvas is saved off the main thread.
+//
+
+class CPaintJournal
+{
+public:
+	typedef boost::function< void () > callback_t;
+
+	static const int CheckpointIntervalSec = 5 * 60;
+	static const qint64 CheckpointLogSize = 16 * 1024 * 1024;
+	static const size_t RecordHeaderSize = 8;
+
+	enum JournalCode {
+		CODE_JOURNAL_FILE_ITEM = 0x1000,	// not a packet code, the log only
+		CODE_JOURNAL_BG_IMAGE,
+	};
+
+	// | item data | type | path | content hash (empty : not known yet) |
+	typedef PacketSchema::CFields< PacketSchema::Int16, PacketSchema::String16, PacketSchema::String8 > FileItemSchema;
+
+	// | tile frame owner | tile frame id (0 : none) | CODE_PAINT_SET_BG_IMAGE body |
+	// the frame goes with the image, so the deltas after it in the log apply on a replay.
+	typedef PacketSchema::CFields< PacketSchema::String8, PacketSchema::Int32 > TileFrameSchema;
+
+	CPaintJournal( void ) : running_(false), closing_(false), checkpointOnClose_(false), logSize_(0), windowWidth_(0), windowHeight_(0), dirty_(false) { }
+	~CPaintJournal( void )
+	{
+		close();
+	}
+
+	// recovered is called on the writer thread once the last run is recovered.
+	// fresh : the last run is dropped, the journal starts from an empty canvas. (the owner appends its own)
+	void open( const QString &logPath, const QString &canvasPath, callback_t recovered, bool fresh = false );
+
+	// the queued records are written first. checkpoint : the canvas file is saved and the log emptied.
+	void close( bool checkpoint = false );
+
+	bool isOpen( void )
+	{
+		boost::mutex::scoped_lock autolock( mutex_ );
+		return running_;
+	}
+
+	void append( const std::string &packet );	// made by CPacketWriter
+	void append( boost::int16_t code, const CIOBuffer &body );
+	void appendFileItem( boost::shared_ptr<CFileItem> item );
+	void appendBackgroundImage( boost::shared_ptr<CBackgroundImageItem> image );
+
+private:
+	struct SRecord
+	{
+		boost::int16_t code;
+		CIOBuffer body;
+		boost::shared_ptr<CBackgroundImageItem> image;	// encoded on the writer thread
+	};
+	typedef std::pair< std::string, int > ITEM_KEY;
+	typedef std::map< ITEM_KEY, boost::shared_ptr<CPaintItem> > ITEM_MAP;
+
+	void push( const struct SRecord &record );
+
+	// writer thread
+	void _threadMain( callback_t recovered, bool fresh );
+	void recover( callback_t recovered );
+	void startFresh( void );
+	bool writeRecords( std::deque< struct SRecord > &records );
+	void apply( boost::int16_t code, const CPacketView &body );
+	void addItem( boost::shared_ptr<CPaintItem> item );
+	void checkpoint( void );
+
+private:
+	QString logPath_;
+	QString canvasPath_;
+	boost::thread thread_;
+
+	boost::mutex mutex_;
+	boost::condition_variable queued_;
+	std::deque< struct SRecord > queue_;
+	bool running_;
+	bool closing_;
+	bool checkpointOnClose_;
+
+	// writer thread
+	QFile log_;
+	qint64 logSize_;
+	ITEM_MAP items_;
+	boost::shared_ptr<CBackgroundImageItem> background_;
+	int windowWidth_;
+	int windowHeight_;
+	bool dirty_;	// applied since the last checkpoint
+};
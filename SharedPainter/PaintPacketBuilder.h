@@ -11,12 +11,11 @@ namespace PaintPacketBuilder
 	public:
 		static std::string make( boost::shared_ptr<CBackgroundImageItem> item )
 		{		
-			std::string data = item->generateData();
-
-			int pos = 0;
 			try
 			{
-				return CommonPacketBuilder::makePacket( CODE_PAINT_SET_BG_IMAGE, data );
+				CPacketWriter writer( CODE_PAINT_SET_BG_IMAGE, item->dataSize() );
+				item->writeData( writer );
+				return writer.packet();
 			}catch(...)
 			{
 
@@ -25,36 +24,43 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static boost::shared_ptr<CBackgroundImageItem> parse( const std::string &body )
+		static boost::shared_ptr<CBackgroundImageItem> parse( const CPacketView &body )
 		{		
-			boost::shared_ptr< CBackgroundImageItem > item;
+			boost::shared_ptr< CBackgroundImageItem > item( new CBackgroundImageItem );
 
-			try
-			{
-				item = boost::shared_ptr< CBackgroundImageItem >( new CBackgroundImageItem );
-				if( !item->loadData( body ) )
-				{
-					return boost::shared_ptr<CBackgroundImageItem>();
-				}
-			}catch(...)
-			{
+			CPacketReader reader( body );
+			if( !item->loadData( reader ) )
 				return boost::shared_ptr<CBackgroundImageItem>();
-			}
 
 			return item;
 		}
 	};
 
-	class CClearBackgroundImage
+	// only the changed tiles of the background image. (see CTileCodec)
+	class CSetBackgroundImageDelta
 	{
 	public:
-		static std::string make( void )
+		// | owner | width | height | tile size | keyframe | tile count | frame id | base id | (tile index | png) ... |
+		typedef PacketSchema::CFields< PacketSchema::String8, PacketSchema::Int16, PacketSchema::Int16, PacketSchema::Int16, PacketSchema::Int8, PacketSchema::Int32 > HeaderSchema;
+
+		static std::string make( const STileDelta &delta )
 		{		
-			int pos = 0;
 			try
 			{
-				std::string body;
-				return CommonPacketBuilder::makePacket( CODE_PAINT_CLEAR_BG_IMAGE, body );
+				size_t size = HeaderSchema::size( delta.owner, delta.width, delta.height, delta.tileSize, delta.keyframe, (boost::int32_t)delta.indexes.size() ) + 8;
+				for( size_t i = 0; i < delta.tiles.size(); i++ )
+					size += 4 + CPacketWriter::sizeString32( delta.tiles[i].size() );
+
+				CPacketWriter writer( CODE_PAINT_SET_BG_IMAGE_DELTA, size );
+				HeaderSchema::write( writer, delta.owner, delta.width, delta.height, delta.tileSize, delta.keyframe ? 1 : 0, (boost::int32_t)delta.indexes.size() );
+				writer.writeInt32( (boost::int32_t)delta.frameId );
+				writer.writeInt32( (boost::int32_t)delta.baseId );
+				for( size_t i = 0; i < delta.tiles.size(); i++ )
+				{
+					writer.writeInt32( delta.indexes[i] );
+					writer.writeString32( delta.tiles[i].constData(), delta.tiles[i].size() );
+				}
+				return writer.packet();
 			}catch(...)
 			{
 
@@ -63,18 +69,62 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static bool parse( const std::string &body )
+		static boost::shared_ptr<STileDelta> parse( const CPacketView &body )
 		{		
-			int pos = 0;
-			try
-			{
-				// NOTHING BODY
-				return true;
-			}catch(...)
+			CPacketReader reader( body );
+
+			CPacketView ownerView;
+			boost::int16_t width, height, tileSize;
+			boost::int8_t keyframe;
+			boost::int32_t count, frameId, baseId;
+			if( !HeaderSchema::read( reader, ownerView, width, height, tileSize, keyframe, count ) )
+				return boost::shared_ptr<STileDelta>();
+			if( !reader.readInt32( frameId ) || !reader.readInt32( baseId ) )
+				return boost::shared_ptr<STileDelta>();
+
+			// every tile takes 8 bytes at least, a count bigger than the body is broken.
+			if( count < 0 || (size_t)count > reader.remaining() / 8 )
+				return boost::shared_ptr<STileDelta>();
+
+			boost::shared_ptr<STileDelta> delta( new STileDelta );
+			delta->owner = ownerView.str();
+			delta->width = width;
+			delta->height = height;
+			delta->tileSize = tileSize;
+			delta->keyframe = keyframe != 0;
+			delta->frameId = (boost::uint32_t)frameId;
+			delta->baseId = (boost::uint32_t)baseId;
+			delta->indexes.reserve( count );
+			delta->tiles.reserve( count );
+
+			for( boost::int32_t i = 0; i < count; i++ )
 			{
-				return false;
+				boost::int32_t index;
+				CPacketView png;
+				if( !reader.readInt32( index ) || !reader.readString32( png ) )
+					return boost::shared_ptr<STileDelta>();
+
+				delta->indexes.push_back( index );
+				delta->tiles.push_back( QByteArray( png.data(), (int)png.size() ) );
 			}
-			return true;
+			return delta;
+		}
+	};
+
+	class CClearBackgroundImage
+	{
+	public:
+		// NOTHING BODY
+		typedef PacketSchema::CMessage< CODE_PAINT_CLEAR_BG_IMAGE > Schema;
+
+		static std::string make( void )
+		{		
+			return Schema::make();
+		}
+
+		static bool parse( const CPacketView &body )
+		{		
+			return Schema::parse( body );
 		}
 	};
 
@@ -83,11 +133,11 @@ namespace PaintPacketBuilder
 	public:
 		static std::string make( boost::shared_ptr<CPaintItem> item )
 		{		
-			std::string body = CPaintItem::generateBasicData( item->data() );
-
 			try
 			{
-				return CommonPacketBuilder::makePacket( CODE_PAINT_UPDATE_ITEM, body );
+				CPacketWriter writer( CODE_PAINT_UPDATE_ITEM, CPaintItem::basicDataSize( item->data() ) );
+				CPaintItem::writeBasicData( writer, item->data() );
+				return writer.packet();
 			}catch(...)
 			{
 				
@@ -96,10 +146,10 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static bool parse( const std::string &body, struct SPaintData &data )
+		static bool parse( const CPacketView &body, struct SPaintData &data )
 		{		
-			bool res = CPaintItem::loadBasicPaintData( body, data );
-			return res;
+			CPacketReader reader( body );
+			return CPaintItem::loadBasicPaintData( reader, data );
 		}
 	};
 
@@ -108,16 +158,15 @@ namespace PaintPacketBuilder
 	public:
 		static std::string make( boost::shared_ptr<CPaintItem> item )
 		{		
-			std::string body;
-			std::string data = item->generateData();
+			if( item->type() == PT_FILE || item->type() == PT_IMAGE_FILE )
+				return makeFile( boost::static_pointer_cast<CFileItem>(item) );
 
-			int pos = 0;
 			try
 			{
-				pos += CPacketBufferUtil::writeInt16( body, pos, item->type(), true );
-				body += data;
-
-				return CommonPacketBuilder::makePacket( CODE_PAINT_ADD_ITEM, body );
+				CPacketWriter writer( CODE_PAINT_ADD_ITEM, 2 + item->dataSize() );
+				writer.writeInt16( item->type() );
+				item->writeData( writer );
+				return writer.packet();
 			}catch(...)
 			{
 				
@@ -126,50 +175,57 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static boost::shared_ptr<CPaintItem> parse( const std::string &body )
-		{		
-			boost::shared_ptr< CPaintItem > item;
-
+		// the file is measured once for the size and the data.
+		static std::string makeFile( boost::shared_ptr<CFileItem> item )
+		{
 			try
 			{
-				int pos = 0;
-				boost::int16_t temptype;
-				pos += CPacketBufferUtil::readInt16( body, pos, temptype, true );
+				CFileItem::SFileSnapshot file = item->snapshot();
+				CPacketWriter writer( CODE_PAINT_ADD_ITEM, 2 + item->dataSize( file ) );
+				writer.writeInt16( item->type() );
+				item->writeData( writer, file );
+				return writer.packet();
+			}catch(...)
+			{
 
-				PaintItemType type = (PaintItemType)temptype;
+			}
 
-				item = CPaintItemFactory::createItem( type );
+			return "";
+		}
 
-				std::string itemData( (const char *)body.c_str() + pos, body.size() - pos );
-				if( !item->loadData( itemData ) )
-				{
-					return boost::shared_ptr<CPaintItem>();
-				}
-			}catch(...)
-			{
+		static boost::shared_ptr<CPaintItem> parse( const CPacketView &body )
+		{		
+			CPacketReader reader( body );
+
+			boost::int16_t temptype;
+			if( !reader.readInt16( temptype ) )
+				return boost::shared_ptr<CPaintItem>();
+
+			// the item data follows the type in the same body, no copy.
+			if( temptype < 0 || temptype >= PT_MAX || temptype == PT_BG_IMAGE )
+				return boost::shared_ptr<CPaintItem>();
+
+			boost::shared_ptr< CPaintItem > item = CPaintItemFactory::createItem( (PaintItemType)temptype );
+			if( !item || !item->loadData( reader ) )
 				return boost::shared_ptr<CPaintItem>();
-			}
 
 			return item;
 		}
 	};
 
-	class CMoveItem
+	class CAddCompactLine
 	{
 	public:
-		static std::string make( const std::string &owner, int itemId, double x, double y )
+		// curve : false flattens a curve for a peer without CAPABILITY_CURVE_STROKE.
+		static std::string make( boost::shared_ptr<CLineItem> item, bool curve = true, int fracBits = CStrokeCodec::DefaultFracBits )
 		{		
-			int pos = 0;
 			try
 			{
-				std::string body;
-				pos += CPacketBufferUtil::writeString8( body, pos, owner  );
-				pos += CPacketBufferUtil::writeInt32( body, pos, itemId, true );
-				pos += CPacketBufferUtil::writeDouble( body, pos, x, true );
-				pos += CPacketBufferUtil::writeDouble( body, pos, y, true );
-				pos = 0;
-
-				return CommonPacketBuilder::makePacket( CODE_PAINT_MOVE_ITEM, body );
+				std::string packed = item->packPoints( fracBits, curve );
+
+				CPacketWriter writer( CODE_PAINT_ADD_LINE_COMPACT, item->compactDataSize( packed, curve ) );
+				item->writeCompactData( writer, fracBits, packed, curve );
+				return writer.packet();
 			}catch(...)
 			{
 				
@@ -178,36 +234,62 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static bool parse( const std::string &body, std::string &owner, int &itemId, double &x, double &y )
+		static boost::shared_ptr<CLineItem> parse( const CPacketView &body )
 		{		
-			int pos = 0;
-			try
-			{
-				pos += CPacketBufferUtil::readString8( body, pos, owner );
-				pos += CPacketBufferUtil::readInt32( body, pos, itemId, true );
-				pos += CPacketBufferUtil::readDouble( body, pos, x, true );
-				pos += CPacketBufferUtil::readDouble( body, pos, y, true );
-			}catch(...)
-			{
+			boost::shared_ptr< CLineItem > item( new CLineItem );
+
+			CPacketReader reader( body );
+			if( !item->loadCompactData( reader ) )
+				return boost::shared_ptr<CLineItem>();
+
+			return item;
+		}
+	};
+
+	// in-progress stroke preview. (the stroke is committed by CAddItem or CAddCompactLine as before)
+	class CStrokeBegin
+	{
+	public:
+		// | owner | itemId | rgba | width |
+		typedef PacketSchema::CMessage< CODE_PAINT_STROKE_BEGIN, PacketSchema::String8, PacketSchema::Int32, PacketSchema::Int32, PacketSchema::Int16 > Schema;
+
+		static std::string make( boost::shared_ptr<CLineItem> line )
+		{		
+			return Schema::make( line->owner(), line->itemId(), (boost::int32_t)line->color().rgba(), line->width() );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, QColor &color, int &width )
+		{		
+			CPacketView ownerView;
+			boost::int32_t id, rgba;
+			boost::int16_t w;
+			if( !Schema::parse( body, ownerView, id, rgba, w ) )
 				return false;
-			}
+
+			owner = ownerView.str();
+			itemId = id;
+			color = QColor::fromRgba( (QRgb)rgba );
+			width = w;
 			return true;
 		}
 	};
 
-	class CRemoveItem
+	class CStrokeAppend
 	{
 	public:
-		static std::string make( const std::string &owner, int itemId )
+		// | owner | itemId | start index | fracBits | point count | packed points |
+		typedef PacketSchema::CFields< PacketSchema::String8, PacketSchema::Int32, PacketSchema::Int32, PacketSchema::Int8 > HeaderSchema;
+
+		static std::string make( const std::string &owner, int itemId, int startIndex, const std::vector<QPointF> &points, int fracBits = CStrokeCodec::DefaultFracBits )
 		{		
-			int pos = 0;
 			try
 			{
-				std::string body;
-				pos += CPacketBufferUtil::writeString8( body, pos, owner  );
-				pos += CPacketBufferUtil::writeInt32( body, pos, itemId, true );
+				std::string packed = CStrokeCodec::encodePoints( points, fracBits );
 
-				return CommonPacketBuilder::makePacket( CODE_PAINT_REMOVE_ITEM, body );
+				CPacketWriter writer( CODE_PAINT_STROKE_APPEND, HeaderSchema::size( owner, itemId, startIndex, fracBits ) + CStrokeCodec::pointsSize( packed ) );
+				HeaderSchema::write( writer, owner, itemId, startIndex, fracBits );
+				CStrokeCodec::writePoints( writer, points.size(), packed );
+				return writer.packet();
 			}catch(...)
 			{
 
@@ -216,31 +298,112 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static bool parse( const std::string &body, std::string &owner, int &itemId )
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, int &startIndex, std::vector<QPointF> &points )
 		{		
-			int pos = 0;
-			try
-			{
-				pos += CPacketBufferUtil::readString8( body, pos, owner );
-				pos += CPacketBufferUtil::readInt32( body, pos, itemId, true );
-			}catch(...)
-			{
+			CPacketReader reader( body );
+
+			CPacketView ownerView;
+			boost::int32_t id, start;
+			boost::int8_t fracBits;
+			if( !HeaderSchema::read( reader, ownerView, id, start, fracBits ) )
 				return false;
-			}
+
+			if( !CStrokeCodec::readPoints( reader, fracBits, points ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			startIndex = start;
 			return true;
 		}
 	};
 
-	class CClearScreen
+	class CStrokeEnd
 	{
 	public:
-		static std::string make( void )
+		// | owner | itemId |
+		typedef PacketSchema::CMessage< CODE_PAINT_STROKE_END, PacketSchema::String8, PacketSchema::Int32 > Schema;
+
+		static std::string make( const std::string &owner, int itemId )
+		{		
+			return Schema::make( owner, itemId );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId )
+		{		
+			CPacketView ownerView;
+			boost::int32_t id;
+			if( !Schema::parse( body, ownerView, id ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			return true;
+		}
+	};
+
+	class CMoveItem
+	{
+	public:
+		// | owner | itemId | x | y |
+		typedef PacketSchema::CMessage< CODE_PAINT_MOVE_ITEM, PacketSchema::String8, PacketSchema::Int32, PacketSchema::Double, PacketSchema::Double > Schema;
+
+		static std::string make( const std::string &owner, int itemId, double x, double y )
+		{		
+			return Schema::make( owner, itemId, x, y );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, double &x, double &y )
 		{		
-			int pos = 0;
+			CPacketView ownerView;
+			boost::int32_t id;
+			if( !Schema::parse( body, ownerView, id, x, y ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			return true;
+		}
+	};
+
+	class CRemoveItem
+	{
+	public:
+		// | owner | itemId |
+		typedef PacketSchema::CMessage< CODE_PAINT_REMOVE_ITEM, PacketSchema::String8, PacketSchema::Int32 > Schema;
+
+		static std::string make( const std::string &owner, int itemId )
+		{		
+			return Schema::make( owner, itemId );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId )
+		{		
+			CPacketView ownerView;
+			boost::int32_t id;
+			if( !Schema::parse( body, ownerView, id ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			return true;
+		}
+	};
+
+	// chunked file transfer. (see FileTransfer.h)
+	class CFileBegin
+	{
+	public:
+		// | type | item data | file name | file size |
+		static std::string make( boost::shared_ptr<CFileItem> item )
+		{
 			try
 			{
-				std::string body;
-				return CommonPacketBuilder::makePacket( CODE_PAINT_CLEAR_SCREEN, body );
+				CFileItem::SFileSnapshot file = item->snapshot();
+				CPacketWriter writer( CODE_FILE_BEGIN, 2 + item->metaDataSize( file ) );
+				writer.writeInt16( item->type() );
+				item->writeMetaData( writer, file );
+				return writer.packet();
 			}catch(...)
 			{
 
@@ -249,18 +412,138 @@ namespace PaintPacketBuilder
 			return "";
 		}
 
-		static bool parse( const std::string &body )
-		{		
-			int pos = 0;
+		static boost::shared_ptr<CFileItem> parse( const CPacketView &body, QString &fileName, size_t &size )
+		{
+			CPacketReader reader( body );
+
+			boost::int16_t temptype;
+			if( !reader.readInt16( temptype ) )
+				return boost::shared_ptr<CFileItem>();
+
+			if( temptype != PT_FILE && temptype != PT_IMAGE_FILE )
+				return boost::shared_ptr<CFileItem>();
+
+			boost::shared_ptr< CFileItem > item = boost::static_pointer_cast<CFileItem>( CPaintItemFactory::createItem( (PaintItemType)temptype ) );
+			if( !item || !item->loadMetaData( reader, fileName, size ) )
+				return boost::shared_ptr<CFileItem>();
+
+			return item;
+		}
+	};
+
+	// receiver -> sender : a file offset of an item.
+	// CFileRequest : the bytes it has already. CFileAck : the bytes written so far.
+	template< boost::int16_t Code >
+	class CFileOffset
+	{
+	public:
+		// | owner | itemId | offset |
+		typedef PacketSchema::CMessage< Code, PacketSchema::String8, PacketSchema::Int32, PacketSchema::Int32 > Schema;
+
+		static std::string make( const std::string &owner, int itemId, size_t offset )
+		{
+			return Schema::make( owner, itemId, (boost::int32_t)offset );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, size_t &offset )
+		{
+			CPacketView ownerView;
+			boost::int32_t id, off;
+			if( !Schema::parse( body, ownerView, id, off ) || off < 0 )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			offset = (size_t)off;
+			return true;
+		}
+	};
+
+	typedef CFileOffset< CODE_FILE_REQUEST > CFileRequest;
+	typedef CFileOffset< CODE_FILE_ACK > CFileAck;
+
+	class CFileChunk
+	{
+	public:
+		// | owner | itemId | offset | data |
+		typedef PacketSchema::CFields< PacketSchema::String8, PacketSchema::Int32, PacketSchema::Int32 > HeaderSchema;
+
+		static std::string make( const std::string &owner, int itemId, size_t offset, const std::string &data )
+		{
 			try
 			{
-				// NOTHING BODY
-				return true;
+				CPacketWriter writer( CODE_FILE_CHUNK, HeaderSchema::size( owner, itemId, (boost::int32_t)offset ) + CPacketWriter::sizeString32( data.size() ) );
+				HeaderSchema::write( writer, owner, itemId, (boost::int32_t)offset );
+				writer.writeString32( data.data(), data.size() );
+				return writer.packet();
 			}catch(...)
 			{
-				return false;
+
 			}
+
+			return "";
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, size_t &offset, std::string &data )
+		{
+			CPacketReader reader( body );
+
+			CPacketView ownerView, dataView;
+			boost::int32_t id, off;
+			if( !HeaderSchema::read( reader, ownerView, id, off ) || off < 0 )
+				return false;
+
+			if( !reader.readString32( dataView ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			offset = (size_t)off;
+			data.assign( dataView.data(), dataView.size() );
 			return true;
 		}
 	};
+
+	// sender -> receiver : the hash of the whole file, after the last chunk.
+	class CFileEnd
+	{
+	public:
+		// | owner | itemId | hash |
+		typedef PacketSchema::CMessage< CODE_FILE_END, PacketSchema::String8, PacketSchema::Int32, PacketSchema::String8 > Schema;
+
+		static std::string make( const std::string &owner, int itemId, const QByteArray &digest )
+		{
+			return Schema::make( owner, itemId, std::string( digest.constData(), digest.size() ) );
+		}
+
+		static bool parse( const CPacketView &body, std::string &owner, int &itemId, QByteArray &digest )
+		{
+			CPacketView ownerView, digestView;
+			boost::int32_t id;
+			if( !Schema::parse( body, ownerView, id, digestView ) )
+				return false;
+
+			owner = ownerView.str();
+			itemId = id;
+			digest = QByteArray( digestView.data(), (int)digestView.size() );
+			return true;
+		}
+	};
+
+	class CClearScreen
+	{
+	public:
+		// NOTHING BODY
+		typedef PacketSchema::CMessage< CODE_PAINT_CLEAR_SCREEN > Schema;
+
+		static std::string make( void )
+		{		
+			return Schema::make();
+		}
+
+		static bool parse( const CPacketView &body )
+		{		
+			return Schema::parse( body );
+		}
+	};
 };
@@ -3,6 +3,8 @@
 #include <boost/enable_shared_from_this.hpp>
 #include "PacketSlicer.h"
 #include "NetPeerSession.h"
+#include "PaintUser.h"
+#include "StreamCompressor.h"
 
 class CPaintSession;
 
@@ -13,6 +15,7 @@ public:
 	virtual void onIPaintSessionEvent_ConnectFailed( boost::shared_ptr<CPaintSession> session ) = 0;
 	virtual void onIPaintSessionEvent_ReceivedPacket( boost::shared_ptr<CPaintSession> session, const boost::shared_ptr<CPacketData> data ) = 0;
 	virtual void onIPaintSessionEvent_SendingPacket( boost::shared_ptr<CPaintSession> session, const boost::shared_ptr<CNetPacketData> data ) = 0;
+	virtual void onIPaintSessionEvent_SendQueue( boost::shared_ptr<CPaintSession> session, bool congested ) = 0;
 	virtual void onIPaintSessionEvent_Disconnected( boost::shared_ptr<CPaintSession> session ) = 0;
 };
 
@@ -22,6 +25,7 @@ public:
 	CPaintSession( boost::shared_ptr<CNetPeerSession> session, IPaintSessionEvent *evt ) : session_(session), evtTarget_(evt)
 	{
 		session_->setEvent( this );
+		packetSlicer_.setBoundaryCode( CODE_SYSTEM_STREAM_COMPRESSION );
 		qDebug() << "CPaintSession(void) " << this;
 	}
 	
@@ -47,6 +51,29 @@ public:
 		return session_;
 	}
 
+	// the received packets are read there, in order, off the strand of the network. (null : on the strand of the network)
+	// set before the session starts.
+	void setDecodeStrand( boost::shared_ptr<boost::asio::io_service::strand> strand ) { decodeStrand_ = strand; }
+	boost::shared_ptr<boost::asio::io_service::strand> decodeStrand( void ) { return decodeStrand_; }
+
+	// the user on the other end. (each side sends its own join packet first, so it is the first one received)
+	// set on the strand of this session, read by the handlers of the other sessions too.
+	void setPeerUser( boost::shared_ptr<CPaintUser> user )
+	{
+		boost::mutex::scoped_lock autolock( mutexPeer_ );
+		peerUser_ = user;
+	}
+	boost::shared_ptr<CPaintUser> peerUser( void )
+	{
+		boost::mutex::scoped_lock autolock( mutexPeer_ );
+		return peerUser_;
+	}
+	int peerCapabilities( void )
+	{
+		boost::shared_ptr<CPaintUser> user = peerUser();
+		return user ? user->capabilities() : 0;
+	}
+
 	virtual void onINetPeerSessionEvent_Connected( CNetPeerSession *session )
 	{
 		if( evtTarget_ )
@@ -57,36 +84,118 @@ public:
 		if( evtTarget_ )
 			evtTarget_->onIPaintSessionEvent_ConnectFailed( shared_from_this() );
 	}
-	virtual void onINetPeerSessionEvent_Received( CNetPeerSession *session, const std::string buffer )
+	virtual CIOBuffer::Segment onINetPeerSessionEvent_PrepareReceive( CNetPeerSession *session )
+	{
+		// a deflated stream is read aside and inflated into the slicer.
+		if( decompressor_ )
+			return compressedBuffer_.prepare( CPacketSlicer::DefaultReadSize );
+		return packetSlicer_.prepareBuffer();
+	}
+	virtual void onINetPeerSessionEvent_Received( CNetPeerSession *session, const CIOBuffer::Segment &prepared, size_t bytes )
+	{
+		if( decompressor_ )
+		{
+			compressedBuffer_.commit( prepared, bytes );
+			inflateReceived();
+			return;
+		}
+
+		packetSlicer_.commitBuffer( prepared, bytes );
+		dispatchReceived();
+	}
+	virtual void onINetPeerSessionEvent_Disconnected( CNetPeerSession *session )
+	{
+		if( evtTarget_ )
+			evtTarget_->onIPaintSessionEvent_Disconnected( shared_from_this() );
+	}
+	virtual void onINetPeerSessionEvent_Sending( CNetPeerSession *session, boost::shared_ptr<CNetPacketData> packet )
+	{
+		if( evtTarget_ )
+			evtTarget_->onIPaintSessionEvent_SendingPacket( shared_from_this(), packet );
+	}
+	virtual void onINetPeerSessionEvent_SendQueue( CNetPeerSession *session, bool congested )
 	{
-		packetSlicer_.addBuffer( buffer );
+		if( evtTarget_ )
+			evtTarget_->onIPaintSessionEvent_SendQueue( shared_from_this(), congested );
+	}
 
+private:
+	void dispatchReceived( void )
+	{
 		if( packetSlicer_.parse() == false )
 			return;
 
+		bool switched = false;
 		for( size_t i = 0; i < packetSlicer_.parsedItemCount(); i++ )
 		{
 			boost::shared_ptr<CPacketData> data = packetSlicer_.parsedItem( i );
 
+			// the boundary packet is the last one, the rest of the buffer is deflated.
+			if( data->code == CODE_SYSTEM_STREAM_COMPRESSION )
+			{
+				switched = true;
+				break;
+			}
+
 			if( evtTarget_ )
 				evtTarget_->onIPaintSessionEvent_ReceivedPacket( shared_from_this(), data );
 		}
+
+		if( switched && !decompressor_ )
+		{
+			decompressor_ = boost::shared_ptr<CStreamDecompressor>( new CStreamDecompressor );
+			packetSlicer_.setBoundaryCode( -1 );
+			compressedBuffer_ = packetSlicer_.takeBuffer();
+			inflateReceived();
+		}
 	}
-	virtual void onINetPeerSessionEvent_Disconnected( CNetPeerSession *session )
-	{
-		if( evtTarget_ )
-			evtTarget_->onIPaintSessionEvent_Disconnected( shared_from_this() );
-	}
-	virtual void onINetPeerSessionEvent_Sending( CNetPeerSession *session, boost::shared_ptr<CNetPacketData> packet )
+
+	void inflateReceived( void )
 	{
-		if( evtTarget_ )
-			evtTarget_->onIPaintSessionEvent_SendingPacket( shared_from_this(), packet );
+		while( true )
+		{
+			const char *in = NULL;
+			size_t inSize = 0;
+			if( compressedBuffer_.segmentCount() > 0 )
+			{
+				in = compressedBuffer_.segment( 0 ).data();
+				inSize = compressedBuffer_.segment( 0 ).length;
+			}
+
+			CIOBuffer::Segment out = packetSlicer_.prepareBuffer();
+			size_t consumed = 0, produced = 0;
+			bool ok = decompressor_->decompress( in, inSize, consumed, out.slab->data() + out.offset, out.length, produced );
+
+			compressedBuffer_.trimFront( consumed );
+			packetSlicer_.commitBuffer( out, produced );
+
+			if( !ok )
+			{
+				qDebug() << "CPaintSession : broken compressed stream " << this;
+				close();
+				return;
+			}
+
+			if( produced > 0 )
+				dispatchReceived();
+
+			// the output had room left : all the input so far is inflated.
+			if( produced < out.length && compressedBuffer_.empty() )
+				break;
+			if( consumed == 0 && produced == 0 )
+				break;
+		}
 	}
 
 private:
 	IPaintSessionEvent *evtTarget_;
 	boost::shared_ptr<CNetPeerSession> session_;
 	CPacketSlicer packetSlicer_;
+	boost::shared_ptr<CStreamDecompressor> decompressor_;
+	CIOBuffer compressedBuffer_;	// received, not inflated yet
+	boost::shared_ptr<CPaintUser> peerUser_;
+	boost::mutex mutexPeer_;
+	boost::shared_ptr<boost::asio::io_service::strand> decodeStrand_;
 
 	std::deque< boost::shared_ptr<CNetPacketData> > packetList_;
 };
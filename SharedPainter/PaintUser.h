@@ -2,7 +2,10 @@
 
 struct SPaintUserInfoData
 {
+	SPaintUserInfoData( void ) : capabilities(0) { }
+
 	std::string userId;
+	int capabilities;	// SharedPaintCapability bits
 };
 
 class CPaintUser
@@ -16,6 +19,8 @@ public:
 	void loadData( const struct SPaintUserInfoData &info ) { data_ = info; }
 
 	const std::string &userId( void ) { return data_.userId; }
+	int capabilities( void ) { return data_.capabilities; }
+	bool supports( int capability ) { return (data_.capabilities & capability) == capability; }
 
 private:
 	int sessionId_;
@@ -29,6 +29,22 @@ void CSettingManager::load( void )
 	settings.beginGroup( "network" );
 	peerAddress_ = settings.value( "peerAddress" ).toString().toStdString();
 	broadCastChannel_ = settings.value( "broadCastChannel" ).toString().toStdString();
+	networkThreadCount_ = settings.value( "threadCount", 0 ).toInt();	// a thread per core
+	networkPinThreads_ = settings.value( "pinThreads", false ).toBool();
+	sendQueueLimitMB_ = settings.value( "sendQueueLimitMB", 64 ).toInt();
+	sendQueueLimitPackets_ = settings.value( "sendQueueLimitPackets", 16 * 1024 ).toInt();
+	sendQueuePolicy_ = settings.value( "sendQueuePolicy", 3 ).toInt();	// drop superseded, pause bulk
+	stateSendRate_ = settings.value( "stateSendRate", 20 ).toInt();
+	writeDelayMs_ = settings.value( "writeDelayMs", 0 ).toInt();
+	settings.endGroup();
+
+	settings.beginGroup( "paint" );
+	strokeMode_ = settings.value( "strokeMode", 0 ).toInt();	// off, 1 : simplify, 2 : curve
+	strokeTolerance_ = settings.value( "strokeTolerance", 0.5 ).toDouble();
+	settings.endGroup();
+
+	settings.beginGroup( "file" );
+	fileStoreCapacityMB_ = settings.value( "storeCapacityMB", 1024 ).toInt();
 	settings.endGroup();
 }
 
@@ -39,5 +55,21 @@ void CSettingManager::save( void )
 	settings.beginGroup( "network" );
 	settings.setValue( "peerAddress", peerAddress_.c_str() );
 	settings.setValue( "broadCastChannel", broadCastChannel_.c_str() );
+	settings.setValue( "threadCount", networkThreadCount_ );
+	settings.setValue( "pinThreads", networkPinThreads_ );
+	settings.setValue( "sendQueueLimitMB", sendQueueLimitMB_ );
+	settings.setValue( "sendQueueLimitPackets", sendQueueLimitPackets_ );
+	settings.setValue( "sendQueuePolicy", sendQueuePolicy_ );
+	settings.setValue( "stateSendRate", stateSendRate_ );
+	settings.setValue( "writeDelayMs", writeDelayMs_ );
+	settings.endGroup();
+
+	settings.beginGroup( "paint" );
+	settings.setValue( "strokeMode", strokeMode_ );
+	settings.setValue( "strokeTolerance", strokeTolerance_ );
+	settings.endGroup();
+
+	settings.beginGroup( "file" );
+	settings.setValue( "storeCapacityMB", fileStoreCapacityMB_ );
 	settings.endGroup();
 }
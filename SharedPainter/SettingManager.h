@@ -24,6 +24,28 @@ public:
 		broadCastChannel_ = channel;
 	}
 
+	// free pen stroke reduction. (CStrokeProcessor::Mode, pixel tolerance)
+	int strokeMode( void ) { return strokeMode_; }
+	double strokeTolerance( void ) { return strokeTolerance_; }
+
+	// the size cap of the received files in bytes. (CFileStore)
+	qint64 fileStoreCapacity( void ) { return (qint64)fileStoreCapacityMB_ * 1024 * 1024; }
+
+	// the network threads, 0 : one per core. pinned : one core for each. (CNetServiceRunner)
+	int networkThreadCount( void ) { return networkThreadCount_; }
+	bool networkPinThreads( void ) { return networkPinThreads_; }
+
+	// what a slow peer may queue. (CNetPeerSession::setSendQueueLimit)
+	size_t sendQueueBytes( void ) { return (size_t)sendQueueLimitMB_ * 1024 * 1024; }
+	size_t sendQueuePackets( void ) { return (size_t)sendQueueLimitPackets_; }
+	int sendQueuePolicy( void ) { return sendQueuePolicy_; }
+
+	// how long a packet waits to go in one write with the others, 0 : the end of the network turn. (CNetPeerSession::setWriteDelay)
+	int writeDelayMs( void ) { return writeDelayMs_; }
+
+	// the moves, scales and resizes of a key per second, 0 : every one. (CSharedPaintManager::sendStateToUsers)
+	int stateSendRate( void ) { return stateSendRate_; }
+
 	void load( void );
 	void save( void );
 
@@ -33,5 +55,15 @@ protected slots:
 private:
 	std::string broadCastChannel_;
 	std::string peerAddress_;
+	int strokeMode_;
+	double strokeTolerance_;
+	int fileStoreCapacityMB_;
+	int networkThreadCount_;
+	bool networkPinThreads_;
+	int sendQueueLimitMB_;
+	int sendQueueLimitPackets_;
+	int sendQueuePolicy_;
+	int writeDelayMs_;
+	int stateSendRate_;
 	QTimer *timer_;
 };
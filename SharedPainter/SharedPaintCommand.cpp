@@ -5,9 +5,9 @@
 bool CAddItemCommand::execute( void )
 {
 	manager_->addPaintItem( item_ );
+	manager_->journalAddItem( item_ );
 
-	std::string msg = PaintPacketBuilder::CAddItem::make( item_ );
-	int packetId = manager_->sendDataToUsers( msg );
+	int packetId = manager_->sendAddItemPacket( item_ );
 	item_->setPacketId( packetId );
 	return true;
 }
@@ -15,6 +15,7 @@ bool CAddItemCommand::execute( void )
 void CAddItemCommand::undo( void )
 {
 	std::string msg = PaintPacketBuilder::CRemoveItem::make( item_->owner(), item_->itemId() );
+	manager_->journalPacket( msg );
 	manager_->sendDataToUsers( msg );
 	manager_->removePaintItem( item_->owner(), item_->itemId() );
 }
@@ -23,6 +24,7 @@ void CAddItemCommand::undo( void )
 bool CRemoveItemCommand::execute( void )
 {
 	std::string msg = PaintPacketBuilder::CRemoveItem::make( item_->owner(), item_->itemId() );
+	manager_->journalPacket( msg );
 	manager_->sendDataToUsers( msg );
 	manager_->removePaintItem( item_->owner(), item_->itemId() );
 
@@ -32,9 +34,9 @@ bool CRemoveItemCommand::execute( void )
 void CRemoveItemCommand::undo( void )
 {
 	manager_->addPaintItem( item_ );
+	manager_->journalAddItem( item_ );
 
-	std::string msg = PaintPacketBuilder::CAddItem::make( item_ );
-	int packetId = manager_->sendDataToUsers( msg );
+	int packetId = manager_->sendAddItemPacket( item_ );
 	item_->setPacketId( packetId );
 }
 
@@ -45,7 +47,8 @@ bool CUpdateItemCommand::execute( void )
 	manager_->updatePaintItem( item_ );
 
 	std::string msg = PaintPacketBuilder::CUpdateItem::make( item_ );
-	int packetId = manager_->sendDataToUsers( msg );
+	manager_->journalPacket( msg );
+	int packetId = manager_->sendStateToUsers( msg, CSharedPaintManager::stateKey( CODE_PAINT_UPDATE_ITEM, item_->owner(), item_->itemId() ) );
 	item_->setPacketId( packetId );
 	return true;
 }
@@ -57,7 +60,8 @@ void CUpdateItemCommand::undo( void )
 	manager_->updatePaintItem( item_ );
 
 	std::string msg = PaintPacketBuilder::CUpdateItem::make( item_ );
-	int packetId = manager_->sendDataToUsers( msg );
+	manager_->journalPacket( msg );
+	int packetId = manager_->sendStateToUsers( msg, CSharedPaintManager::stateKey( CODE_PAINT_UPDATE_ITEM, item_->owner(), item_->itemId() ) );
 	item_->setPacketId( packetId );
 }
 
@@ -68,7 +72,8 @@ bool CMoveItemCommand::execute( void )
 	prevY_ = item_->prevData().posY;
 
 	std::string msg = PaintPacketBuilder::CMoveItem::make( item_->owner(), item_->itemId(), item_->posX(), item_->posY() );
-	manager_->sendDataToUsers( msg );
+	manager_->journalPacket( msg );
+	manager_->sendStateToUsers( msg, CSharedPaintManager::stateKey( CODE_PAINT_MOVE_ITEM, item_->owner(), item_->itemId() ) );
 	return true;
 }
 
@@ -77,5 +82,6 @@ void CMoveItemCommand::undo( void )
 	item_->move( prevX_, prevY_ );
 
 	std::string msg = PaintPacketBuilder::CMoveItem::make( item_->owner(), item_->itemId(), item_->posX(), item_->posY() );
-	manager_->sendDataToUsers( msg );
+	manager_->journalPacket( msg );
+	manager_->sendStateToUsers( msg, CSharedPaintManager::stateKey( CODE_PAINT_MOVE_ITEM, item_->owner(), item_->itemId() ) );
 }
@@ -44,8 +44,12 @@ static std::string getMyIPAddress( void )
 }
 
 CSharedPaintManager::CSharedPaintManager(void) : canvas_(NULL), acceptPort_(-1), serverMode_(false)
-, lastWindowWidth_(0), lastWindowHeight_(0)
-, lastPacketId_(-1)
+, lastWindowWidth_(0), lastWindowHeight_(0), liveStrokeSentCount_(0)
+, sendQueueBytes_(CNetPeerSession::DefaultSendQueueBytes), sendQueuePackets_(CNetPeerSession::DefaultSendQueuePackets)
+, sendQueuePolicy_(CNetPeerSession::POLICY_DROP_SUPERSEDED | CNetPeerSession::POLICY_PAUSE_BULK)
+, writeDelayMs_(CNetPeerSession::DefaultWriteDelayMs)
+, pendingStateCount_(0), stateSeq_(0), stateIntervalMs_(DefaultStateIntervalMs), stateTimerArmed_(false)
+, lastPacketId_(-1), decodeSeq_(0), appliedSeq_(0)
 {
 	// default generate my id
 	myId_ = generateMyId();
@@ -53,6 +57,7 @@ CSharedPaintManager::CSharedPaintManager(void) : canvas_(NULL), acceptPort_(-1),
 	// create my user info
 	struct SPaintUserInfoData data;
 	data.userId = myId_;
+	data.capabilities = SUPPORTED_CAPABILITIES;
 
 	myUserInfo_ = boost::shared_ptr<CPaintUser>(new CPaintUser);
 	myUserInfo_->loadData( data );
@@ -63,6 +68,16 @@ CSharedPaintManager::~CSharedPaintManager(void)
 	close();
 }
 
+static boost::mutex packetIdMutex;
+static int packetIdPool = 0;
+
+int CSharedPaintManager::generatePacketId( void )
+{
+	// the relay of every session thread asks too.
+	boost::mutex::scoped_lock autolock( packetIdMutex );
+	return ++packetIdPool;
+}
+
 bool CSharedPaintManager::startClient( void )
 {
 	clearAllSessions();
@@ -81,6 +96,7 @@ bool CSharedPaintManager::startClient( void )
 	{
 		if( serverMode_ )
 		{
+			journal_.close();	// the log stays for the next server start
 			clearAllItems();
 			serverMode_ = false;
 		}
@@ -134,22 +150,44 @@ void CSharedPaintManager::startServer( const std::string &broadCastChannel, int
 }
 
 
-void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession> session, boost::shared_ptr<CPacketData> packetData )
+void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession> session, boost::shared_ptr<CPacketData> packetData, MAIN_THREAD_CALLS &calls )
 {
+	// the parsers read straight from the received bytes. (coalesce copies only if the body spans slabs)
+	const CPacketView body( packetData->body.coalesce(), packetData->body.size() );
+
+	// the changes go to the journal in the order they are applied. (a file item by its path, see CPaintJournal)
+	if( isJournalCode( packetData->code ) )
+		calls.push_back( boost::bind( &CSharedPaintManager::_journalPacket, this, packetData ) );
+
 	switch( packetData->code )
 	{
 	case CODE_SYSTEM_JOIN:
 		{
-			boost::shared_ptr<CPaintUser> user = SystemPacketBuilder::CJoinerUser::parse( packetData->body );
+			boost::shared_ptr<CPaintUser> user = SystemPacketBuilder::CJoinerUser::parse( body );
+			if( !user )
+				break;
 			user->setSessionId( session->sessionId() );
 
+			bool firstJoin = !session->peerUser();
+			if( firstJoin )
+			{
+				session->setPeerUser( user );
+
+				// one deflate stream for the rest of the connection. (the sync data too)
+				if( user->supports( CAPABILITY_STREAM_COMPRESSION ) && myUserInfo_->supports( CAPABILITY_STREAM_COMPRESSION ) )
+					session->session()->startStreamCompression( SystemPacketBuilder::CStreamCompression::make() );
+			}
 			addUser( user );
+
+			// the sync data is encoded for the capabilities in this packet, so it waits for the join.
+			if( isServerMode() && firstJoin )
+				calls.push_back( boost::bind( &CSharedPaintManager::sendAllSyncData, this, session->sessionId() ) );
 		}
 		break;
 	case CODE_SYSTEM_LEFT:
 		{
 			std::string userId;
-			if( SystemPacketBuilder::CLeftUser::parse( packetData->body, userId ) )
+			if( SystemPacketBuilder::CLeftUser::parse( body, userId ) )
 			{
 				removeUser( userId );
 			}
@@ -157,40 +195,140 @@ void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession>
 		break;
 	case CODE_PAINT_CLEAR_SCREEN:
 		{
-			PaintPacketBuilder::CClearScreen::parse( packetData->body );	// nothing to do..
-			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_ClearScreen, this ) );
+			PaintPacketBuilder::CClearScreen::parse( body );	// nothing to do..
+			calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_ClearScreen, this ) );
 		}
 		break;
 	case CODE_PAINT_CLEAR_BG_IMAGE:
 		{
-			PaintPacketBuilder::CClearScreen::parse( packetData->body );	// nothing to do..
-			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_ClearBackgroundImage, this ) );
+			PaintPacketBuilder::CClearScreen::parse( body );	// nothing to do..
+			calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_ClearBackgroundImage, this ) );
 		}
 		break;
 	case CODE_PAINT_SET_BG_IMAGE:
 		{
-			boost::shared_ptr<CBackgroundImageItem> image = PaintPacketBuilder::CSetBackgroundImage::parse( packetData->body );
-			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_SetBackgroundImage, this, image ) );
+			boost::shared_ptr<CBackgroundImageItem> image = PaintPacketBuilder::CSetBackgroundImage::parse( body );
+			calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_SetBackgroundImage, this, image ) );
+		}
+		break;
+	case CODE_PAINT_SET_BG_IMAGE_DELTA:
+		{
+			boost::shared_ptr<STileDelta> delta = PaintPacketBuilder::CSetBackgroundImageDelta::parse( body );
+			if( delta )
+				calls.push_back( boost::bind( &CSharedPaintManager::_applyBackgroundImageDelta, this, delta, session->sessionId() ) );
 		}
 		break;
 	case CODE_PAINT_ADD_ITEM:
 		{
-			boost::shared_ptr<CPaintItem> item = PaintPacketBuilder::CAddItem::parse( packetData->body );
+			boost::shared_ptr<CPaintItem> item = PaintPacketBuilder::CAddItem::parse( body );
 			if( item )
-				addPaintItem( item );
+			{
+				if( isFileItem( item ) )
+					calls.push_back( boost::bind( &CPaintJournal::appendFileItem, &journal_, boost::static_pointer_cast<CFileItem>(item) ) );
+				else
+					calls.push_back( boost::bind( &CSharedPaintManager::_journalPacket, this, packetData ) );
+				calls.push_back( boost::bind( &CSharedPaintManager::addPaintItem, this, item ) );
+			}
+		}
+		break;
+	case CODE_PAINT_ADD_LINE_COMPACT:
+		{
+			boost::shared_ptr<CLineItem> item = PaintPacketBuilder::CAddCompactLine::parse( body );
+			if( item )
+				calls.push_back( boost::bind( &CSharedPaintManager::addPaintItem, this, item ) );
+		}
+		break;
+	case CODE_FILE_BEGIN:
+		{
+			QString fileName;
+			size_t size;
+			boost::shared_ptr<CFileItem> item = PaintPacketBuilder::CFileBegin::parse( body, fileName, size );
+			if( item )
+				calls.push_back( boost::bind( &CSharedPaintManager::_beginFileReceive, this, item, fileName, size, session->sessionId() ) );
+		}
+		break;
+	case CODE_FILE_REQUEST:
+		{
+			std::string owner;
+			int itemId;
+			size_t offset;
+			if( PaintPacketBuilder::CFileRequest::parse( body, owner, itemId, offset ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_onFileRequest, this, session->sessionId(), owner, itemId, offset ) );
+			}
+		}
+		break;
+	case CODE_FILE_CHUNK:
+		{
+			std::string owner, data;
+			int itemId;
+			size_t offset;
+			if( PaintPacketBuilder::CFileChunk::parse( body, owner, itemId, offset, data ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_receiveFileChunk, this, owner, itemId, offset, data ) );
+			}
+		}
+		break;
+	case CODE_FILE_ACK:
+		{
+			std::string owner;
+			int itemId;
+			size_t offset;
+			if( PaintPacketBuilder::CFileAck::parse( body, owner, itemId, offset ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_onFileAck, this, session->sessionId(), owner, itemId, offset ) );
+			}
+		}
+		break;
+	case CODE_FILE_END:
+		{
+			std::string owner;
+			int itemId;
+			QByteArray digest;
+			if( PaintPacketBuilder::CFileEnd::parse( body, owner, itemId, digest ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_onFileEnd, this, owner, itemId, digest ) );
+			}
+		}
+		break;
+	case CODE_PAINT_STROKE_BEGIN:
+		{
+			std::string owner;
+			int itemId, width;
+			QColor color;
+			if( PaintPacketBuilder::CStrokeBegin::parse( body, owner, itemId, color, width ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_beginRemoteStroke, this, owner, itemId, color, width ) );
+			}
+		}
+		break;
+	case CODE_PAINT_STROKE_APPEND:
+		{
+			std::string owner;
+			int itemId, startIndex;
+			std::vector<QPointF> points;
+			if( PaintPacketBuilder::CStrokeAppend::parse( body, owner, itemId, startIndex, points ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_appendRemoteStroke, this, owner, itemId, startIndex, points ) );
+			}
+		}
+		break;
+	case CODE_PAINT_STROKE_END:
+		{
+			std::string owner;
+			int itemId;
+			if( PaintPacketBuilder::CStrokeEnd::parse( body, owner, itemId ) )
+			{
+				calls.push_back( boost::bind( &CSharedPaintManager::_endRemoteStroke, this, owner, itemId ) );
+			}
 		}
 		break;
 	case CODE_PAINT_UPDATE_ITEM:
 		{
 			struct SPaintData data;
-			if( PaintPacketBuilder::CUpdateItem::parse( packetData->body, data ) )
+			if( PaintPacketBuilder::CUpdateItem::parse( body, data ) )
 			{
-				boost::shared_ptr<CPaintItem> item = findItem( data.owner, data.itemId );
-				if( item )
-				{
-					item->setData( data );
-					updatePaintItem( item );
-				}
+				calls.push_back( boost::bind( &CSharedPaintManager::_updateRemoteItem, this, data ) );
 			}
 		}
 		break;
@@ -198,9 +336,9 @@ void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession>
 		{
 			std::string owner;
 			int itemId;
-			if( PaintPacketBuilder::CRemoveItem::parse( packetData->body, owner, itemId ) )
+			if( PaintPacketBuilder::CRemoveItem::parse( body, owner, itemId ) )
 			{
-				caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_RemovePaintItem, this, owner, itemId ) );
+				calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_RemovePaintItem, this, owner, itemId ) );
 			}
 		}
 		break;
@@ -209,9 +347,9 @@ void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession>
 			std::string owner;
 			double x, y;
 			int itemId;
-			if( PaintPacketBuilder::CMoveItem::parse( packetData->body, owner, itemId, x, y ) )
+			if( PaintPacketBuilder::CMoveItem::parse( body, owner, itemId, x, y ) )
 			{
-				caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_MovePaintItem, this, owner, itemId, x, y ) );
+				calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_MovePaintItem, this, owner, itemId, x, y ) );
 			}
 		}
 		break;
@@ -219,11 +357,11 @@ void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession>
 		{
 			std::string owner;
 			int width, height;
-			if( WindowPacketBuilder::CResizeMainWindow::parse( packetData->body, width, height ) )
+			if( WindowPacketBuilder::CResizeMainWindow::parse( body, width, height ) )
 			{
 				if( width <= 0 || height <= 0 )
 					return;
-				caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_ResizeMainWindow, this, width, height ) );
+				calls.push_back( boost::bind( &CSharedPaintManager::fireObserver_ResizeMainWindow, this, width, height ) );
 			}
 		}
 		break;
@@ -232,13 +370,16 @@ void CSharedPaintManager::dispatchPaintPacket( boost::shared_ptr<CPaintSession>
 
 void CSharedPaintManager::dispatchBroadCastPacket( boost::shared_ptr<CPacketData> packetData )
 {
+	// the parsers read straight from the received bytes. (coalesce copies only if the body spans slabs)
+	const CPacketView body( packetData->body.coalesce(), packetData->body.size() );
+
 	switch( packetData->code )
 	{
 	case CODE_BROAD_SERVER_INFO:
 		{
 			std::string addr, broadcastChannel;
 			int port;
-			if( BroadCastPacketBuilder::CServerInfo::parse( packetData->body, broadcastChannel, addr, port ) )
+			if( BroadCastPacketBuilder::CServerInfo::parse( body, broadcastChannel, addr, port ) )
 			{
 				caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_GetServerInfo, this, broadcastChannel, addr, port ) );
 			}
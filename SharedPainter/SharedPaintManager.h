@@ -17,6 +17,10 @@
 #include "NetBroadCastSession.h"
 #include "NetServiceRunner.h"
 #include "PaintUser.h"
+#include "FileTransfer.h"
+#include "CanvasFile.h"
+#include "PaintJournal.h"
+#include "WorkerPool.h"
 
 #define SharePaintManagerPtr()		CSingleton<CSharedPaintManager>::Instance()
 
@@ -39,6 +43,7 @@ public:
 	virtual void onISharedPaintEvent_ClearScreen( CSharedPaintManager *self ) = 0;
 	virtual void onISharedPaintEvent_ClearBackgroundImage( CSharedPaintManager *self ) = 0;
 	virtual void onISharedPaintEvent_UpdatePaintUser( CSharedPaintManager *self, boost::shared_ptr<CPaintUser> user ) = 0;
+	virtual void onISharedPaintEvent_RestoreFailed( CSharedPaintManager *self, const QString &path ) = 0;
 };
 
 
@@ -77,6 +82,32 @@ public:
 		canvas_ = canvas;
 	}
 
+	// the size cap of the received files. (see CFileStore)
+	void setFileStoreCapacity( qint64 capacity )
+	{
+		fileWriter_.post( boost::bind( &CFileStore::setCapacity, &fileStore_, capacity ) );
+	}
+
+	// how long a packet waits for the others to go in one write. (see CNetPeerSession::setWriteDelay)
+	void setWriteDelay( int ms )
+	{
+		writeDelayMs_ = ms;
+	}
+
+	// the threads of the network. (see CNetServiceRunner, before the first connection)
+	void setNetworkThreadCount( int count, bool pinThreads )
+	{
+		netRunner_.setThreadCount( count, pinThreads );
+	}
+
+	// what a slow peer may queue. (see CNetPeerSession::setSendQueueLimit, the sessions made after it)
+	void setSendQueueLimit( size_t maxBytes, size_t maxPackets, int policy )
+	{
+		sendQueueBytes_ = maxBytes;
+		sendQueuePackets_ = maxPackets;
+		sendQueuePolicy_ = policy;
+	}
+
 	void registerObserver( ISharedPaintEvent *obs )
 	{
 		observers_.remove( obs );
@@ -100,6 +131,8 @@ public:
 		clearAllUsers();
 
 		boost::shared_ptr<CNetPeerSession> session = netRunner_.newSession();
+		session->setSendQueueLimit( sendQueueBytes_, sendQueuePackets_, sendQueuePolicy_ );
+		session->setWriteDelay( writeDelayMs_ );
 		boost::shared_ptr<CPaintSession> userSession = boost::shared_ptr<CPaintSession>(new CPaintSession(session, this));
 
 		mutexSession_.lock();
@@ -155,10 +188,37 @@ public:
 
 	int sendDataToUsers( const std::vector<boost::shared_ptr<CPaintSession>> &sessionList, const std::string &msg, int toSessionId = -1 )
 	{
-		static int PACKETID = 0;
+		return sendDataToUsers( sessionList, makePayload( msg ), toSessionId );
+	}
+
+	int sendDataToUsers( const std::vector<boost::shared_ptr<CPaintSession>> &sessionList, const CIOBuffer &msg, int toSessionId = -1 )
+	{
+		return sendDataToUsers( sessionList, makePayload( msg ), toSessionId );
+	}
+
+	static int generatePacketId( void );	// any thread
+
+	int sendDataToUsers( const std::vector<boost::shared_ptr<CPaintSession>> &sessionList, const PAYLOAD_PTR &msg, int toSessionId = -1 )
+	{
+		return sendDataToUsersWithId( sessionList, msg, toSessionId, generatePacketId() );
+	}
+
+	// every session shares the payload and keeps its own write cursor. (one copy for any number of joiners)
+	// compress : false sends the payload as it is. (a relayed frame)
+	// key : the state key of the message, a congested session may drop it for a later one. (see stateKey)
+	int sendDataToUsersWithId( const std::vector<boost::shared_ptr<CPaintSession>> &sessionList, const PAYLOAD_PTR &msg, int toSessionId, int packetId, bool compress = true, const std::string &key = std::string() )
+	{
 		int sendCnt = 0;
-		int packetId = ++PACKETID;
 		std::vector<struct send_byte_info_t> infolist;
+		std::vector< std::pair< boost::shared_ptr<CPaintSession>, boost::shared_ptr<CNetPacketData> > > sendList;
+
+		// compressed once for all the sessions which can read it.
+		PAYLOAD_PTR compressed;
+		bool compressTried = false;
+
+		// the waiting states go first, an event does not pass them. (see sendStateToUsers)
+		if( key.empty() && caller_.isMainThread() )
+			flushStates();
 
 		SESSION_LIST::const_iterator it = sessionList.begin();
 		for( ; it != sessionList.end(); it++ )
@@ -168,38 +228,120 @@ public:
 				if( toSessionId >= 0 && (*it)->sessionId() != toSessionId )
 					continue;
 
+				// a compressed stream compresses the bodies already.
+				PAYLOAD_PTR payload = msg;
+				if( compress && ((*it)->peerCapabilities() & CAPABILITY_COMPRESSION) && !(*it)->session()->isStreamCompressed() )
+				{
+					if( !compressTried )
+					{
+						compressed = CPacketCompressor::compress( *msg );
+						compressTried = true;
+					}
+					if( compressed )
+						payload = compressed;
+				}
+
 				struct send_byte_info_t info;
 				info.session = (*it).get();
-				info.totalBytes = msg.size();
+				info.totalBytes = payload->size();
 				info.wroteBytes = 0;
 
 				infolist.push_back( info );
-				boost::shared_ptr<CNetPacketData> packet = boost::shared_ptr<CNetPacketData>(new CNetPacketData( packetId, msg ) );
-				(*it)->session()->sendData( packet );
+				boost::shared_ptr<CNetPacketData> packet = boost::shared_ptr<CNetPacketData>(new CNetPacketData( packetId, payload ) );
+				packet->setSupersedeKey( key );
+				sendList.push_back( std::make_pair( *it, packet ) );
 				sendCnt ++;
 			}
 		}
 
-		if ( sendCnt > 0 )
-		{
-			mutexSendInfo_.lock();
-			sendInfoDataMap_.insert( send_info_map_t::value_type( packetId, infolist ) );
-			lastPacketId_ = packetId;
-			mutexSendInfo_.unlock();
-		}
-		else
-			packetId = -1;
+		if ( sendCnt <= 0 )
+			return -1;
+
+		// registered before the first write starts, the pool may finish it before this returns.
+		mutexSendInfo_.lock();
+		sendInfoDataMap_.insert( send_info_map_t::value_type( packetId, infolist ) );
+		lastPacketId_ = packetId;
+		mutexSendInfo_.unlock();
+
+		for( size_t i = 0; i < sendList.size(); i++ )
+			sendList[i].first->session()->sendData( sendList[i].second );
 
 		return packetId;
 	}
 
 	int sendDataToUsers( const std::string &msg, int toSessionId = -1 )
 	{
+		mutexSession_.lock();
 		std::vector<boost::shared_ptr<CPaintSession> > sessionList = sessionList_;
+		mutexSession_.unlock();
 
 		return sendDataToUsers( sessionList, msg, toSessionId );
 	}
 
+	static const int DefaultStateIntervalMs = 50;	// 20 states of a key per second
+
+	// the key of a packet which is a state : the last one of a key is all a peer needs.
+	// made by the sender, which knows the item. (a move and an update of an item are two keys)
+	static std::string stateKey( int code, const std::string &owner = std::string(), int itemId = 0 )
+	{
+		char prefix[32];
+		sprintf( prefix, "%d:%d:", code, itemId );
+		return prefix + owner;
+	}
+
+	// the key of a relayed state, read from the front of the body without parsing the rest.
+	// | owner | itemId | ... for a move and an update. empty : not a state.
+	static std::string relayStateKey( const CPacketData &data )
+	{
+		if( data.code == CODE_WINDOW_RESIZE_MAIN_WND )
+			return stateKey( data.code );
+		if( data.code != CODE_PAINT_MOVE_ITEM && data.code != CODE_PAINT_UPDATE_ITEM )
+			return std::string();
+
+		char head[1 + 255 + 4];
+		CPacketReader reader( CPacketView( head, data.body.copyOut( 0, head, sizeof(head) ) ) );
+
+		CPacketView owner;
+		boost::int32_t itemId;
+		if( !reader.readString8( owner ) || !reader.readInt32( itemId ) )
+			return std::string();
+		return stateKey( data.code, owner.str(), itemId );
+	}
+
+	// a state goes out at most once per interval, the latest one of its key.
+	// the first one of a quiet key goes at once, so a single action is not delayed. (main thread)
+	// key : empty sends it at once as an event. returns -1 if it waits.
+	int sendStateToUsers( const std::string &msg, const std::string &key )
+	{
+		if( key.empty() || stateIntervalMs_ <= 0 )
+			return sendStateData( msg, key );
+
+		qint64 now = QDateTime::currentMSecsSinceEpoch();
+		struct SPendingState &state = stateMap_[ key ];
+		if( state.msg.empty() && now - state.lastSent >= stateIntervalMs_ )
+		{
+			// the older states of the other keys go before it.
+			flushStates();
+
+			state.lastSent = now;
+			return sendStateData( msg, key );
+		}
+
+		if( state.msg.empty() )
+			pendingStateCount_++;
+		state.msg = msg;
+		state.seq = ++stateSeq_;
+
+		armStateTimer();
+		return -1;
+	}
+
+	// 0 : no coalescing, every state goes at once.
+	void setStateSendRate( int perSecond )
+	{
+		stateIntervalMs_ = perSecond > 0 ? 1000 / perSecond : 0;
+	}
+
 	// Shared Paint Action
 public:
 	void undoCommand( void )
@@ -207,25 +349,27 @@ public:
 		commandMngr_.undoCommand();
 	}
 
+	// the snapshot of the canvas for a joiner, sent as a stream of batches. (see pumpSyncStream)
 	void sendAllSyncData( int toSessionId )
 	{
 		if( isServerMode() == false )
 			return;
 
-		std::string allData;
+		// the joiner gets the encodings it announced in the join packet.
+		boost::shared_ptr<CPaintSession> session = findSession( toSessionId );
+		if( !session )
+			return;
 
-		// User Info
-		allData += generateJoinerInfoPacket();
+		_removeSyncStream( toSessionId );
 
-		// Window Resize
-		std::string msg = WindowPacketBuilder::CResizeMainWindow::make( lastWindowWidth_, lastWindowHeight_ );
-		allData += msg;
+		struct SSyncStream &stream = syncStreamMap_[ toSessionId ];
+		stream.caps = session->peerCapabilities();
+		stream.background = backgroundImageItem_;
+		stream.nextTile = 0;
+		stream.backgroundFrame = 0;
+		stream.transferId = generatePacketId();
 
-		// Back Ground Image
-		if( backgroundImageItem_ )
-			allData += PaintPacketBuilder::CSetBackgroundImage::make( backgroundImageItem_ );
-		
-		// All Paint Item
+		// the vector items first, the joiner draws them while the bulky ones are on the way.
 		ITEM_LIST_MAP::iterator it = userItemListMap_.begin();
 		for( ; it != userItemListMap_.end(); it++ )
 		{
@@ -233,13 +377,232 @@ public:
 			CSharedPaintItemList::ITEM_MAP::iterator itItem = map.begin();
 			for( ; itItem != map.end(); itItem++ )
 			{
-				std::string msg = PaintPacketBuilder::CAddItem::make( itItem->second );
-				allData += msg;
+				SYNC_ITEM_KEY key( itItem->second->owner(), itItem->second->itemId() );
+				if( isFileItem( itItem->second ) )
+					stream.fileItems.push_back( key );
+				else
+					stream.lightItems.push_back( key );
 			}
 		}
 
-		sendDataToUsers( allData, toSessionId );
-		
+		// User Info, Window Resize
+		std::string header = generateJoinerInfoPacket();
+		header += WindowPacketBuilder::CResizeMainWindow::make( lastWindowWidth_, lastWindowHeight_ );
+		stream.header = header;
+
+		pumpSyncStream( toSessionId );
+	}
+
+	// the add item packet every peer can read. (a line is compact only if all joiners support it)
+	std::string generateAddItemPacket( boost::shared_ptr<CPaintItem> item )
+	{
+		return generateAddItemPacket( item, commonCapabilities() );
+	}
+
+	std::string generateAddItemPacket( boost::shared_ptr<CPaintItem> item, int caps )
+	{
+		return cachedItemPacket( item, addItemEncoding( item, caps ) );
+	}
+
+	// the encodings cached on the items. (see CPaintItem::cachedEncoding)
+	enum ItemEncoding {
+		ENCODING_ADD_ITEM = 0,
+		ENCODING_COMPACT_LINE,
+		ENCODING_COMPACT_CURVE,
+		ENCODING_FILE_BEGIN,
+	};
+
+	static int addItemEncoding( boost::shared_ptr<CPaintItem> item, int caps )
+	{
+		if( item->type() == PT_LINE && (caps & CAPABILITY_COMPACT_STROKE) )
+			return (caps & CAPABILITY_CURVE_STROKE) ? ENCODING_COMPACT_CURVE : ENCODING_COMPACT_LINE;
+
+		return ENCODING_ADD_ITEM;
+	}
+
+	static std::string encodeItem( boost::shared_ptr<CPaintItem> item, int encoding )
+	{
+		switch( encoding )
+		{
+		case ENCODING_COMPACT_LINE:
+			return PaintPacketBuilder::CAddCompactLine::make( boost::static_pointer_cast<CLineItem>(item), false );
+		case ENCODING_COMPACT_CURVE:
+			return PaintPacketBuilder::CAddCompactLine::make( boost::static_pointer_cast<CLineItem>(item), true );
+		case ENCODING_FILE_BEGIN:
+			return PaintPacketBuilder::CFileBegin::make( boost::static_pointer_cast<CFileItem>(item) );
+		}
+
+		return PaintPacketBuilder::CAddItem::make( item );
+	}
+
+	// the items on the canvas only. (main thread, or encodePool_ while the main thread waits)
+	static std::string cachedItemPacket( boost::shared_ptr<CPaintItem> item, int encoding )
+	{
+		std::string msg;
+		if( item->cachedEncoding( encoding, msg ) )
+			return msg;
+
+		int version = item->encodingVersion();
+		msg = encodeItem( item, encoding );
+		item->setCachedEncoding( encoding, msg, version );
+		return msg;
+	}
+
+	// a file goes to the joiners with CAPABILITY_FILE_STREAM in chunks, the others get it in one packet.
+	// the file is read on encodePool_, the packets go later from the main thread.
+	// returns the packet id of the progress. (the transfer id for the chunks)
+	int sendAddItemPacket( boost::shared_ptr<CPaintItem> item, int exceptSessionId = -1 )
+	{
+		if( !isFileItem( item ) )
+			return sendDataToUsers( generateAddItemPacket( item ) );
+
+		boost::shared_ptr<CFileItem> file = boost::static_pointer_cast<CFileItem>(item);
+		int packetId = generatePacketId();
+
+		bool legacy = !capableSessions( CAPABILITY_FILE_STREAM, false ).empty();
+		if( file->hasCachedEncoding( ENCODING_FILE_BEGIN ) && (!legacy || file->hasCachedEncoding( ENCODING_ADD_ITEM )) )
+		{
+			sendFileItemPackets( file, packetId, exceptSessionId );
+			return packetId;
+		}
+
+		encodePool_.post( boost::bind( &CSharedPaintManager::_encodeFileItem, this, file, copyFileItem( file ), file->encodingVersion(), legacy, packetId, exceptSessionId ) );
+		return packetId;
+	}
+
+	// a copy is encoded, the item may move meanwhile.
+	static boost::shared_ptr<CFileItem> copyFileItem( boost::shared_ptr<CFileItem> file )
+	{
+		boost::shared_ptr<CFileItem> copy = boost::static_pointer_cast<CFileItem>( CPaintItemFactory::createItem( file->type() ) );
+		copy->setData( file->data() );
+		copy->setPath( file->path() );
+		if( file->hasContentHash() )
+			copy->setContentHash( file->contentHash() );
+		return copy;
+	}
+
+	// encodePool_
+	void _encodeFileItem( boost::shared_ptr<CFileItem> file, boost::shared_ptr<CFileItem> copy, int version, bool legacy, int packetId, int exceptSessionId )
+	{
+		QByteArray hash = copy->contentHash();
+		std::string begin = encodeItem( copy, ENCODING_FILE_BEGIN );
+		std::string full = legacy ? encodeItem( copy, ENCODING_ADD_ITEM ) : std::string();
+
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onFileItemEncoded, this, file, version, hash, begin, full, packetId, exceptSessionId ) );
+	}
+
+	void _onFileItemEncoded( boost::shared_ptr<CFileItem> file, int version, const QByteArray &hash, const std::string &begin, const std::string &full, int packetId, int exceptSessionId )
+	{
+		// removed meanwhile
+		if( findItem( file->owner(), file->itemId() ) != file )
+			return;
+
+		// changed meanwhile, the packets are made again when they are sent.
+		bool current = file->encodingVersion() == version;
+
+		if( !hash.isEmpty() && !file->hasContentHash() )
+			file->setContentHash( hash );
+
+		if( !current )
+		{
+			sendFileItemPackets( file, packetId, exceptSessionId );
+			return;
+		}
+
+		file->setCachedEncoding( ENCODING_FILE_BEGIN, begin, file->encodingVersion() );
+		file->setCachedEncoding( ENCODING_ADD_ITEM, full, file->encodingVersion() );
+
+		sendFileItemPackets( file, packetId, exceptSessionId, begin, full );
+	}
+
+	void sendFileItemPackets( boost::shared_ptr<CFileItem> file, int packetId, int exceptSessionId, const std::string &begin = std::string(), const std::string &full = std::string() )
+	{
+		SESSION_LIST list;
+		{
+			boost::recursive_mutex::scoped_lock autolock(mutexSession_);
+			SESSION_LIST::iterator it = sessionList_.begin();
+			for( ; it != sessionList_.end(); it++ )
+			{
+				if( (*it)->sessionId() != exceptSessionId && (*it)->session()->isConnected() )
+					list.push_back( *it );
+			}
+		}
+
+		SESSION_LIST legacyList = filterSessions( list, CAPABILITY_FILE_STREAM, false );
+		if( !legacyList.empty() )
+			sendDataToUsersWithId( legacyList, makePayload( full.empty() ? cachedItemPacket( file, ENCODING_ADD_ITEM ) : full ), -1, packetId );
+
+		SESSION_LIST streamList = filterSessions( list, CAPABILITY_FILE_STREAM );
+		if( !streamList.empty() && sendDataToUsers( streamList, begin.empty() ? cachedItemPacket( file, ENCODING_FILE_BEGIN ) : begin ) >= 0 )
+		{
+			for( SESSION_LIST::iterator it = streamList.begin(); it != streamList.end(); it++ )
+				addFileSender( (*it)->sessionId(), file, packetId );
+		}
+	}
+
+	static bool isFileItem( boost::shared_ptr<CPaintItem> item )
+	{
+		return item->type() == PT_FILE || item->type() == PT_IMAGE_FILE;
+	}
+
+	// the received codes that change the canvas. (CODE_PAINT_ADD_ITEM is journalled by the item)
+	static bool isJournalCode( int code )
+	{
+		switch( code )
+		{
+		case CODE_PAINT_ADD_LINE_COMPACT:
+		case CODE_PAINT_UPDATE_ITEM:
+		case CODE_PAINT_MOVE_ITEM:
+		case CODE_PAINT_REMOVE_ITEM:
+		case CODE_PAINT_CLEAR_SCREEN:
+		case CODE_PAINT_CLEAR_BG_IMAGE:
+		case CODE_PAINT_SET_BG_IMAGE:
+		case CODE_PAINT_SET_BG_IMAGE_DELTA:
+		case CODE_WINDOW_RESIZE_MAIN_WND:
+			return true;
+		}
+		return false;
+	}
+
+	// in-progress stroke streaming. the stroke is committed by sendPaintItem() as before,
+	// so the joiners without CAPABILITY_LIVE_STROKE, undo and the sync data are not affected.
+	void beginLiveStroke( boost::shared_ptr<CLineItem> line )
+	{
+		liveStroke_ = boost::shared_ptr<CLineItem>();
+		if( isConnected() == false || capableSessions( CAPABILITY_LIVE_STROKE ).empty() )
+			return;
+
+		liveStroke_ = line;
+		liveStrokeSentCount_ = 0;
+
+		std::string msg = PaintPacketBuilder::CStrokeBegin::make( line );
+		sendDataToUsers( capableSessions( CAPABILITY_LIVE_STROKE ), msg );
+	}
+
+	// called every tick. the points added since the last tick go in one packet.
+	void flushLiveStroke( void )
+	{
+		if( !liveStroke_ || liveStroke_->pointSize() <= liveStrokeSentCount_ )
+			return;
+
+		const std::vector<QPointF> &points = liveStroke_->points();
+		std::vector<QPointF> batch( points.begin() + liveStrokeSentCount_, points.end() );
+
+		std::string msg = PaintPacketBuilder::CStrokeAppend::make( liveStroke_->owner(), liveStroke_->itemId(), liveStrokeSentCount_, batch );
+		sendDataToUsers( capableSessions( CAPABILITY_LIVE_STROKE ), msg );
+
+		liveStrokeSentCount_ = points.size();
+	}
+
+	void endLiveStroke( boost::shared_ptr<CPaintItem> item )
+	{
+		if( !liveStroke_ || liveStroke_ != item )
+			return;
+
+		std::string msg = PaintPacketBuilder::CStrokeEnd::make( liveStroke_->owner(), liveStroke_->itemId() );
+		sendDataToUsers( capableSessions( CAPABILITY_LIVE_STROKE ), msg );
+
+		liveStroke_ = boost::shared_ptr<CLineItem>();
 	}
 
 	bool sendPaintItem( boost::shared_ptr<CPaintItem> item )
@@ -257,19 +620,41 @@ public:
 
 		canvas_->drawBackgroundImage( image );
 
+		// the tiles changed since the last shot. (diffed even if nobody is here, a joiner gets the whole image)
+		std::vector<int> tiles;
+		bool keyframe = backgroundTileCodec_.diff( image->image(), tiles );
+		image->setTileFrame( image->owner(), backgroundTileCodec_.frameId() );
+
+		// with its frame, the deltas journaled after it go on it.
+		journal_.appendBackgroundImage( image );
+
 		if( isConnected() == false )
 			return -1;
 
-		std::string msg = PaintPacketBuilder::CSetBackgroundImage::make( image );
-		return sendDataToUsers( msg );
+		int packetId = -1;
+
+		SESSION_LIST fullList = capableSessions( CAPABILITY_BG_IMAGE_DELTA, false );
+		if( !fullList.empty() )
+			packetId = sendDataToUsers( fullList, PaintPacketBuilder::CSetBackgroundImage::make( image ) );
+
+		SESSION_LIST deltaList = capableSessions( CAPABILITY_BG_IMAGE_DELTA );
+		if( !deltaList.empty() && !tiles.empty() )
+		{
+			STileDelta delta;
+			CTileCodec::encode( image->image(), image->owner(), keyframe, backgroundTileCodec_.frameId(), backgroundTileCodec_.baseId(), tiles, delta );
+			packetId = sendDataToUsers( deltaList, PaintPacketBuilder::CSetBackgroundImageDelta::make( delta ) );
+		}
+		return packetId;
 	}
 
 	void clearBackgroundImage( void )
 	{
 		backgroundImageItem_ = boost::shared_ptr<CBackgroundImageItem>();
+		backgroundTileCodec_.reset();
 		canvas_->clearBackgroundImage();
 
 		std::string msg = PaintPacketBuilder::CClearBackgroundImage::make();
+		journal_.append( msg );
 		sendDataToUsers( msg );
 	}
 
@@ -278,6 +663,7 @@ public:
 		clearAllItems();
 
 		std::string msg = PaintPacketBuilder::CClearScreen::make();
+		journal_.append( msg );
 		sendDataToUsers( msg );
 	}
 	
@@ -304,16 +690,54 @@ public:
 		std::string msg = WindowPacketBuilder::CResizeMainWindow::make( width, height );
 		lastWindowWidth_ = width;
 		lastWindowHeight_ = height;
-		return sendDataToUsers( msg );
+		journal_.append( msg );
+		return sendStateToUsers( msg, stateKey( CODE_WINDOW_RESIZE_MAIN_WND ) );
 	}
 
 	// User Management and Sync
 public:
 	int userCount( void )
 	{
+		boost::recursive_mutex::scoped_lock autolock(mutexUser_);
 		return joinerMap_.size();
 	}
 
+	// the capabilities shared by all the directly connected peers.
+	// (the server re-encodes for its joiners, so a client needs the server's only)
+	int commonCapabilities( void )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutexSession_);
+
+		int caps = SUPPORTED_CAPABILITIES;
+		SESSION_LIST::iterator it = sessionList_.begin();
+		for( ; it != sessionList_.end(); it++ )
+		{
+			if( (*it)->session()->isConnected() )
+				caps &= (*it)->peerCapabilities();
+		}
+		return caps;
+	}
+
+	// capable : false gets the sessions without the capability.
+	SESSION_LIST capableSessions( int capability, bool capable = true )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutexSession_);
+
+		return filterSessions( sessionList_, capability, capable );
+	}
+
+	static SESSION_LIST filterSessions( const SESSION_LIST &sessionList, int capability, bool capable = true )
+	{
+		SESSION_LIST list;
+		SESSION_LIST::const_iterator it = sessionList.begin();
+		for( ; it != sessionList.end(); it++ )
+		{
+			if( (((*it)->peerCapabilities() & capability) == capability) == capable )
+				list.push_back( *it );
+		}
+		return list;
+	}
+
 private:
 	void sendMyUserInfo( boost::shared_ptr<CPaintSession> session )
 	{
@@ -379,7 +803,10 @@ private:
 		}
 
 		if( removing )
+		{
+			caller_.performMainThread( boost::bind( &CSharedPaintManager::_removeRemoteStrokes, this, removing->userId() ) );
 			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_UpdatePaintUser, this, removing ) );
+		}
 	}
 
 	void removeUser( boost::shared_ptr<CPaintUser> user )
@@ -396,13 +823,16 @@ private:
 
 	void clearAllSessions( void )
 	{
+		// closed out of the lock, the disconnected events look for the sessions.
 		mutexSession_.lock();
-		SESSION_LIST::iterator it = sessionList_.begin();
-		for( ; it != sessionList_.end(); it++ )
+		SESSION_LIST sessionList = sessionList_;
+		mutexSession_.unlock();
+
+		SESSION_LIST::iterator it = sessionList.begin();
+		for( ; it != sessionList.end(); it++ )
 		{
 			(*it)->close();
 		}
-		mutexSession_.unlock();
 	}
 
 	void clearAllUsers( void )
@@ -450,6 +880,14 @@ public:
 
 		itemList->addItem( item );
 
+		// a received file points into the store. (see CFileReceiver)
+		if( isFileItem( item ) )
+		{
+			boost::shared_ptr<CFileItem> file = boost::static_pointer_cast<CFileItem>(item);
+			if( file->hasContentHash() )
+				filePinMap_[ FILE_ITEM_KEY( item->owner(), item->itemId() ) ] = fileStore_.pin( file->contentHash() );
+		}
+
 		if( !caller_.isMainThread() )
 			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_AddPaintItem, this, item ) );
 		else
@@ -472,6 +910,8 @@ public:
 		if( itemId < 0 )
 			return;
 
+		_cancelFileTransfers( owner, itemId );
+
 		boost::shared_ptr<CSharedPaintItemList> itemList = findItemList( owner );
 		if( !itemList )
 			return;
@@ -483,6 +923,7 @@ public:
 		item->remove();
 	
 		itemList->removeItem( itemId );
+		filePinMap_.erase( FILE_ITEM_KEY( owner, itemId ) );
 	}
 
 	boost::shared_ptr<CPaintItem> findItem( const std::string &owner, int itemId )
@@ -516,80 +957,1034 @@ public:
 	void clearAllItems( void )
 	{
 		backgroundImageItem_ = boost::shared_ptr<CBackgroundImageItem>();
+		backgroundTileCodec_.reset();
 		canvas_->clearScreen();
 
 		// all data clear
 		userItemListMap_.clear();
 		commandMngr_.clear();
+
+		_removeRemoteStrokes( "" );
+
+		// the part files stay for a resume.
+		fileSenderMap_.clear();
+		fileReceiveMap_.clear();
+		filePinMap_.clear();
+
+		restoringCanvas_ = boost::shared_ptr<CCanvasFile>();
 	}
 
-private:
-	void dispatchBroadCastPacket( boost::shared_ptr<CPacketData> packetData );
-	void dispatchPaintPacket( boost::shared_ptr<CPaintSession> session, boost::shared_ptr<CPacketData> packetData );
+	// the canvas kept over a restart. (see CCanvasFile)
+public:
+	static const size_t RestoreChunkSize = 1024;
 
-	boost::shared_ptr<CSharedPaintItemList> findItemList( const std::string &owner )
+	// the journal has the canvas as it is here, it saves it in its canvas file as it closes.
+	// the blobs are copied and hashed on its writer thread, this thread only waits for it.
+	// a server only : the canvas of a client is the server's, and the file and the log are of the last server run.
+	bool saveCanvas( void )
 	{
-		ITEM_LIST_MAP::iterator it = userItemListMap_.find( owner );
-		if( it == userItemListMap_.end() )
-			return boost::shared_ptr<CSharedPaintItemList>();
+		if( !isServerMode() || !journal_.isOpen() )
+			return false;
 
-		return it->second;
+		journal_.close( true );
+		return true;
 	}
 
-	boost::shared_ptr<CPaintSession> findSession( int sessionId )
+	// a server journals the changes over the canvas file. (see CPaintJournal)
+	// on an empty canvas, the last run is recovered from the file and the log, then restored.
+	// otherwise the journal starts from this canvas.
+	void openJournal( const QString &logPath, const QString &canvasPath )
 	{
-		boost::recursive_mutex::scoped_lock autolock(mutexSession_);
-
-		SESSION_LIST::iterator it = sessionList_.begin();
-		for( ; it != sessionList_.end(); it++ )
+		if( !isCanvasEmpty() )
 		{
-			if( (*it)->sessionId() == sessionId )
-			{
-				return *it;
-			}
+			journal_.open( logPath, canvasPath, CPaintJournal::callback_t(), true );
+			journalCanvas();
+			return;
 		}
-		return boost::shared_ptr<CPaintSession>();
+
+		journal_.open( logPath, canvasPath, boost::bind( &CSharedPaintManager::_onJournalRecovered, this, canvasPath ) );
 	}
 
+	// the changes of the commands. (see SharedPaintCommand.cpp)
+	void journalPacket( const std::string &msg )
+	{
+		journal_.append( msg );
+	}
 
-private:
-	// observer methods
-	void fireObserver_ConnectFailed( void )
+	void _journalPacket( boost::shared_ptr<CPacketData> packetData )
 	{
-		std::list<ISharedPaintEvent *> observers = observers_;
-		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
-		{
-			(*it)->onISharedPaintEvent_ConnectFailed( this );
-		}
+		journal_.append( packetData->code, packetData->body );
 	}
-	void fireObserver_Connected( int sessionId )
+
+	void journalAddItem( boost::shared_ptr<CPaintItem> item )
 	{
-		std::list<ISharedPaintEvent *> observers = observers_;
-		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
-		{
-			(*it)->onISharedPaintEvent_Connected( this );
-		}
+		if( !journal_.isOpen() )
+			return;
 
-		if( isServerMode() )
-			sendAllSyncData( sessionId );
+		if( isFileItem( item ) )
+			journal_.appendFileItem( boost::static_pointer_cast<CFileItem>(item) );
+		else
+			journal_.append( cachedItemPacket( item, item->type() == PT_LINE ? ENCODING_COMPACT_CURVE : ENCODING_ADD_ITEM ) );
 	}
-	void fireObserver_DisConnected( void )
+
+	// the whole canvas as records, for a journal which starts from it.
+	void journalCanvas( void )
 	{
-		std::list<ISharedPaintEvent *> observers = observers_;
-		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		ITEM_LIST_MAP::iterator it = userItemListMap_.begin();
+		for( ; it != userItemListMap_.end(); it++ )
 		{
-			(*it)->onISharedPaintEvent_Disconnected( this );
+			CSharedPaintItemList::ITEM_MAP &map = it->second->itemMap();
+			CSharedPaintItemList::ITEM_MAP::iterator itItem = map.begin();
+			for( ; itItem != map.end(); itItem++ )
+				journalAddItem( itItem->second );
 		}
+
+		if( backgroundImageItem_ )
+			journal_.appendBackgroundImage( backgroundImageItem_ );
+
+		if( lastWindowWidth_ > 0 && lastWindowHeight_ > 0 )
+			journal_.append( WindowPacketBuilder::CResizeMainWindow::make( lastWindowWidth_, lastWindowHeight_ ) );
 	}
 
-	void fireObserver_UpdatePaintItem( boost::shared_ptr<CPaintItem> item )
+	// the file stays mapped, and the items are made a chunk at a time on the main thread,
+	// so the first ones are drawn at once. the joiners get them as they come.
+	// the canvas may have changed before it is restored (joiners are in already) : the saved items
+	// are merged into it, and the background and the window size are taken only if it has none.
+	bool restoreCanvas( const QString &path )
 	{
-		std::list<ISharedPaintEvent *> observers = observers_;
-		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		boost::shared_ptr<CCanvasFile> file( new CCanvasFile );
+		if( !file->open( path ) )
 		{
-			(*it)->onISharedPaintEvent_UpdatePaintItem( this, item );
+			if( QFile::exists( path ) )
+				fireObserver_RestoreFailed( path );
+			return false;
 		}
-	}
+
+		bool empty = isCanvasEmpty();
+		restoringCanvas_ = file;
+
+		if( empty && file->windowWidth() > 0 && file->windowHeight() > 0 )
+		{
+			lastWindowWidth_ = file->windowWidth();
+			lastWindowHeight_ = file->windowHeight();
+			fireObserver_ResizeMainWindow( lastWindowWidth_, lastWindowHeight_ );
+		}
+
+		if( !backgroundImageItem_ )
+			sendBackgroundImage( file->background() );
+
+		_restoreCanvasItems( file, 0 );
+		return true;
+	}
+
+private:
+	bool isCanvasEmpty( void )
+	{
+		if( backgroundImageItem_ )
+			return false;
+
+		ITEM_LIST_MAP::iterator it = userItemListMap_.begin();
+		for( ; it != userItemListMap_.end(); it++ )
+		{
+			if( !it->second->itemMap().empty() )
+				return false;
+		}
+		return true;
+	}
+
+	// the journal thread
+	void _onJournalRecovered( const QString &canvasPath )
+	{
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::restoreCanvas, this, canvasPath ) );
+	}
+
+	void _restoreCanvasItems( boost::shared_ptr<CCanvasFile> file, size_t start )
+	{
+		if( restoringCanvas_ != file )
+			return;	// cleared meanwhile
+
+		size_t end = std::min( start + RestoreChunkSize, file->itemCount() );
+		for( size_t i = start; i < end; i++ )
+		{
+			boost::shared_ptr<CPaintItem> item = file->item( i );
+			if( !item || findItem( item->owner(), item->itemId() ) )
+				continue;
+
+			addPaintItem( item );
+
+			if( isConnected() )
+				sendAddItemPacket( item );
+		}
+
+		if( end < file->itemCount() )
+			caller_.performMainThread( boost::bind( &CSharedPaintManager::_restoreCanvasItems, this, file, end ) );
+		else
+			restoringCanvas_ = boost::shared_ptr<CCanvasFile>();	// unmapped
+	}
+
+	// the background tiles of the others. (main thread)
+private:
+	void _applyBackgroundImageDelta( boost::shared_ptr<STileDelta> delta, int fromSessionId )
+	{
+		boost::shared_ptr<CBackgroundImageItem> image = backgroundImageItem_;
+		std::vector<QRect> rects;
+
+		if( !image )
+		{
+			if( !delta->keyframe )
+				return;	// waits for a keyframe
+
+			image = boost::shared_ptr<CBackgroundImageItem>( new CBackgroundImageItem );
+			image->setOwner( delta->owner );
+			if( !image->applyDelta( *delta, rects ) )
+				return;
+
+			fireObserver_SetBackgroundImage( image );
+		}
+		else
+		{
+			QSize oldSize = image->image().size();
+			if( !image->applyDelta( *delta, rects ) )
+				return;
+
+			backgroundTileCodec_.reset();	// my next shot is a keyframe
+			image->setOwner( delta->owner );
+			if( image->image().size() != oldSize )
+				canvas_->drawBackgroundImage( image );
+			else
+				canvas_->drawBackgroundImageTiles( image, rects );
+		}
+
+		// an old joiner gets the patched image. (the others got the tiles relayed)
+		if( isServerMode() )
+		{
+			SESSION_LIST fullList;
+			SESSION_LIST list = capableSessions( CAPABILITY_BG_IMAGE_DELTA, false );
+			for( SESSION_LIST::iterator it = list.begin(); it != list.end(); it++ )
+			{
+				if( (*it)->sessionId() != fromSessionId )
+					fullList.push_back( *it );
+			}
+
+			if( !fullList.empty() )
+				sendDataToUsers( fullList, PaintPacketBuilder::CSetBackgroundImage::make( image ) );
+		}
+	}
+
+	// chunked file transfer. (main thread, see FileTransfer.h)
+private:
+	typedef std::pair< std::string, int > FILE_ITEM_KEY;
+	typedef std::pair< int, FILE_ITEM_KEY > FILE_SENDER_KEY;	// session id, item
+
+	void sendDataToSession( int sessionId, const std::string &msg )
+	{
+		boost::shared_ptr<CPaintSession> session = findSession( sessionId );
+		if( session && session->session()->isConnected() )
+			session->session()->sendData( msg );
+	}
+
+	void addFileSender( int sessionId, boost::shared_ptr<CFileItem> file, int packetId )
+	{
+		FILE_SENDER_KEY key( sessionId, FILE_ITEM_KEY( file->owner(), file->itemId() ) );
+		fileSenderMap_[ key ] = boost::shared_ptr<CFileSender>( new CFileSender( file, packetId ) );
+	}
+
+	// a congested session gets no bulk data, it goes on when the queue is drained. (_onSendQueueDrained)
+	bool isBulkPaused( int sessionId )
+	{
+		boost::shared_ptr<CPaintSession> session = findSession( sessionId );
+		return session && session->session()->isBulkPaused();
+	}
+
+	void pumpFileSender( int sessionId, boost::shared_ptr<CFileSender> sender )
+	{
+		if( isBulkPaused( sessionId ) )
+			return;
+
+		size_t offset;
+		std::string data;
+		while( sender->nextChunk( offset, data ) )
+			sendDataToSession( sessionId, PaintPacketBuilder::CFileChunk::make( sender->item()->owner(), sender->item()->itemId(), offset, data ) );
+
+		QByteArray digest;
+		if( sender->takeDigest( digest ) )
+			sendDataToSession( sessionId, PaintPacketBuilder::CFileEnd::make( sender->item()->owner(), sender->item()->itemId(), digest ) );
+	}
+
+	void _onFileRequest( int sessionId, const std::string &owner, int itemId, size_t offset )
+	{
+		FILE_SENDER_MAP::iterator it = fileSenderMap_.find( FILE_SENDER_KEY( sessionId, FILE_ITEM_KEY( owner, itemId ) ) );
+		if( it == fileSenderMap_.end() )
+			return;
+
+		boost::shared_ptr<CFileSender> sender = it->second;
+		if( !sender->start( offset ) )
+		{
+			fileSenderMap_.erase( it );
+			return;
+		}
+
+		// the receiver may have it all already, it still needs the hash.
+		pumpFileSender( sessionId, sender );
+
+		if( sender->isDone() )
+			fileSenderMap_.erase( it );
+	}
+
+	void _onFileAck( int sessionId, const std::string &owner, int itemId, size_t offset )
+	{
+		FILE_SENDER_MAP::iterator it = fileSenderMap_.find( FILE_SENDER_KEY( sessionId, FILE_ITEM_KEY( owner, itemId ) ) );
+		if( it == fileSenderMap_.end() )
+			return;
+
+		boost::shared_ptr<CFileSender> sender = it->second;
+		sender->acknowledge( offset );
+
+		fireObserver_SendingPacket( sender->packetId(), sender->ackedSize(), sender->totalSize() );
+
+		if( sender->isDone() )
+			fileSenderMap_.erase( it );
+		else
+			pumpFileSender( sessionId, sender );
+	}
+
+	// the receivers do the disk work on fileWriter_, the results come back to the main thread.
+	// a result of a receiver which is not in the map anymore is dropped.
+	static FILE_ITEM_KEY fileItemKey( boost::shared_ptr<CFileReceiver> receiver )
+	{
+		return FILE_ITEM_KEY( receiver->item()->owner(), receiver->item()->itemId() );
+	}
+
+	void _beginFileReceive( boost::shared_ptr<CFileItem> item, const QString &fileName, size_t size, int fromSessionId )
+	{
+		FILE_ITEM_KEY key( item->owner(), item->itemId() );
+
+		// already here, the sender is told it has nothing to send.
+		if( findItem( item->owner(), item->itemId() ) )
+		{
+			sendDataToSession( fromSessionId, PaintPacketBuilder::CFileRequest::make( item->owner(), item->itemId(), size ) );
+			return;
+		}
+
+		// the part file of the last try is closed before the new one opens it. (the jobs run in order)
+		fileReceiveMap_.erase( key );
+
+		struct SFileReceive receive;
+		receive.sessionId = fromSessionId;
+		receive.receiver = boost::shared_ptr<CFileReceiver>( new CFileReceiver( item, fileName, size, &fileStore_ ) );
+		receive.opened = false;
+		receive.nextOffset = 0;
+		if( item->hasContentHash() )
+			receive.pin = fileStore_.pin( item->contentHash() );
+		fileReceiveMap_[ key ] = receive;
+
+		fileWriter_.post( boost::bind( &CSharedPaintManager::_openFileReceiver, this, receive.receiver ) );
+	}
+
+	// writer thread
+	void _openFileReceiver( boost::shared_ptr<CFileReceiver> receiver )
+	{
+		size_t offset = 0;
+		bool ret = receiver->open( offset );
+
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onFileReceiverOpened, this, receiver, ret, receiver->isStored(), offset ) );
+	}
+
+	void _onFileReceiverOpened( boost::shared_ptr<CFileReceiver> receiver, bool ret, bool stored, size_t offset )
+	{
+		FILE_RECEIVE_MAP::iterator it = fileReceiveMap_.find( fileItemKey( receiver ) );
+		if( it == fileReceiveMap_.end() || it->second.receiver != receiver )
+			return;
+
+		if( !ret )
+		{
+			fileReceiveMap_.erase( it );
+			return;
+		}
+
+		int fromSessionId = it->second.sessionId;
+		sendDataToSession( fromSessionId, PaintPacketBuilder::CFileRequest::make( receiver->item()->owner(), receiver->item()->itemId(), offset ) );
+
+		// the content is in the store, only the item came.
+		if( stored )
+		{
+			fileReceiveMap_.erase( it );
+			completeFileReceive( receiver->item(), fromSessionId );
+			return;
+		}
+
+		it->second.opened = true;
+		it->second.nextOffset = offset;
+	}
+
+	void _receiveFileChunk( const std::string &owner, int itemId, size_t offset, const std::string &data )
+	{
+		FILE_RECEIVE_MAP::iterator it = fileReceiveMap_.find( FILE_ITEM_KEY( owner, itemId ) );
+		if( it == fileReceiveMap_.end() )
+			return;
+
+		struct SFileReceive &receive = it->second;
+		if( !receive.opened || offset != receive.nextOffset )
+			return;	// sent before the last request
+
+		if( data.size() > receive.receiver->totalSize() - receive.nextOffset )
+		{
+			fileWriter_.post( boost::bind( &CFileReceiver::abort, receive.receiver ) );
+			fileReceiveMap_.erase( it );
+			return;
+		}
+
+		// at most a window of chunks waits for the disk, the sender waits for the acks.
+		receive.nextOffset += data.size();
+		fileWriter_.post( boost::bind( &CSharedPaintManager::_writeFileChunk, this, receive.receiver, offset, data ) );
+	}
+
+	// writer thread
+	void _writeFileChunk( boost::shared_ptr<CFileReceiver> receiver, size_t offset, const std::string &data )
+	{
+		bool ret = receiver->write( offset, data.data(), data.size() );
+		if( !ret )
+			receiver->abort();
+
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onFileChunkWritten, this, receiver, ret, receiver->receivedSize() ) );
+	}
+
+	void _onFileChunkWritten( boost::shared_ptr<CFileReceiver> receiver, bool ret, size_t receivedSize )
+	{
+		FILE_RECEIVE_MAP::iterator it = fileReceiveMap_.find( fileItemKey( receiver ) );
+		if( it == fileReceiveMap_.end() || it->second.receiver != receiver )
+			return;
+
+		if( !ret )
+		{
+			fileReceiveMap_.erase( it );
+			return;
+		}
+
+		sendDataToSession( it->second.sessionId, PaintPacketBuilder::CFileAck::make( receiver->item()->owner(), receiver->item()->itemId(), receivedSize ) );
+	}
+
+	void _onFileEnd( const std::string &owner, int itemId, const QByteArray &digest )
+	{
+		FILE_RECEIVE_MAP::iterator it = fileReceiveMap_.find( FILE_ITEM_KEY( owner, itemId ) );
+		if( it == fileReceiveMap_.end() )
+			return;
+
+		struct SFileReceive &receive = it->second;
+		if( !receive.opened || receive.nextOffset != receive.receiver->totalSize() )
+			return;
+
+		// after the writes of the chunks.
+		fileWriter_.post( boost::bind( &CSharedPaintManager::_finishFileReceiver, this, receive.receiver, digest ) );
+	}
+
+	// writer thread
+	void _finishFileReceiver( boost::shared_ptr<CFileReceiver> receiver, const QByteArray &digest )
+	{
+		bool ret = receiver->finish( digest );
+
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onFileReceiverFinished, this, receiver, ret ) );
+	}
+
+	void _onFileReceiverFinished( boost::shared_ptr<CFileReceiver> receiver, bool ret )
+	{
+		FILE_RECEIVE_MAP::iterator it = fileReceiveMap_.find( fileItemKey( receiver ) );
+		if( it == fileReceiveMap_.end() || it->second.receiver != receiver )
+			return;
+
+		int fromSessionId = it->second.sessionId;
+		fileReceiveMap_.erase( it );
+
+		if( ret )
+			completeFileReceive( receiver->item(), fromSessionId );
+	}
+
+	void completeFileReceive( boost::shared_ptr<CFileItem> item, int fromSessionId )
+	{
+		addPaintItem( item );
+		journalAddItem( item );
+
+		// the server has the file now, the others get it from here.
+		if( isServerMode() )
+			sendAddItemPacket( item, fromSessionId );
+	}
+
+	void _cancelFileTransfers( const std::string &owner, int itemId )
+	{
+		FILE_ITEM_KEY key( owner, itemId );
+
+		FILE_RECEIVE_MAP::iterator itReceive = fileReceiveMap_.find( key );
+		if( itReceive != fileReceiveMap_.end() )
+		{
+			fileWriter_.post( boost::bind( &CFileReceiver::abort, itReceive->second.receiver ) );
+			fileReceiveMap_.erase( itReceive );
+		}
+
+		FILE_SENDER_MAP::iterator it = fileSenderMap_.begin();
+		while( it != fileSenderMap_.end() )
+		{
+			FILE_SENDER_MAP::iterator curr = it++;
+			if( curr->first.second == key )
+				fileSenderMap_.erase( curr );
+		}
+	}
+
+	// the part files of this session stay for a resume.
+	void _removeFileTransfers( int sessionId )
+	{
+		FILE_SENDER_MAP::iterator it = fileSenderMap_.begin();
+		while( it != fileSenderMap_.end() )
+		{
+			FILE_SENDER_MAP::iterator curr = it++;
+			if( curr->first.first == sessionId )
+				fileSenderMap_.erase( curr );
+		}
+
+		FILE_RECEIVE_MAP::iterator itReceive = fileReceiveMap_.begin();
+		while( itReceive != fileReceiveMap_.end() )
+		{
+			FILE_RECEIVE_MAP::iterator curr = itReceive++;
+			if( curr->second.sessionId == sessionId )
+				fileReceiveMap_.erase( curr );
+		}
+	}
+
+	// late joiner snapshot. (main thread)
+	// the items are encoded when their batch goes, so the memory is bounded by the batches in flight,
+	// and a removed item is skipped. order : header, vector items, background image tiles, files.
+	// a file is read on encodePool_ (its hash, or the whole file for a legacy joiner), the stream waits for it.
+private:
+	static const size_t SyncBatchSize = 64 * 1024;
+	static const size_t SyncBatchesInFlight = 2;
+	static const int SyncTilesPerPacket = 32;
+	static const size_t SyncWarmCount = 256;
+	static const size_t SyncFilesEncoding = 4;
+
+	typedef std::pair< std::string, int > SYNC_ITEM_KEY;
+
+	void pumpSyncStream( int sessionId )
+	{
+		SYNC_STREAM_MAP::iterator it = syncStreamMap_.find( sessionId );
+		if( it == syncStreamMap_.end() )
+			return;
+
+		if( isBulkPaused( sessionId ) )
+			return;
+
+		struct SSyncStream &stream = it->second;
+		while( stream.batchIds.size() < SyncBatchesInFlight )
+		{
+			warmSyncStream( stream );
+
+			std::string batch;
+			bool more = true;
+			while( batch.size() < SyncBatchSize && (more = nextSyncPacket( sessionId, stream, batch )) )
+				;
+
+			if( !batch.empty() )
+			{
+				// registered before the write can complete. (see onIPaintSessionEvent_SendingPacket)
+				boost::recursive_mutex::scoped_lock autolock(mutexSendInfo_);
+
+				int packetId = sendDataToUsers( batch, sessionId );
+				if( packetId < 0 )
+				{
+					syncStreamMap_.erase( it );
+					return;
+				}
+
+				syncBatchMap_[ packetId ] = sessionId;
+				stream.batchIds.push_back( packetId );
+			}
+
+			if( !more )
+			{
+				// a file left : it is being read. (see _onSyncFileEncoded)
+				if( stream.batchIds.empty() && stream.fileItems.empty() )
+					syncStreamMap_.erase( it );
+				else
+					prepareSyncFiles( sessionId, stream );
+				return;
+			}
+		}
+
+		prepareSyncFiles( sessionId, stream );
+	}
+
+	// the cold items of the next batch are encoded in parallel. (a cached one costs a copy)
+	void warmSyncStream( struct SSyncStream &stream )
+	{
+		std::vector<CWorkerPool::job_t> jobs;
+
+		for( size_t i = 0; i < stream.lightItems.size() && i < SyncWarmCount; i++ )
+		{
+			boost::shared_ptr<CPaintItem> item = findItem( stream.lightItems[i].first, stream.lightItems[i].second );
+			int encoding = item ? addItemEncoding( item, stream.caps ) : 0;
+			if( item && !item->hasCachedEncoding( encoding ) )
+				jobs.push_back( boost::bind( &CSharedPaintManager::cachedItemPacket, item, encoding ) );
+		}
+
+		if( jobs.size() > 1 )
+			encodePool_.run( jobs );
+	}
+
+	static int syncFileEncoding( const struct SSyncStream &stream )
+	{
+		return (stream.caps & CAPABILITY_FILE_STREAM) ? ENCODING_FILE_BEGIN : ENCODING_ADD_ITEM;
+	}
+
+	// the packet of a file without reading it. empty : it is read on encodePool_ first
+	std::string readySyncFile( struct SSyncStream &stream, const SYNC_ITEM_KEY &key, boost::shared_ptr<CFileItem> file )
+	{
+		int encoding = syncFileEncoding( stream );
+
+		std::string msg;
+		SYNC_FILE_MAP::iterator it = stream.readyFiles.find( key );
+		if( it != stream.readyFiles.end() )
+		{
+			if( it->second.version == file->encodingVersion() )
+				msg = it->second.packet;
+			stream.readyFiles.erase( it );
+			if( !msg.empty() )
+				return msg;
+		}
+
+		if( file->cachedEncoding( encoding, msg ) )
+			return msg;
+
+		// the meta data only, once the hash is known.
+		if( encoding == ENCODING_FILE_BEGIN && file->hasContentHash() )
+			return cachedItemPacket( file, encoding );
+
+		return std::string();
+	}
+
+	// the next files are read ahead, a few at a time. the first one always, the stream waits for it.
+	void prepareSyncFiles( int sessionId, struct SSyncStream &stream )
+	{
+		for( size_t i = 0; i < stream.fileItems.size() && i < SyncWarmCount; i++ )
+		{
+			if( i > 0 && stream.encodingFiles.size() + stream.readyFiles.size() >= SyncFilesEncoding )
+				break;
+
+			const SYNC_ITEM_KEY &key = stream.fileItems[i];
+			if( stream.encodingFiles.find( key ) != stream.encodingFiles.end() || stream.readyFiles.find( key ) != stream.readyFiles.end() )
+				continue;
+
+			boost::shared_ptr<CPaintItem> item = findItem( key.first, key.second );
+			if( !item )
+				continue;
+
+			boost::shared_ptr<CFileItem> file = boost::static_pointer_cast<CFileItem>(item);
+			int encoding = syncFileEncoding( stream );
+			if( file->hasCachedEncoding( encoding ) || (encoding == ENCODING_FILE_BEGIN && file->hasContentHash()) )
+				continue;
+
+			stream.encodingFiles.insert( key );
+			encodePool_.post( boost::bind( &CSharedPaintManager::_encodeSyncFile, this, sessionId, file, copyFileItem( file ), file->encodingVersion(), encoding ) );
+		}
+	}
+
+	// encodePool_
+	void _encodeSyncFile( int sessionId, boost::shared_ptr<CFileItem> file, boost::shared_ptr<CFileItem> copy, int version, int encoding )
+	{
+		QByteArray hash = copy->contentHash();
+		std::string msg = encodeItem( copy, encoding );
+
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onSyncFileEncoded, this, sessionId, file, version, hash, msg ) );
+	}
+
+	void _onSyncFileEncoded( int sessionId, boost::shared_ptr<CFileItem> file, int version, const QByteArray &hash, const std::string &msg )
+	{
+		SYNC_STREAM_MAP::iterator it = syncStreamMap_.find( sessionId );
+		if( it == syncStreamMap_.end() )
+			return;
+
+		SYNC_ITEM_KEY key( file->owner(), file->itemId() );
+		it->second.encodingFiles.erase( key );
+
+		if( findItem( key.first, key.second ) == file )
+		{
+			// changed meanwhile, it is read again when its turn comes.
+			bool current = file->encodingVersion() == version;
+
+			if( !hash.isEmpty() && !file->hasContentHash() )
+				file->setContentHash( hash );
+
+			if( current && !msg.empty() )
+			{
+				struct SSyncFile &ready = it->second.readyFiles[ key ];
+				ready.packet = msg;
+				ready.version = file->encodingVersion();
+				file->setCachedEncoding( syncFileEncoding( it->second ), msg, file->encodingVersion() );
+			}
+		}
+
+		pumpSyncStream( sessionId );
+	}
+
+	// appends the next packet. false : nothing left, or the next file is being read
+	bool nextSyncPacket( int sessionId, struct SSyncStream &stream, std::string &batch )
+	{
+		if( !stream.header.empty() )
+		{
+			batch += stream.header;
+			stream.header.clear();
+			return true;
+		}
+
+		if( !stream.lightItems.empty() )
+		{
+			SYNC_ITEM_KEY key = stream.lightItems.front();
+			stream.lightItems.pop_front();
+
+			boost::shared_ptr<CPaintItem> item = findItem( key.first, key.second );
+			if( item )
+				batch += generateAddItemPacket( item, stream.caps );
+			return true;
+		}
+
+		if( stream.background )
+		{
+			nextSyncBackground( stream, batch );
+			return true;
+		}
+
+		if( !stream.fileItems.empty() )
+		{
+			SYNC_ITEM_KEY key = stream.fileItems.front();
+
+			boost::shared_ptr<CPaintItem> item = findItem( key.first, key.second );
+			if( !item )
+			{
+				stream.fileItems.pop_front();
+				stream.readyFiles.erase( key );
+				return true;
+			}
+
+			boost::shared_ptr<CFileItem> file = boost::static_pointer_cast<CFileItem>(item);
+			std::string msg = readySyncFile( stream, key, file );
+			if( msg.empty() )
+				return false;	// being read, the stream goes on when it is done.
+
+			stream.fileItems.pop_front();
+			batch += msg;
+
+			// a file follows in chunks, the snapshot does not wait for it.
+			if( stream.caps & CAPABILITY_FILE_STREAM )
+				addFileSender( sessionId, file, stream.transferId );
+			return true;
+		}
+
+		return false;
+	}
+
+	// a band of tiles per packet, the first one is a keyframe. (the whole image for a joiner without the tiles)
+	void nextSyncBackground( struct SSyncStream &stream, std::string &batch )
+	{
+		// changed while sending, the current one from the beginning. (patched in place too, its frame id changed)
+		if( stream.background != backgroundImageItem_ || (stream.nextTile > 0 && !isSyncTileFrame( stream )) )
+		{
+			stream.background = backgroundImageItem_;
+			stream.nextTile = 0;
+			if( !stream.background )
+				return;
+		}
+
+		if( !(stream.caps & CAPABILITY_BG_IMAGE_DELTA) )
+		{
+			batch += PaintPacketBuilder::CSetBackgroundImage::make( stream.background );
+			stream.background = boost::shared_ptr<CBackgroundImageItem>();
+			return;
+		}
+
+		const QImage &image = stream.background->image();
+		int count = CTileCodec::tileCount( image.width(), image.height() );
+
+		std::vector<int> tiles;
+		for( int i = stream.nextTile; i < count && (int)tiles.size() < SyncTilesPerPacket; i++ )
+			tiles.push_back( i );
+
+		// the joiner gets the frame the item is, so the next live delta of the owner applies on it.
+		// a whole image from the stream is no frame of the owner (0), the joiner waits for a keyframe.
+		if( stream.nextTile == 0 )
+		{
+			stream.backgroundOwner = stream.background->owner();
+			stream.backgroundFrame = stream.background->hasTileFrame() ? stream.background->tileFrameId() : 0;
+		}
+
+		if( !tiles.empty() )
+		{
+			STileDelta delta;
+			CTileCodec::encode( image, stream.backgroundOwner, stream.nextTile == 0, stream.backgroundFrame, stream.backgroundFrame, tiles, delta );
+			batch += PaintPacketBuilder::CSetBackgroundImageDelta::make( delta );
+		}
+
+		stream.nextTile += (int)tiles.size();
+		if( stream.nextTile >= count )
+			stream.background = boost::shared_ptr<CBackgroundImageItem>();
+	}
+
+	static bool isSyncTileFrame( const struct SSyncStream &stream )
+	{
+		if( !stream.background->hasTileFrame() )
+			return stream.backgroundFrame == 0 && stream.background->owner() == stream.backgroundOwner;
+		return stream.background->isTileFrame( stream.backgroundOwner, stream.backgroundFrame );
+	}
+
+	void _onSyncBatchWritten( int sessionId, int packetId )
+	{
+		SYNC_STREAM_MAP::iterator it = syncStreamMap_.find( sessionId );
+		if( it == syncStreamMap_.end() )
+			return;
+
+		std::deque<int> &ids = it->second.batchIds;
+		ids.erase( std::remove( ids.begin(), ids.end(), packetId ), ids.end() );
+
+		pumpSyncStream( sessionId );
+	}
+
+	void _onSendQueueDrained( int sessionId )
+	{
+		pumpSyncStream( sessionId );
+
+		// the file senders of the session, in the order of the map.
+		FILE_SENDER_MAP::iterator it = fileSenderMap_.lower_bound( FILE_SENDER_KEY( sessionId, FILE_ITEM_KEY() ) );
+		for( ; it != fileSenderMap_.end() && it->first.first == sessionId; it++ )
+			pumpFileSender( sessionId, it->second );
+	}
+
+	void _removeSyncStream( int sessionId )
+	{
+		SYNC_STREAM_MAP::iterator it = syncStreamMap_.find( sessionId );
+		if( it == syncStreamMap_.end() )
+			return;
+
+		{
+			boost::recursive_mutex::scoped_lock autolock(mutexSendInfo_);
+			for( size_t i = 0; i < it->second.batchIds.size(); i++ )
+				syncBatchMap_.erase( it->second.batchIds[i] );
+		}
+
+		syncStreamMap_.erase( it );
+	}
+
+	// the received items, on the main thread in the order they came. (the sessions are read on the pool)
+private:
+	void _updateRemoteItem( const struct SPaintData &data )
+	{
+		boost::shared_ptr<CPaintItem> item = findItem( data.owner, data.itemId );
+		if( !item )
+			return;
+
+		item->setData( data );
+		updatePaintItem( item );
+	}
+
+	// the waiting states of sendStateToUsers. (main thread)
+private:
+	void armStateTimer( void )
+	{
+		if( stateTimerArmed_ )
+			return;
+
+		if( !stateTimer_ )
+			stateTimer_.reset( new boost::asio::deadline_timer( netRunner_.io_service() ) );
+
+		stateTimerArmed_ = true;
+		stateTimer_->expires_from_now( boost::posix_time::milliseconds( stateIntervalMs_ ) );
+		stateTimer_->async_wait( boost::bind( &CSharedPaintManager::_handleStateTimer, this ) );
+	}
+
+	int sendStateData( const std::string &msg, const std::string &key )
+	{
+		mutexSession_.lock();
+		std::vector<boost::shared_ptr<CPaintSession> > sessionList = sessionList_;
+		mutexSession_.unlock();
+
+		return sendDataToUsersWithId( sessionList, makePayload( msg ), -1, generatePacketId(), true, key );
+	}
+
+	void _handleStateTimer( void )
+	{
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_onStateTimer, this ) );
+	}
+
+	void _onStateTimer( void )
+	{
+		stateTimerArmed_ = false;
+		flushStates();
+
+		// the keys which are quiet for an interval begin again with no delay.
+		qint64 now = QDateTime::currentMSecsSinceEpoch();
+		STATE_MAP::iterator it = stateMap_.begin();
+		while( it != stateMap_.end() )
+		{
+			STATE_MAP::iterator curr = it++;
+			if( curr->second.msg.empty() && now - curr->second.lastSent >= stateIntervalMs_ )
+				stateMap_.erase( curr );
+		}
+	}
+
+	// every waiting state, in the order they were made. (a move and an update of an item are two keys)
+	void flushStates( void )
+	{
+		if( pendingStateCount_ == 0 )
+			return;
+
+		qint64 now = QDateTime::currentMSecsSinceEpoch();
+		std::map< boost::uint64_t, std::pair< std::string, std::string > > msgs;	// key, msg
+
+		STATE_MAP::iterator it = stateMap_.begin();
+		for( ; it != stateMap_.end(); it++ )
+		{
+			if( it->second.msg.empty() )
+				continue;
+
+			std::pair< std::string, std::string > &state = msgs[ it->second.seq ];
+			state.first = it->first;
+			state.second.swap( it->second.msg );
+			it->second.lastSent = now;
+		}
+		pendingStateCount_ = 0;
+
+		std::map< boost::uint64_t, std::pair< std::string, std::string > >::iterator itMsg = msgs.begin();
+		for( ; itMsg != msgs.end(); itMsg++ )
+			sendStateData( itMsg->second.second, itMsg->second.first );
+	}
+
+	// the previews of the in-progress strokes of the others. (main thread)
+private:
+	void _beginRemoteStroke( const std::string &owner, int itemId, const QColor &color, int width )
+	{
+		struct SRemoteStroke stroke;
+		stroke.color = color;
+		stroke.width = width;
+		stroke.nextIndex = 0;
+		remoteStrokeMap_[ std::make_pair( owner, itemId ) ] = stroke;
+	}
+
+	void _appendRemoteStroke( const std::string &owner, int itemId, int startIndex, const std::vector<QPointF> &points )
+	{
+		REMOTE_STROKE_MAP::iterator it = remoteStrokeMap_.find( std::make_pair( owner, itemId ) );
+		if( it == remoteStrokeMap_.end() )
+			return;	// began before this joiner came, the committed item will come.
+
+		struct SRemoteStroke &stroke = it->second;
+		if( points.empty() || startIndex != stroke.nextIndex )
+			return;
+
+		// a batch continues from the last point of the previous one.
+		std::vector<QPointF> segment;
+		segment.reserve( points.size() + 1 );
+		if( stroke.nextIndex > 0 )
+			segment.push_back( stroke.lastPoint );
+		segment.insert( segment.end(), points.begin(), points.end() );
+
+		stroke.nextIndex += points.size();
+		stroke.lastPoint = points.back();
+
+		if( canvas_ )
+			canvas_->drawLiveStroke( owner, itemId, stroke.color, stroke.width, segment );
+	}
+
+	void _endRemoteStroke( const std::string &owner, int itemId )
+	{
+		remoteStrokeMap_.erase( std::make_pair( owner, itemId ) );
+
+		if( canvas_ )
+			canvas_->removeLiveStroke( owner, itemId );
+	}
+
+	// owner "" : all
+	void _removeRemoteStrokes( const std::string &owner )
+	{
+		REMOTE_STROKE_MAP::iterator it = remoteStrokeMap_.begin();
+		while( it != remoteStrokeMap_.end() )
+		{
+			REMOTE_STROKE_MAP::iterator curr = it++;
+			if( owner.empty() || curr->first.first == owner )
+			{
+				if( canvas_ )
+					canvas_->removeLiveStroke( curr->first.first, curr->first.second );
+				remoteStrokeMap_.erase( curr );
+			}
+		}
+	}
+
+private:
+	void dispatchBroadCastPacket( boost::shared_ptr<CPacketData> packetData );
+	typedef std::vector< CDefferedCaller::deferredMethod_t > MAIN_THREAD_CALLS;
+	void dispatchPaintPacket( boost::shared_ptr<CPaintSession> session, boost::shared_ptr<CPacketData> packetData, MAIN_THREAD_CALLS &calls );
+
+	boost::shared_ptr<CSharedPaintItemList> findItemList( const std::string &owner )
+	{
+		ITEM_LIST_MAP::iterator it = userItemListMap_.find( owner );
+		if( it == userItemListMap_.end() )
+			return boost::shared_ptr<CSharedPaintItemList>();
+
+		return it->second;
+	}
+
+	boost::shared_ptr<CPaintSession> findSession( int sessionId )
+	{
+		boost::recursive_mutex::scoped_lock autolock(mutexSession_);
+
+		SESSION_LIST::iterator it = sessionList_.begin();
+		for( ; it != sessionList_.end(); it++ )
+		{
+			if( (*it)->sessionId() == sessionId )
+			{
+				return *it;
+			}
+		}
+		return boost::shared_ptr<CPaintSession>();
+	}
+
+
+private:
+	// observer methods
+	void fireObserver_ConnectFailed( void )
+	{
+		std::list<ISharedPaintEvent *> observers = observers_;
+		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		{
+			(*it)->onISharedPaintEvent_ConnectFailed( this );
+		}
+	}
+	void fireObserver_RestoreFailed( const QString &path )
+	{
+		std::list<ISharedPaintEvent *> observers = observers_;
+		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		{
+			(*it)->onISharedPaintEvent_RestoreFailed( this, path );
+		}
+	}
+	void fireObserver_Connected( int sessionId )
+	{
+		std::list<ISharedPaintEvent *> observers = observers_;
+		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		{
+			(*it)->onISharedPaintEvent_Connected( this );
+		}
+	}
+	void fireObserver_DisConnected( void )
+	{
+		std::list<ISharedPaintEvent *> observers = observers_;
+		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		{
+			(*it)->onISharedPaintEvent_Disconnected( this );
+		}
+	}
+
+	void fireObserver_UpdatePaintItem( boost::shared_ptr<CPaintItem> item )
+	{
+		std::list<ISharedPaintEvent *> observers = observers_;
+		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
+		{
+			(*it)->onISharedPaintEvent_UpdatePaintItem( this, item );
+		}
+	}
 	
 	void fireObserver_AddPaintItem( boost::shared_ptr<CPaintItem> item )
 	{
@@ -642,6 +2037,7 @@ private:
 	void fireObserver_ClearBackgroundImage( void )
 	{
 		backgroundImageItem_ = boost::shared_ptr<CBackgroundImageItem>(); // clear
+		backgroundTileCodec_.reset();
 
 		std::list<ISharedPaintEvent *> observers = observers_;
 		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
@@ -652,6 +2048,7 @@ private:
 	void fireObserver_SetBackgroundImage( boost::shared_ptr<CBackgroundImageItem> image )
 	{
 		backgroundImageItem_ = image;
+		backgroundTileCodec_.reset();	// my next shot is a keyframe
 
 		std::list<ISharedPaintEvent *> observers = observers_;
 		for( std::list<ISharedPaintEvent *>::iterator it = observers.begin(); it != observers.end(); it++ )
@@ -707,7 +2104,11 @@ protected:
 	// INetPeerServerEvent
 	virtual void onINetPeerServerEvent_Accepted( boost::shared_ptr<CNetPeerServer> server, boost::shared_ptr<CNetPeerSession> session )
 	{
+		session->setSendQueueLimit( sendQueueBytes_, sendQueuePackets_, sendQueuePolicy_ );
+		session->setWriteDelay( writeDelayMs_ );
+
 		boost::shared_ptr<CPaintSession> userSession = boost::shared_ptr<CPaintSession>(new CPaintSession(session, this));
+		userSession->setDecodeStrand( decodePool_.newStrand() );
 		
 		mutexSession_.lock();
 		sessionList_.push_back( userSession );
@@ -750,32 +2151,147 @@ protected:
 
 	virtual void onIPaintSessionEvent_ReceivedPacket( boost::shared_ptr<CPaintSession> session, const boost::shared_ptr<CPacketData> data )
 	{
-		dispatchPaintPacket( session, data );
+		// the server passes the packet on first, then reads it for its own canvas on decodePool_,
+		// so the next packet of the joiner is passed on without waiting. (a legacy file is written to the disk there)
+		// the strands of the joiners finish in any order : the number taken with the relay puts the packets
+		// back in the relay order on the main thread. (a move of an item after the add of it, as the joiners see it)
+		boost::uint64_t seq;
+		{
+			boost::mutex::scoped_lock autolock(mutexDecodeSeq_);
+			if( isServerMode() )
+				relayPacket( session, data );
+			seq = decodeSeq_++;
+		}
+
+		boost::shared_ptr<boost::asio::io_service::strand> decodeStrand = session->decodeStrand();
+		if( decodeStrand )
+			decodeStrand->post( boost::bind( &CSharedPaintManager::_decodePaintPacket, this, session, data, seq ) );
+		else
+			_decodePaintPacket( session, data, seq );
+	}
+
+	void _decodePaintPacket( boost::shared_ptr<CPaintSession> session, boost::shared_ptr<CPacketData> data, boost::uint64_t seq )
+	{
+		MAIN_THREAD_CALLS calls;
+		dispatchPaintPacket( session, data, calls );
 
-		if( isServerMode() )
+		// one call per packet, none too. (the next packets wait for this number)
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_applyDecodedPacket, this, seq, calls ) );
+	}
+
+	void _applyDecodedPacket( boost::uint64_t seq, const MAIN_THREAD_CALLS &calls )
+	{
+		decodedMap_[ seq ] = calls;
+
+		DECODED_MAP::iterator it = decodedMap_.begin();
+		while( it != decodedMap_.end() && it->first == appliedSeq_ )
 		{
-			// to send the others without this user
-			if( sessionList_.size() <= 1 )
-				return;
+			for( size_t i = 0; i < it->second.size(); i++ )
+				it->second[i]();
+
+			decodedMap_.erase( it++ );
+			appliedSeq_++;
+		}
+	}
+
+	// the packet goes on as it came, a code this server does not know too. (not to an old joiner, see below)
+	// the frame is not made again and the body is not copied, so a relay costs the same for any size.
+	// a compressed frame goes to the joiners with CAPABILITY_COMPRESSION, the others get the raw body.
+	void relayPacket( boost::shared_ptr<CPaintSession> from, const boost::shared_ptr<CPacketData> data )
+	{
+		// a file transfer is between two peers, the server sends the file on when it has it all.
+		if( data->code == CODE_FILE_BEGIN || data->code == CODE_FILE_REQUEST || data->code == CODE_FILE_CHUNK || data->code == CODE_FILE_ACK || data->code == CODE_FILE_END )
+			return;
+
+		// a live stroke is a preview only, an old joiner just gets the committed item later.
+		// an old joiner gets the whole image after the server patched its own. (see _applyBackgroundImageDelta)
+		int required = 0;
+		if( data->code == CODE_PAINT_STROKE_BEGIN || data->code == CODE_PAINT_STROKE_APPEND || data->code == CODE_PAINT_STROKE_END )
+			required = CAPABILITY_LIVE_STROKE;
+		else if( data->code == CODE_PAINT_SET_BG_IMAGE_DELTA )
+			required = CAPABILITY_BG_IMAGE_DELTA;
+
+		// a joiner which may not read a compact line as it is. (decided by the line below)
+		const int lineCaps = CAPABILITY_COMPACT_STROKE | CAPABILITY_CURVE_STROKE;
+
+		SESSION_LIST frameList, rawList, lineList;
+		{
+			boost::recursive_mutex::scoped_lock autolock(mutexSession_);
 
-			SESSION_LIST list = sessionList_;
-			SESSION_LIST::iterator it = list.begin();
-			for( ; it != list.end(); it++ )
+			SESSION_LIST::iterator it = sessionList_.begin();
+			for( ; it != sessionList_.end(); it++ )
 			{
-				if( *it == session )
+				if( *it == from || !(*it)->session()->isConnected() )
+					continue;
+
+				int caps = (*it)->peerCapabilities();
+				if( (caps & required) != required )
+					continue;
+
+				// an old joiner takes a code over its own last one for a broken stream and drops what it has read.
+				// a joiner which announced any capability skips a code under CODE_LIMIT it does not know.
+				if( data->code >= CODE_MAX && caps == 0 )
+					continue;
+
+				if( data->code == CODE_PAINT_ADD_LINE_COMPACT && (caps & lineCaps) != lineCaps )
+					lineList.push_back( *it );
+				else if( data->compressed && !(caps & CAPABILITY_COMPRESSION) )
+					rawList.push_back( *it );
+				else
+					frameList.push_back( *it );
+			}
+		}
+
+		if( !lineList.empty() )
+		{
+			const CPacketView body( data->body.coalesce(), data->body.size() );
+			boost::shared_ptr<CLineItem> line = PaintPacketBuilder::CAddCompactLine::parse( body );
+			if( line )
+			{
+				// a joiner which can not read this line as it is gets it re-encoded for its capabilities.
+				int lineRequired = CAPABILITY_COMPACT_STROKE | (line->isCurve() ? CAPABILITY_CURVE_STROKE : 0);
+
+				typedef std::map< int, SESSION_LIST > CAPS_SESSION_MAP;
+				CAPS_SESSION_MAP reencodeMap;
+
+				SESSION_LIST::iterator it = lineList.begin();
+				for( ; it != lineList.end(); it++ )
 				{
-					list.erase( it );
-					break;
+					int caps = (*it)->peerCapabilities();
+					if( (caps & lineRequired) != lineRequired )
+						reencodeMap[ caps & SUPPORTED_CAPABILITIES ].push_back( *it );
+					else if( data->compressed && !(caps & CAPABILITY_COMPRESSION) )
+						rawList.push_back( *it );
+					else
+						frameList.push_back( *it );
 				}
+
+				CAPS_SESSION_MAP::iterator itMap = reencodeMap.begin();
+				for( ; itMap != reencodeMap.end(); itMap++ )
+					sendDataToUsers( itMap->second, encodeItem( line, addItemEncoding( line, itMap->first ) ) );	// not a canvas item of this thread
 			}
+		}
 
-			std::string msg = CommonPacketBuilder::makePacket( data->code, data->body );
+		// sent as they are, not compressed again.
+		std::string key = relayStateKey( *data );
+		if( !frameList.empty() )
+			sendDataToUsersWithId( frameList, makePayload( data->frame ), -1, generatePacketId(), false, key );
 
-			sendDataToUsers( list, msg );
-		}
+		if( !rawList.empty() )
+			sendDataToUsersWithId( rawList, makePayload( CommonPacketBuilder::makePacket( data->code, data->body ) ), -1, generatePacketId(), false, key );
 	}
 
 	virtual void onIPaintSessionEvent_Disconnected( boost::shared_ptr<CPaintSession> session )
+	{
+		// after the packets of the session are read. (a join read later would add the user again)
+		boost::shared_ptr<boost::asio::io_service::strand> decodeStrand = session->decodeStrand();
+		if( decodeStrand )
+			decodeStrand->post( boost::bind( &CSharedPaintManager::_onSessionDisconnected, this, session ) );
+		else
+			_onSessionDisconnected( session );
+	}
+
+	void _onSessionDisconnected( boost::shared_ptr<CPaintSession> session )
 	{
 		if( isConnected() == false )
 			caller_.performMainThread( boost::bind( &CSharedPaintManager::fireObserver_DisConnected, this ) );
@@ -790,12 +2306,22 @@ protected:
 			removeUser( user );
 		}
 
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_removeFileTransfers, this, session->sessionId() ) );
+		caller_.performMainThread( boost::bind( &CSharedPaintManager::_removeSyncStream, this, session->sessionId() ) );
+
 		removeSession( session->sessionId() );
 	}
 
+	virtual void onIPaintSessionEvent_SendQueue( boost::shared_ptr<CPaintSession> session, bool congested )
+	{
+		//qDebug() << "send queue" << session->sessionId() << (congested ? "congested" : "drained") << session->session()->queuedBytes();
+		if( !congested )
+			caller_.performMainThread( boost::bind( &CSharedPaintManager::_onSendQueueDrained, this, session->sessionId() ) );
+	}
+
 	virtual void onIPaintSessionEvent_SendingPacket( boost::shared_ptr<CPaintSession> session, const boost::shared_ptr<CNetPacketData> packet )
 	{
-		//qDebug() << "Packet sending " << packet->packetId() << packet->buffer().remainingSize() << packet->buffer().totalSize();
+		//qDebug() << "Packet sending " << packet->packetId() << packet->remainingSize() << packet->totalSize();
 		if( packet->packetId() < 0 )
 			return;	// ignore this!
 
@@ -815,7 +2341,7 @@ protected:
 			{
 				if( (*itD).session == session.get() )
 				{
-					(*itD).wroteBytes = packet->buffer().totalSize() -  packet->buffer().remainingSize();
+					(*itD).wroteBytes = packet->totalSize() -  packet->remainingSize();
 					break;
 				}
 			}
@@ -831,6 +2357,10 @@ protected:
 			{
 				//qDebug() << "sendInfoDataMap_.erase!!i!!" << packet->packetId() << wroteBytes << totalBytes;
 				sendInfoDataMap_.erase( it );
+
+				// the next batch of the snapshot
+				if( syncBatchMap_.erase( packet->packetId() ) > 0 )
+					caller_.performMainThread( boost::bind( &CSharedPaintManager::_onSyncBatchWritten, this, session->sessionId(), packet->packetId() ) );
 			}
 		}
 
@@ -851,9 +2381,89 @@ private:
 	IGluePaintCanvas *canvas_;
 	ITEM_LIST_MAP userItemListMap_;
 	boost::shared_ptr<CBackgroundImageItem> backgroundImageItem_;
+	CTileCodec backgroundTileCodec_;	// my last shot
 	int lastWindowWidth_;
 	int lastWindowHeight_;
 
+	// live stroke
+	boost::shared_ptr<CLineItem> liveStroke_;
+	size_t liveStrokeSentCount_;
+
+	struct SRemoteStroke
+	{
+		QColor color;
+		int width;
+		int nextIndex;
+		QPointF lastPoint;
+	};
+	typedef std::map< std::pair<std::string, int>, struct SRemoteStroke > REMOTE_STROKE_MAP;
+	REMOTE_STROKE_MAP remoteStrokeMap_;
+
+	// file transfer (the store outlives the pins below)
+	CFileStore fileStore_;	// used by fileWriter_ only, but the pins
+	CFileWriter fileWriter_;
+
+	typedef std::map< FILE_SENDER_KEY, boost::shared_ptr<CFileSender> > FILE_SENDER_MAP;
+	FILE_SENDER_MAP fileSenderMap_;
+
+	struct SFileReceive
+	{
+		int sessionId;
+		boost::shared_ptr<CFileReceiver> receiver;
+		bool opened;
+		size_t nextOffset;	// the end of the chunks posted to fileWriter_
+		boost::shared_ptr<CFileStore::CPin> pin;	// the content stays until the item is on the canvas
+	};
+	typedef std::map< FILE_ITEM_KEY, struct SFileReceive > FILE_RECEIVE_MAP;
+	FILE_RECEIVE_MAP fileReceiveMap_;
+
+	// the stored files of the items on the canvas are not evicted.
+	typedef std::map< FILE_ITEM_KEY, boost::shared_ptr<CFileStore::CPin> > FILE_PIN_MAP;
+	FILE_PIN_MAP filePinMap_;
+
+	// item encoding
+	CWorkerPool encodePool_;
+
+	// the packets of the joiners (a strand per session)
+	CWorkerPool decodePool_;
+	boost::mutex mutexDecodeSeq_;
+	boost::uint64_t decodeSeq_;
+
+	// decoded out of order, applied in the relay order. (main thread)
+	typedef std::map< boost::uint64_t, MAIN_THREAD_CALLS > DECODED_MAP;
+	DECODED_MAP decodedMap_;
+	boost::uint64_t appliedSeq_;
+
+	// canvas file being restored (main thread)
+	boost::shared_ptr<CCanvasFile> restoringCanvas_;
+	CPaintJournal journal_;
+
+	// late joiner snapshot
+	struct SSyncFile
+	{
+		std::string packet;
+		int version;		// the encoding version of the item it was made for
+	};
+	typedef std::map< SYNC_ITEM_KEY, struct SSyncFile > SYNC_FILE_MAP;
+
+	struct SSyncStream
+	{
+		int caps;
+		std::string header;
+		std::deque< SYNC_ITEM_KEY > lightItems;
+		std::deque< SYNC_ITEM_KEY > fileItems;
+		boost::shared_ptr<CBackgroundImageItem> background;	// null : sent
+		std::string backgroundOwner;
+		boost::uint32_t backgroundFrame;	// the tile frame sent (see CTileCodec)
+		int nextTile;
+		int transferId;
+		std::deque<int> batchIds;	// in flight
+		std::set< SYNC_ITEM_KEY > encodingFiles;	// on encodePool_
+		SYNC_FILE_MAP readyFiles;
+	};
+	typedef std::map< int, struct SSyncStream > SYNC_STREAM_MAP;
+	SYNC_STREAM_MAP syncStreamMap_;
+
 	// user management
 	boost::recursive_mutex mutexUser_;
 	boost::shared_ptr<CPaintUser> myUserInfo_;
@@ -861,6 +2471,27 @@ private:
 	
 	// network
 	CNetServiceRunner netRunner_;
+	size_t sendQueueBytes_;
+	size_t sendQueuePackets_;
+	int sendQueuePolicy_;
+	int writeDelayMs_;
+
+	// coalesced states (see sendStateToUsers)
+	struct SPendingState
+	{
+		SPendingState( void ) : lastSent(0), seq(0) { }
+
+		std::string msg;	// empty : nothing waits
+		qint64 lastSent;
+		boost::uint64_t seq;
+	};
+	typedef std::map< std::string, struct SPendingState > STATE_MAP;
+	STATE_MAP stateMap_;
+	size_t pendingStateCount_;
+	boost::uint64_t stateSeq_;
+	int stateIntervalMs_;
+	boost::scoped_ptr< boost::asio::deadline_timer > stateTimer_;	// destroyed before netRunner_
+	bool stateTimerArmed_;
 	bool serverMode_;
 	int acceptPort_;
 	SESSION_LIST sessionList_;
@@ -879,5 +2510,6 @@ private:
 	};
 	typedef std::map< int, std::vector<struct send_byte_info_t> > send_info_map_t;
 	send_info_map_t sendInfoDataMap_;
+	std::map< int, int > syncBatchMap_;	// snapshot batch packet id, session id
 	int lastPacketId_;
 };
@@ -4,6 +4,8 @@
 
 static const int DEFAULT_HIDE_POS_X = 9999;
 static const int DEFAULT_HIDE_POS_Y = 9999;
+static const char DEFAULT_CANVAS_FILE_NAME[] = "SharedPainter.canvas";
+static const char DEFAULT_JOURNAL_FILE_NAME[] = "SharedPainter.journal";
 
 SharedPainter::SharedPainter(CSharedPainterScene *canvas, QWidget *parent, Qt::WFlags flags)
 	: QMainWindow(parent, flags), canvas_(canvas), currPaintItemId_(1), currPacketId_(-1), resizeFreezingFlag_(false), screenShotMode_(false), wroteProgressBar_(NULL)
@@ -12,9 +14,15 @@ SharedPainter::SharedPainter(CSharedPainterScene *canvas, QWidget *parent, Qt::W
 
 	ui.painterView->setScene( canvas );
 	canvas_->setEvent( this );
+	canvas_->setStrokeProcessing( (CStrokeProcessor::Mode)SettingManagerPtr()->strokeMode(), SettingManagerPtr()->strokeTolerance() );
 
 	SharePaintManagerPtr()->registerObserver( this );
 	SharePaintManagerPtr()->setCanvas( canvas_ );
+	SharePaintManagerPtr()->setFileStoreCapacity( SettingManagerPtr()->fileStoreCapacity() );
+	SharePaintManagerPtr()->setNetworkThreadCount( SettingManagerPtr()->networkThreadCount(), SettingManagerPtr()->networkPinThreads() );
+	SharePaintManagerPtr()->setSendQueueLimit( SettingManagerPtr()->sendQueueBytes(), SettingManagerPtr()->sendQueuePackets(), SettingManagerPtr()->sendQueuePolicy() );
+	SharePaintManagerPtr()->setStateSendRate( SettingManagerPtr()->stateSendRate() );
+	SharePaintManagerPtr()->setWriteDelay( SettingManagerPtr()->writeDelayMs() );
 	
 	QMenuBar *menuBar = ui.menuBar;
 
@@ -121,6 +129,9 @@ static bool checkKeyPressed( int virtKey )
 
 void SharedPainter::onTimer( void )
 {
+	// the points of the stroke drawn since the last tick
+	SharePaintManagerPtr()->flushLiveStroke();
+
 	//if(!isActiveWindow())
 	//	return;
 	//
@@ -348,6 +359,7 @@ void SharedPainter::actionServerType( void )
 		return;
 
 	SharePaintManagerPtr()->startServer( SettingManagerPtr()->broadCastChannel() );
+	SharePaintManagerPtr()->openJournal( DEFAULT_JOURNAL_FILE_NAME, DEFAULT_CANVAS_FILE_NAME );	// the canvas of the last run, if this one is empty
 	setStatusBar_BroadCastType( tr("Server Type") );
 }
 
@@ -393,6 +405,7 @@ void SharedPainter::showEvent( QShowEvent * evt )
 void SharedPainter::closeEvent( QCloseEvent *evt )
 {
 	SettingManagerPtr()->save();
+	SharePaintManagerPtr()->saveCanvas();	// a server only, in DEFAULT_CANVAS_FILE_NAME of openJournal
 	SharePaintManagerPtr()->clearAllItems();
 
 	QMainWindow::closeEvent( evt );
@@ -439,10 +452,16 @@ void SharedPainter::resizeEvent( QResizeEvent *evt )
 }
 
 
-void SharedPainter::_requestAddItem( boost::shared_ptr<CPaintItem> item )
+void SharedPainter::_setItemId( boost::shared_ptr<CPaintItem> item )
 {
 	item->setOwner( SharePaintManagerPtr()->myId() );
 	item->setItemId( currPaintItemId_++ );
+}
+
+void SharedPainter::_requestAddItem( boost::shared_ptr<CPaintItem> item )
+{
+	if( item->itemId() <= 0 )	// a stroke has the id since it began
+		_setItemId( item );
 
 	SharePaintManagerPtr()->sendPaintItem( item );
 }
@@ -458,9 +477,18 @@ void SharedPainter::onICanvasViewEvent_EndMove( CSharedPainterScene *view, boost
 	SharePaintManagerPtr()->notifyMoveItem( item );
 }
 
+void SharedPainter::onICanvasViewEvent_BeginStroke( CSharedPainterScene *view, boost::shared_ptr<CLineItem> line )
+{
+	_setItemId( line );
+
+	SharePaintManagerPtr()->beginLiveStroke( line );
+}
+
 void SharedPainter::onICanvasViewEvent_DrawItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item  )
 {
 	_requestAddItem( item );
+
+	SharePaintManagerPtr()->endLiveStroke( item );
 }
 
 void SharedPainter::onICanvasViewEvent_UpdateItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item )
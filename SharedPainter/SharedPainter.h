@@ -54,6 +54,7 @@ protected slots:
 	void actionClientType( void );
 
 private:
+	void _setItemId( boost::shared_ptr<CPaintItem> item );
 	void _requestAddItem( boost::shared_ptr<CPaintItem> item );
 	QPointF _calculateTextPos( int textSize );
 	bool getBroadcastChannelString( bool force = false );
@@ -62,6 +63,7 @@ protected:
 	// ICanvasViewEvent
 	virtual void onICanvasViewEvent_BeginMove( CSharedPainterScene *view, boost::shared_ptr< CPaintItem > item );
 	virtual void onICanvasViewEvent_EndMove( CSharedPainterScene *view, boost::shared_ptr< CPaintItem > item );
+	virtual void onICanvasViewEvent_BeginStroke( CSharedPainterScene *view, boost::shared_ptr<CLineItem> line );
 	virtual void onICanvasViewEvent_DrawItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item );
 	virtual void onICanvasViewEvent_UpdateItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item );
 	virtual void onICanvasViewEvent_RemoveItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item );
@@ -172,6 +174,11 @@ protected:
 		setStatusBar_JoinerCnt( self->userCount() );
 	}
 
+	virtual void onISharedPaintEvent_RestoreFailed( CSharedPaintManager *self, const QString &path )
+	{
+		QMessageBox::warning( this, "", tr("The canvas of the last run can't be restored.\n") + path );
+	}
+
 
 private:
 	Ui::SharedPainterClass ui;
@@ -309,9 +309,19 @@ void CSharedPainterScene::drawLine( boost::shared_ptr<CLineItem> line )
 	painterPath.moveTo( *line->point( 0 ) );
 	if( line->pointSize() > 1 )
 	{
-		for( size_t i = 1; i < line->pointSize(); i++ )
+		if( line->isCurve() )
 		{
-			painterPath.lineTo( *line->point( i ) );
+			for( size_t i = 1; i + 2 < line->pointSize(); i += 3 )
+			{
+				painterPath.cubicTo( *line->point( i ), *line->point( i + 1 ), *line->point( i + 2 ) );
+			}
+		}
+		else
+		{
+			for( size_t i = 1; i < line->pointSize(); i++ )
+			{
+				painterPath.lineTo( *line->point( i ) );
+			}
 		}
 
 		CMyGraphicItem<QGraphicsPathItem> *pathItem = new CMyGraphicItem<QGraphicsPathItem>( this );
@@ -376,6 +386,59 @@ void CSharedPainterScene::drawBackgroundImage( boost::shared_ptr<CBackgroundImag
 	invalidate( QRectF(), QGraphicsScene::BackgroundLayer );
 }
 
+void CSharedPainterScene::drawBackgroundImageTiles( boost::shared_ptr<CBackgroundImageItem> image, const std::vector<QRect> &rects )
+{
+	if( !image || image != backgroundImageItem_ || backgroundPixmap_.isNull() )
+	{
+		drawBackgroundImage( image );
+		return;
+	}
+
+	// patch in place, the rest of the background is not converted again.
+	const QImage &source = image->image();
+	QPainter pixmapPainter( &backgroundPixmap_ );
+	QPainter painter( &image_ );
+	for( size_t i = 0; i < rects.size(); i++ )
+	{
+		pixmapPainter.drawImage( rects[i].topLeft(), source, rects[i] );
+		painter.drawImage( rects[i].topLeft(), source, rects[i] );
+		invalidate( rects[i], QGraphicsScene::BackgroundLayer );
+	}
+}
+
+void CSharedPainterScene::drawLiveStroke( const std::string &owner, int itemId, const QColor &clr, int width, const std::vector<QPointF> &points )
+{
+	if( points.empty() )
+		return;
+
+	// only the new batch is added, the earlier pieces are not rebuilt.
+	QPainterPath path;
+	path.moveTo( points[0] );
+	for( size_t i = 1; i < points.size(); i++ )
+		path.lineTo( points[i] );
+	if( points.size() == 1 )
+		path.lineTo( points[0] );	// a dot
+
+	QGraphicsPathItem *item = addPath( path, QPen(clr, width, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin) );
+	item->setZValue( ZVALUE_TOPMOST );
+
+	liveStrokeMap_[ std::make_pair( owner, itemId ) ].push_back( item );
+}
+
+void CSharedPainterScene::removeLiveStroke( const std::string &owner, int itemId )
+{
+	LIVE_STROKE_MAP::iterator it = liveStrokeMap_.find( std::make_pair( owner, itemId ) );
+	if( it == liveStrokeMap_.end() )
+		return;
+
+	for( size_t i = 0; i < it->second.size(); i++ )
+	{
+		QGraphicsScene::removeItem( it->second[i] );
+		delete it->second[i];
+	}
+	liveStrokeMap_.erase( it );
+}
+
 void CSharedPainterScene::drawLineTo( const QPointF &pt1, const QPointF &pt2, const QColor &clr, int width )
 {
 	QGraphicsLineItem *item = addLine( pt1.x(), pt1.y(), pt2.x(), pt2.y(), QPen(clr, width, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin) );
@@ -528,6 +591,8 @@ void CSharedPainterScene::mousePressEvent( QGraphicsSceneMouseEvent *evt )
 		currLineItem_->setMyItem();
 
 		currentLineZValue_ = currentZValue();
+
+		fireEvent_BeginStroke( currLineItem_ );
 	}
 }
 
@@ -566,6 +631,10 @@ void CSharedPainterScene::mouseReleaseEvent( QGraphicsSceneMouseEvent *evt )
 	{
 		drawFlag_ = false;
 
+		// reduce the samples once, before the line is stored and sent.
+		if( currLineItem_ )
+			strokeProcessor_.process( *currLineItem_ );
+
 		fireEvent_DrawItem( currLineItem_ );
 
 		currLineItem_ = boost::shared_ptr<CLineItem>();
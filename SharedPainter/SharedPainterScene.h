@@ -11,6 +11,7 @@ class ICanvasViewEvent
 public:
 	virtual void onICanvasViewEvent_BeginMove( CSharedPainterScene *view, boost::shared_ptr< CPaintItem > item ) = 0;
 	virtual void onICanvasViewEvent_EndMove( CSharedPainterScene *view, boost::shared_ptr< CPaintItem > item ) = 0;
+	virtual void onICanvasViewEvent_BeginStroke( CSharedPainterScene *view, boost::shared_ptr<CLineItem> line ) = 0;
 	virtual void onICanvasViewEvent_DrawItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item ) = 0;
 	virtual void onICanvasViewEvent_UpdateItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item ) = 0;
 	virtual void onICanvasViewEvent_RemoveItem( CSharedPainterScene *view, boost::shared_ptr<CPaintItem> item ) = 0;
@@ -60,6 +61,12 @@ public:
 		penWidth_ = width;
 	}
 
+	void setStrokeProcessing( CStrokeProcessor::Mode mode, double tolerance )
+	{
+		strokeProcessor_.setMode( mode );
+		strokeProcessor_.setTolerance( tolerance );
+	}
+
 	bool isFreePenMode( void ) { return freePenMode_; }
 
 	int penWidth( void ) { return penWidth_; }
@@ -78,6 +85,9 @@ public:
 	virtual void drawImage( boost::shared_ptr<CImageFileItem> image );
 	virtual void drawBackgroundImage( boost::shared_ptr<CBackgroundImageItem> image );
 	virtual void clearBackgroundImage( void );
+	virtual void drawBackgroundImageTiles( boost::shared_ptr<CBackgroundImageItem> image, const std::vector<QRect> &rects );
+	virtual void drawLiveStroke( const std::string &owner, int itemId, const QColor &clr, int width, const std::vector<QPointF> &points );
+	virtual void removeLiveStroke( const std::string &owner, int itemId );
 	virtual void clearScreen( void )
 	{
 		currentZValue_ = ZVALUE_NORMAL;
@@ -119,6 +129,12 @@ private:
 	void setScaleImageFileItem( boost::shared_ptr<CImageFileItem> image, QGraphicsPixmapItem *pixmapItem );
 	void commonAddItem( QGraphicsItem *item );
 
+	inline void fireEvent_BeginStroke( boost::shared_ptr<CLineItem> line )
+	{
+		if(eventTarget_)
+			eventTarget_->onICanvasViewEvent_BeginStroke( this, line );
+	}
+
 	inline void fireEvent_DrawItem( boost::shared_ptr<CPaintItem> item )
 	{
 		if(eventTarget_)
@@ -137,9 +153,14 @@ private:
 
 	boost::shared_ptr<CBackgroundImageItem> backgroundImageItem_;
 	boost::shared_ptr<CLineItem> currLineItem_;
+	CStrokeProcessor strokeProcessor_;
 
 	std::vector< QGraphicsLineItem * > tempLineItemList_;
 
+	// remote in-progress strokes. one path item per received batch.
+	typedef std::map< std::pair<std::string, int>, std::vector< QGraphicsPathItem * > > LIVE_STROKE_MAP;
+	LIVE_STROKE_MAP liveStrokeMap_;
+
 	QFileIconProvider fileIconProvider_;
 	qreal currentZValue_;
 	qreal currentLineZValue_;
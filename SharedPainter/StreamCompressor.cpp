@@ -0,0 +1,93 @@
+#include "StdAfx.h"
+#include "StreamCompressor.h"
+
+#define DEFLATE_CHUNK_SIZE		4096
+#define DEFLATE_MEM_LEVEL		8
+
+CStreamCompressor::CStreamCompressor( void )
+{
+	memset( &stream_, 0, sizeof(stream_) );
+
+	// raw deflate : no zlib header and no checksum, tcp already checks the bytes.
+	valid_ = deflateInit2( &stream_, CompressLevel, Z_DEFLATED, -MAX_WBITS, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY ) == Z_OK;
+}
+
+CStreamCompressor::~CStreamCompressor( void )
+{
+	if( valid_ )
+		deflateEnd( &stream_ );
+}
+
+PAYLOAD_PTR CStreamCompressor::compress( const CIOBuffer &data )
+{
+	if( !valid_ || data.empty() )
+		return PAYLOAD_PTR();
+
+	std::string res;
+	char chunk[DEFLATE_CHUNK_SIZE];
+
+	for( size_t i = 0; i < data.segmentCount(); i++ )
+	{
+		const CIOBuffer::Segment &seg = data.segment( i );
+		int flush = ( i + 1 == data.segmentCount() ) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+		stream_.next_in = (Bytef *)seg.data();
+		stream_.avail_in = (uInt)seg.length;
+
+		// the output is full : there may be more to come.
+		do
+		{
+			stream_.next_out = (Bytef *)chunk;
+			stream_.avail_out = sizeof(chunk);
+
+			if( deflate( &stream_, flush ) == Z_STREAM_ERROR )
+			{
+				valid_ = false;
+				return PAYLOAD_PTR();
+			}
+
+			res.append( chunk, sizeof(chunk) - stream_.avail_out );
+		} while( stream_.avail_out == 0 );
+	}
+
+	boost::shared_ptr<CIOBuffer> payload( new CIOBuffer );
+	payload->adopt( res );
+	return payload;
+}
+
+CStreamDecompressor::CStreamDecompressor( void )
+{
+	memset( &stream_, 0, sizeof(stream_) );
+	valid_ = inflateInit2( &stream_, -MAX_WBITS ) == Z_OK;
+}
+
+CStreamDecompressor::~CStreamDecompressor( void )
+{
+	if( valid_ )
+		inflateEnd( &stream_ );
+}
+
+bool CStreamDecompressor::decompress( const char *in, size_t inSize, size_t &consumed, char *out, size_t outSize, size_t &produced )
+{
+	consumed = produced = 0;
+	if( !valid_ )
+		return false;
+
+	stream_.next_in = (Bytef *)in;
+	stream_.avail_in = (uInt)inSize;
+	stream_.next_out = (Bytef *)out;
+	stream_.avail_out = (uInt)outSize;
+
+	int ret = inflate( &stream_, Z_SYNC_FLUSH );
+
+	consumed = inSize - stream_.avail_in;
+	produced = outSize - stream_.avail_out;
+
+	// Z_BUF_ERROR : no progress possible now, waits for more input.
+	// the sender never ends the stream, so Z_STREAM_END is broken too.
+	if( ret == Z_OK || ret == Z_BUF_ERROR )
+		return true;
+
+	valid_ = false;
+	return false;
+}
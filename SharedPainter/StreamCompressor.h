@@ -0,0 +1,62 @@
+#pragma once
+
+#include <zlib.h>
+#include "IOBuffer.h"
+#include "NetPacketData.h"
+
+//---------------------------------------------
+// per connection stream compression
+//---------------------------------------------
+//
+// One raw deflate stream for the life of the connection. Every payload is flushed
+// to a byte boundary (Z_SYNC_FLUSH), so the peer inflates each packet as soon as it is received.
+// The history window is shared by all the packets, so the small ones which repeat
+// the owner id and the same layout (move, update, remove, short lines ...) cost a few bytes each.
+//
+// The sender switches with CODE_SYSTEM_STREAM_COMPRESSION, sent raw. every byte after it is deflated.
+// (see CNetPeerSession::startStreamCompression, CPaintSession)
+//
+
+class CStreamCompressor
+{
+public:
+	static const int CompressLevel = 1;
+
+	CStreamCompressor( void );
+	~CStreamCompressor( void );
+
+	bool isValid( void ) { return valid_; }
+
+	// the deflated data, flushed at its end. NULL on an error.
+	// the stream state moves on, so the payloads must be sent in the order they are compressed.
+	PAYLOAD_PTR compress( const CIOBuffer &data );
+
+private:
+	CStreamCompressor( const CStreamCompressor & );
+	CStreamCompressor & operator = ( const CStreamCompressor & );
+
+private:
+	z_stream stream_;
+	bool valid_;
+};
+
+class CStreamDecompressor
+{
+public:
+	CStreamDecompressor( void );
+	~CStreamDecompressor( void );
+
+	bool isValid( void ) { return valid_; }
+
+	// inflate the input into out as far as it fits.
+	// returns false on a broken stream. (the connection can not be recovered)
+	bool decompress( const char *in, size_t inSize, size_t &consumed, char *out, size_t outSize, size_t &produced );
+
+private:
+	CStreamDecompressor( const CStreamDecompressor & );
+	CStreamDecompressor & operator = ( const CStreamDecompressor & );
+
+private:
+	z_stream stream_;
+	bool valid_;
+};
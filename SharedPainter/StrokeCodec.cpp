@@ -0,0 +1,281 @@
+#include "StdAfx.h"
+#include "StrokeCodec.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2_STROKE_CODEC 1
+#endif
+
+static inline boost::int32_t quantize( double value, double scale )
+{
+	double v = value * scale;
+	if( v >= 2147483647.0 )
+		return 0x7fffffff;
+	if( v <= -2147483648.0 )
+		return (boost::int32_t)0x80000000;
+	return (boost::int32_t)( v < 0 ? v - 0.5 : v + 0.5 );
+}
+
+static inline boost::uint32_t zigzag( boost::uint32_t delta )
+{
+	return (delta << 1) ^ (boost::uint32_t)((boost::int32_t)delta >> 31);
+}
+
+static inline boost::uint32_t unzigzag( boost::uint32_t value )
+{
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+std::string CStrokeCodec::encodePoints( const std::vector<QPointF> &points, int fracBits )
+{
+	std::string packed;
+	if( points.empty() )
+		return packed;
+
+	std::vector<boost::uint32_t> deltas( points.size() * 2 );
+	quantizeDeltas( &points[0], points.size(), fracBits, &deltas[0] );
+
+#if defined(USE_SSE2_STROKE_CODEC) && !defined(NDEBUG)
+	std::vector<boost::uint32_t> check( deltas.size() );
+	quantizeDeltasScalar( &points[0], points.size(), fracBits, &check[0] );
+	assert( check == deltas );
+#endif
+
+	packed.resize( deltas.size() * 5 );	// 5 bytes : the longest 32bit varint
+	size_t size = packVarints( &deltas[0], deltas.size(), &packed[0] );
+	packed.resize( size );
+	return packed;
+}
+
+void CStrokeCodec::writePoints( CPacketWriter &writer, size_t count, const std::string &packed )
+{
+	writer.writeInt32( (boost::int32_t)count );
+	writer.writeString32( packed );
+}
+
+bool CStrokeCodec::readPoints( CPacketReader &reader, int fracBits, std::vector<QPointF> &points )
+{
+	boost::int32_t count = 0;
+	CPacketView packed;
+
+	if( !reader.readInt32( count ) || !reader.readString32( packed ) )
+		return false;
+
+	if( fracBits < 0 || fracBits > MaxFracBits )
+		return false;
+
+	// a coordinate takes 1 byte at least, so a bigger count is broken. (no allocation on a lie)
+	if( count < 0 || (size_t)count * 2 > packed.size() )
+		return false;
+
+	points.clear();
+	if( count <= 0 )
+		return true;
+
+	std::vector<boost::uint32_t> deltas( count * 2 );
+	if( !unpackVarints( packed.data(), packed.size(), &deltas[0], deltas.size() ) )
+		return false;
+
+	points.resize( count );
+	restorePoints( &deltas[0], count, fracBits, &points[0] );
+	return true;
+}
+
+static inline void quantizeRange( const QPointF *points, size_t begin, size_t count, double scale, boost::uint32_t prevX, boost::uint32_t prevY, boost::uint32_t *out )
+{
+	for( size_t i = begin; i < count; i++ )
+	{
+		boost::uint32_t x = (boost::uint32_t)quantize( points[i].x(), scale );
+		boost::uint32_t y = (boost::uint32_t)quantize( points[i].y(), scale );
+		out[i * 2] = zigzag( x - prevX );
+		out[i * 2 + 1] = zigzag( y - prevY );
+		prevX = x;
+		prevY = y;
+	}
+}
+
+#ifdef USE_SSE2_STROKE_CODEC
+// quantize() of two lanes : saturate, add 0.5 with the sign of the value, truncate.
+// the bound is given first, so a NaN stays NaN and truncates to 0x80000000 like the scalar cast.
+static inline __m128i quantizePair( __m128d v )
+{
+	const __m128d hi = _mm_set1_pd( 2147483647.0 );
+	const __m128d lo = _mm_set1_pd( -2147483648.0 );
+	const __m128d sign = _mm_set1_pd( -0.0 );
+	const __m128d half = _mm_set1_pd( 0.5 );
+
+	v = _mm_max_pd( lo, _mm_min_pd( hi, v ) );
+	__m128d rounded = _mm_add_pd( v, _mm_or_pd( _mm_and_pd( v, sign ), half ) );
+	return _mm_cvttpd_epi32( rounded );
+}
+#endif
+
+void CStrokeCodec::quantizeDeltasScalar( const QPointF *points, size_t count, int fracBits, boost::uint32_t *out )
+{
+	quantizeRange( points, 0, count, (double)(1 << fracBits), 0, 0, out );
+}
+
+void CStrokeCodec::quantizeDeltas( const QPointF *points, size_t count, int fracBits, boost::uint32_t *out )
+{
+	const double scale = (double)(1 << fracBits);
+	boost::uint32_t prevX = 0, prevY = 0;
+	size_t i = 0;
+
+#ifdef USE_SSE2_STROKE_CODEC
+	// two points per step : | x0 | y0 | x1 | y1 |
+	const __m128d vscale = _mm_set1_pd( scale );
+	__m128i prev = _mm_setzero_si128();
+	for( ; i + 2 <= count; i += 2 )
+	{
+		__m128d p0 = _mm_mul_pd( _mm_set_pd( points[i].y(), points[i].x() ), vscale );
+		__m128d p1 = _mm_mul_pd( _mm_set_pd( points[i + 1].y(), points[i + 1].x() ), vscale );
+		__m128i q = _mm_unpacklo_epi64( quantizePair( p0 ), quantizePair( p1 ) );
+
+		// the previous point of each lane : | px | py | x0 | y0 |
+		__m128i before = _mm_or_si128( _mm_slli_si128( q, 8 ), _mm_srli_si128( prev, 8 ) );
+		__m128i d = _mm_sub_epi32( q, before );
+		__m128i zz = _mm_xor_si128( _mm_slli_epi32( d, 1 ), _mm_srai_epi32( d, 31 ) );
+
+		_mm_storeu_si128( (__m128i *)(out + i * 2), zz );
+		prev = q;
+	}
+
+	boost::uint32_t last[4];
+	_mm_storeu_si128( (__m128i *)last, prev );
+	prevX = last[2];
+	prevY = last[3];
+#endif
+
+	quantizeRange( points, i, count, scale, prevX, prevY, out );
+}
+
+void CStrokeCodec::restorePoints( const boost::uint32_t *in, size_t count, int fracBits, QPointF *points )
+{
+	const double inv = 1.0 / (double)(1 << fracBits);
+	boost::uint32_t x = 0, y = 0;
+	size_t i = 0;
+
+#ifdef USE_SSE2_STROKE_CODEC
+	const __m128d vinv = _mm_set1_pd( inv );
+	const __m128i one = _mm_set1_epi32( 1 );
+	__m128i carry = _mm_setzero_si128();	// | px | py | px | py |
+	for( ; i + 2 <= count; i += 2 )
+	{
+		__m128i zz = _mm_loadu_si128( (const __m128i *)(in + i * 2) );
+		__m128i d = _mm_xor_si128( _mm_srli_epi32( zz, 1 ), _mm_sub_epi32( _mm_setzero_si128(), _mm_and_si128( zz, one ) ) );
+
+		// prefix sum of the two points, then add the last point of the previous step.
+		d = _mm_add_epi32( d, _mm_slli_si128( d, 8 ) );
+		__m128i v = _mm_add_epi32( d, carry );
+		carry = _mm_shuffle_epi32( v, _MM_SHUFFLE(3, 2, 3, 2) );
+
+		__m128d p0 = _mm_mul_pd( _mm_cvtepi32_pd( v ), vinv );
+		__m128d p1 = _mm_mul_pd( _mm_cvtepi32_pd( _mm_srli_si128( v, 8 ) ), vinv );
+
+		double xy[4];
+		_mm_storeu_pd( xy, p0 );
+		_mm_storeu_pd( xy + 2, p1 );
+		points[i] = QPointF( xy[0], xy[1] );
+		points[i + 1] = QPointF( xy[2], xy[3] );
+	}
+
+	boost::uint32_t last[4];
+	_mm_storeu_si128( (__m128i *)last, carry );
+	x = last[0];
+	y = last[1];
+#endif
+
+	for( ; i < count; i++ )
+	{
+		x += unzigzag( in[i * 2] );
+		y += unzigzag( in[i * 2 + 1] );
+		points[i] = QPointF( (boost::int32_t)x * inv, (boost::int32_t)y * inv );
+	}
+}
+
+size_t CStrokeCodec::packVarints( const boost::uint32_t *in, size_t count, char *out )
+{
+	char *p = out;
+	size_t i = 0;
+
+#ifdef USE_SSE2_STROKE_CODEC
+	const __m128i highMask = _mm_set1_epi32( ~0x7f );
+#endif
+
+	while( i < count )
+	{
+#ifdef USE_SSE2_STROKE_CODEC
+		// four values below 0x80 are four bytes as they are.
+		if( count - i >= 4 )
+		{
+			__m128i v = _mm_loadu_si128( (const __m128i *)(in + i) );
+			if( _mm_movemask_epi8( _mm_cmpeq_epi32( _mm_and_si128( v, highMask ), _mm_setzero_si128() ) ) == 0xffff )
+			{
+				__m128i bytes = _mm_packus_epi16( _mm_packs_epi32( v, v ), _mm_setzero_si128() );
+				int four = _mm_cvtsi128_si32( bytes );
+				memcpy( p, &four, 4 );
+				p += 4;
+				i += 4;
+				continue;
+			}
+		}
+#endif
+		boost::uint32_t v = in[i++];
+		while( v >= 0x80 )
+		{
+			*p++ = (char)(v | 0x80);
+			v >>= 7;
+		}
+		*p++ = (char)v;
+	}
+	return p - out;
+}
+
+bool CStrokeCodec::unpackVarints( const char *in, size_t size, boost::uint32_t *out, size_t count )
+{
+	const unsigned char *p = (const unsigned char *)in;
+	const unsigned char *end = p + size;
+	size_t i = 0;
+
+	while( i < count )
+	{
+#ifdef USE_SSE2_STROKE_CODEC
+		// sixteen 1 byte varints at once.
+		if( count - i >= 16 && end - p >= 16 )
+		{
+			__m128i bytes = _mm_loadu_si128( (const __m128i *)p );
+			if( _mm_movemask_epi8( bytes ) == 0 )
+			{
+				const __m128i zero = _mm_setzero_si128();
+				__m128i lo = _mm_unpacklo_epi8( bytes, zero );
+				__m128i hi = _mm_unpackhi_epi8( bytes, zero );
+				_mm_storeu_si128( (__m128i *)(out + i), _mm_unpacklo_epi16( lo, zero ) );
+				_mm_storeu_si128( (__m128i *)(out + i + 4), _mm_unpackhi_epi16( lo, zero ) );
+				_mm_storeu_si128( (__m128i *)(out + i + 8), _mm_unpacklo_epi16( hi, zero ) );
+				_mm_storeu_si128( (__m128i *)(out + i + 12), _mm_unpackhi_epi16( hi, zero ) );
+				p += 16;
+				i += 16;
+				continue;
+			}
+		}
+#endif
+		if( p >= end )
+			return false;
+
+		boost::uint32_t b = *p++;
+		boost::uint32_t v = b & 0x7f;
+		int shift = 7;
+		while( b >= 0x80 )
+		{
+			if( p >= end || shift > 28 )
+				return false;
+			b = *p++;
+			v |= (b & 0x7f) << shift;
+			shift += 7;
+		}
+		out[i++] = v;
+	}
+
+	// the packed length and the count must agree.
+	return p == end;
+}
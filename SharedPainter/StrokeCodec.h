@@ -0,0 +1,43 @@
+#pragma once
+
+#include "PacketBuffer.h"
+
+//---------------------------------------------
+// compact stroke point encoding
+//---------------------------------------------
+//
+// | point count (4byte) | packed length (4byte) | packed points ... |
+//
+// Every coordinate is quantized to fixed point with fracBits fraction bits,
+// stored as the delta from the previous point (zigzag), and packed as a varint.
+// A mouse stroke mostly takes 1 byte per coordinate instead of an 8 byte double.
+//
+
+class CStrokeCodec
+{
+public:
+	static const int DefaultFracBits = 2;	// 1/4 pixel
+	static const int MaxFracBits = 8;
+
+	// packed points of the stroke. (count and packed bytes are separate, see writePoints)
+	static std::string encodePoints( const std::vector<QPointF> &points, int fracBits );
+
+	static size_t pointsSize( const std::string &packed ) { return 4 + CPacketWriter::sizeString32( packed ); }
+	static void writePoints( CPacketWriter &writer, size_t count, const std::string &packed );
+
+	// never throws. false on a broken or truncated point array.
+	static bool readPoints( CPacketReader &reader, int fracBits, std::vector<QPointF> &points );
+
+	// stages (exposed for the stroke processing code, and for checking the simd path against the scalar one)
+public:
+	// points -> interleaved zigzag deltas of the fixed point x, y
+	// rounded half away from zero, saturated to 32bit. the same bits with or without simd.
+	static void quantizeDeltas( const QPointF *points, size_t count, int fracBits, boost::uint32_t *out );
+	static void quantizeDeltasScalar( const QPointF *points, size_t count, int fracBits, boost::uint32_t *out );
+
+	// interleaved zigzag deltas -> points
+	static void restorePoints( const boost::uint32_t *in, size_t count, int fracBits, QPointF *points );
+
+	static size_t packVarints( const boost::uint32_t *in, size_t count, char *out );
+	static bool unpackVarints( const char *in, size_t size, boost::uint32_t *out, size_t count );
+};
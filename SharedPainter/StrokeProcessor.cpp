@@ -0,0 +1,329 @@
+#include "StdAfx.h"
+#include "StrokeProcessor.h"
+#include "PaintItem.h"
+#include <cmath>
+
+#define MAX_REPARAMETERIZE	4
+#define MAX_FLATTEN_STEPS	256
+
+static inline double dot( const QPointF &a, const QPointF &b )
+{
+	return a.x() * b.x() + a.y() * b.y();
+}
+
+static inline double distance2( const QPointF &a, const QPointF &b )
+{
+	QPointF d = a - b;
+	return dot( d, d );
+}
+
+static inline QPointF unitVector( const QPointF &v )
+{
+	double len = sqrt( dot( v, v ) );
+	if( len < 1e-12 )
+		return QPointF( 0, 0 );
+	return v / len;
+}
+
+// squared distance from p to the segment a-b. (a closed stroke has a == b)
+static double segmentDistance2( const QPointF &p, const QPointF &a, const QPointF &b )
+{
+	QPointF ab = b - a;
+	double len2 = dot( ab, ab );
+	if( len2 <= 0 )
+		return distance2( p, a );
+
+	double t = dot( p - a, ab ) / len2;
+	if( t <= 0 )
+		return distance2( p, a );
+	if( t >= 1 )
+		return distance2( p, b );
+	return distance2( p, a + ab * t );
+}
+
+static QPointF bezierPoint( const QPointF *ctrl, double t )
+{
+	double s = 1 - t;
+	return ctrl[0] * (s * s * s) + ctrl[1] * (3 * s * s * t) + ctrl[2] * (3 * s * t * t) + ctrl[3] * (t * t * t);
+}
+
+void CStrokeProcessor::process( CLineItem &line ) const
+{
+	if( mode_ == MODE_NONE || line.isCurve() || line.pointSize() <= 2 )
+		return;
+
+	std::vector<QPointF> res;
+	if( mode_ == MODE_CURVE )
+	{
+		fitCurve( line.points(), tolerance_, res );
+		line.setPoints( res, true );
+	}
+	else
+	{
+		simplify( line.points(), tolerance_, res );
+		line.setPoints( res, false );
+	}
+}
+
+void CStrokeProcessor::simplify( const std::vector<QPointF> &points, double tolerance, std::vector<QPointF> &res )
+{
+	res.clear();
+	if( points.size() <= 2 )
+	{
+		res = points;
+		return;
+	}
+
+	const double tolerance2 = tolerance * tolerance;
+	std::vector<char> keep( points.size(), 0 );
+	keep[0] = keep[points.size() - 1] = 1;
+
+	// explicit stack instead of recursion. (a long stroke must not exhaust the call stack)
+	std::vector< std::pair<size_t, size_t> > ranges;
+	ranges.push_back( std::make_pair( (size_t)0, points.size() - 1 ) );
+
+	while( !ranges.empty() )
+	{
+		size_t first = ranges.back().first;
+		size_t last = ranges.back().second;
+		ranges.pop_back();
+
+		size_t farthest = 0;
+		double maxDist2 = tolerance2;
+		for( size_t i = first + 1; i < last; i++ )
+		{
+			double d = segmentDistance2( points[i], points[first], points[last] );
+			if( d > maxDist2 )
+			{
+				maxDist2 = d;
+				farthest = i;
+			}
+		}
+
+		if( farthest == 0 )
+			continue;
+
+		keep[farthest] = 1;
+		ranges.push_back( std::make_pair( first, farthest ) );
+		ranges.push_back( std::make_pair( farthest, last ) );
+	}
+
+	for( size_t i = 0; i < points.size(); i++ )
+	{
+		if( keep[i] )
+			res.push_back( points[i] );
+	}
+}
+
+//
+// cubic bezier fitting (P. J. Schneider, "An Algorithm for Automatically Fitting Digitized Curves", Graphics Gems)
+//
+struct SFitRange
+{
+	size_t first;
+	size_t last;
+	QPointF tangent1;
+	QPointF tangent2;
+};
+
+// least squares control points for the fixed end points and tangents.
+static void generateBezier( const std::vector<QPointF> &d, const SFitRange &r, const std::vector<double> &u, QPointF *ctrl )
+{
+	const QPointF &p0 = d[r.first];
+	const QPointF &p3 = d[r.last];
+
+	double c00 = 0, c01 = 0, c11 = 0, x0 = 0, x1 = 0;
+	for( size_t i = 0; i < u.size(); i++ )
+	{
+		double t = u[i], s = 1 - t;
+		double b0 = s * s * s, b1 = 3 * s * s * t, b2 = 3 * s * t * t, b3 = t * t * t;
+
+		QPointF a1 = r.tangent1 * b1;
+		QPointF a2 = r.tangent2 * b2;
+		c00 += dot( a1, a1 );
+		c01 += dot( a1, a2 );
+		c11 += dot( a2, a2 );
+
+		QPointF tmp = d[r.first + i] - ( p0 * (b0 + b1) + p3 * (b2 + b3) );
+		x0 += dot( a1, tmp );
+		x1 += dot( a2, tmp );
+	}
+
+	double det = c00 * c11 - c01 * c01;
+	double alpha1 = 0, alpha2 = 0;
+	if( fabs( det ) > 1e-12 )
+	{
+		alpha1 = (x0 * c11 - x1 * c01) / det;
+		alpha2 = (c00 * x1 - c01 * x0) / det;
+	}
+
+	// a degenerate solution falls back to the chord heuristic.
+	double segLength = sqrt( distance2( p0, p3 ) );
+	double epsilon = 1e-6 * segLength;
+	if( alpha1 < epsilon || alpha2 < epsilon )
+		alpha1 = alpha2 = segLength / 3;
+
+	ctrl[0] = p0;
+	ctrl[1] = p0 + r.tangent1 * alpha1;
+	ctrl[2] = p3 + r.tangent2 * alpha2;
+	ctrl[3] = p3;
+}
+
+// one newton step for every parameter toward the nearest point on the curve.
+static void reparameterize( const std::vector<QPointF> &d, const SFitRange &r, const QPointF *ctrl, std::vector<double> &u )
+{
+	QPointF q1[3], q2[2];
+	for( int i = 0; i < 3; i++ )
+		q1[i] = (ctrl[i + 1] - ctrl[i]) * 3;
+	for( int i = 0; i < 2; i++ )
+		q2[i] = (q1[i + 1] - q1[i]) * 2;
+
+	for( size_t i = 0; i < u.size(); i++ )
+	{
+		double t = u[i], s = 1 - t;
+		QPointF q = bezierPoint( ctrl, t );
+		QPointF dq = q1[0] * (s * s) + q1[1] * (2 * s * t) + q1[2] * (t * t);
+		QPointF ddq = q2[0] * s + q2[1] * t;
+
+		QPointF diff = q - d[r.first + i];
+		double denominator = dot( dq, dq ) + dot( diff, ddq );
+		if( fabs( denominator ) < 1e-12 )
+			continue;
+
+		double next = t - dot( diff, dq ) / denominator;
+		u[i] = next < 0 ? 0 : (next > 1 ? 1 : next);
+	}
+}
+
+static double maxError( const std::vector<QPointF> &d, const SFitRange &r, const QPointF *ctrl, const std::vector<double> &u, size_t &split )
+{
+	double maxDist2 = 0;
+	split = (r.first + r.last) / 2;
+	for( size_t i = 1; i + 1 < u.size(); i++ )
+	{
+		double dist2 = distance2( bezierPoint( ctrl, u[i] ), d[r.first + i] );
+		if( dist2 > maxDist2 )
+		{
+			maxDist2 = dist2;
+			split = r.first + i;
+		}
+	}
+	return maxDist2;
+}
+
+void CStrokeProcessor::fitCurve( const std::vector<QPointF> &points, double tolerance, std::vector<QPointF> &res )
+{
+	res.clear();
+
+	// repeated samples have no direction, drop them first.
+	std::vector<QPointF> d;
+	d.reserve( points.size() );
+	for( size_t i = 0; i < points.size(); i++ )
+	{
+		if( d.empty() || d.back() != points[i] )
+			d.push_back( points[i] );
+	}
+
+	if( d.size() < 2 )
+	{
+		res = d;
+		return;
+	}
+
+	const double tolerance2 = tolerance * tolerance;
+	res.push_back( d[0] );
+
+	SFitRange whole;
+	whole.first = 0;
+	whole.last = d.size() - 1;
+	whole.tangent1 = unitVector( d[1] - d[0] );
+	whole.tangent2 = unitVector( d[d.size() - 2] - d[d.size() - 1] );
+
+	// depth first, the left half is on top. so the segments come out in stroke order.
+	std::vector<SFitRange> ranges;
+	ranges.push_back( whole );
+
+	std::vector<double> u;
+	QPointF ctrl[4];
+
+	while( !ranges.empty() )
+	{
+		SFitRange r = ranges.back();
+		ranges.pop_back();
+
+		// chord length parameterization
+		u.assign( 1, 0.0 );
+		for( size_t i = r.first + 1; i <= r.last; i++ )
+			u.push_back( u.back() + sqrt( distance2( d[i], d[i - 1] ) ) );
+		const double total = u.back();
+		for( size_t i = 1; i < u.size(); i++ )
+			u[i] /= total;
+
+		generateBezier( d, r, u, ctrl );
+
+		size_t split = r.first;
+		double error = maxError( d, r, ctrl, u, split );
+
+		if( error > tolerance2 && error < tolerance2 * 16 )
+		{
+			// close enough to converge by moving the parameters.
+			for( int i = 0; i < MAX_REPARAMETERIZE && error > tolerance2; i++ )
+			{
+				reparameterize( d, r, ctrl, u );
+				generateBezier( d, r, u, ctrl );
+				error = maxError( d, r, ctrl, u, split );
+			}
+		}
+
+		if( error <= tolerance2 || r.last - r.first < 2 )
+		{
+			res.push_back( ctrl[1] );
+			res.push_back( ctrl[2] );
+			res.push_back( ctrl[3] );
+			continue;
+		}
+
+		// split at the worst point with a shared tangent, so the curve stays smooth.
+		QPointF center = unitVector( d[split - 1] - d[split + 1] );
+		if( center == QPointF( 0, 0 ) )
+			center = unitVector( d[split - 1] - d[split] );
+
+		SFitRange left = r, right = r;
+		left.last = split;
+		left.tangent2 = center;
+		right.first = split;
+		right.tangent1 = center * -1;
+
+		ranges.push_back( right );
+		ranges.push_back( left );
+	}
+}
+
+void CStrokeProcessor::flattenCurve( const std::vector<QPointF> &ctrlPoints, double tolerance, std::vector<QPointF> &res )
+{
+	res.clear();
+	if( ctrlPoints.empty() )
+		return;
+
+	res.push_back( ctrlPoints[0] );
+	if( tolerance <= 0 )
+		tolerance = 0.1;
+
+	for( size_t i = 0; i + 3 < ctrlPoints.size(); i += 3 )
+	{
+		const QPointF *ctrl = &ctrlPoints[i];
+
+		// the chord of n steps is within 3/4 * (max second difference) / n^2 of the curve.
+		double dd = std::max( sqrt( distance2( ctrl[0] - ctrl[1], ctrl[1] - ctrl[2] ) ),
+			sqrt( distance2( ctrl[1] - ctrl[2], ctrl[2] - ctrl[3] ) ) );
+		int steps = (int)ceil( sqrt( dd * 0.75 / tolerance ) );
+		if( steps < 1 )
+			steps = 1;
+		if( steps > MAX_FLATTEN_STEPS )
+			steps = MAX_FLATTEN_STEPS;
+
+		for( int s = 1; s < steps; s++ )
+			res.push_back( bezierPoint( ctrl, (double)s / steps ) );
+		res.push_back( ctrl[3] );
+	}
+}
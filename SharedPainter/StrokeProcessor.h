@@ -0,0 +1,48 @@
+#pragma once
+
+class CLineItem;
+
+//---------------------------------------------
+// stroke processing at the end of a free pen stroke
+//---------------------------------------------
+//
+// A mouse or a tablet reports far more samples than a stroke needs.
+// The stroke is reduced once, before it is stored and sent, so every
+// peer stores, relays and renders the reduced one.
+//
+// MODE_SIMPLIFY : Ramer-Douglas-Peucker. a polyline within tolerance pixels of the samples.
+// MODE_CURVE    : cubic bezier fitting. control points | p0 | c1 | c2 | p1 | c1 | c2 | p2 ...
+//
+
+class CStrokeProcessor
+{
+public:
+	enum Mode {
+		MODE_NONE = 0,
+		MODE_SIMPLIFY,
+		MODE_CURVE,
+	};
+
+	CStrokeProcessor( void ) : mode_(MODE_NONE), tolerance_(0.5) { }
+
+	void setMode( Mode mode ) { mode_ = mode; }
+	Mode mode( void ) const { return mode_; }
+
+	// pixel tolerance. (a reduced stroke never leaves the samples further than this)
+	void setTolerance( double tolerance ) { tolerance_ = tolerance > 0 ? tolerance : 0; }
+	double tolerance( void ) const { return tolerance_; }
+
+	// replace the points of the finished stroke.
+	void process( CLineItem &line ) const;
+
+public:
+	static void simplify( const std::vector<QPointF> &points, double tolerance, std::vector<QPointF> &res );
+	static void fitCurve( const std::vector<QPointF> &points, double tolerance, std::vector<QPointF> &res );
+
+	// bezier control points -> polyline within tolerance of the curve
+	static void flattenCurve( const std::vector<QPointF> &ctrlPoints, double tolerance, std::vector<QPointF> &res );
+
+private:
+	Mode mode_;
+	double tolerance_;
+};
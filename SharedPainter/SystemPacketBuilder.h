@@ -8,70 +8,74 @@ namespace SystemPacketBuilder
 	class CJoinerUser
 	{
 	public:
+		// | userId | capabilities |
+		// capabilities is a trailing field. an old peer ignores it, and sends a body without it.
+		typedef PacketSchema::CMessage< CODE_SYSTEM_JOIN, PacketSchema::String8, PacketSchema::Int32 > Schema;
+		typedef PacketSchema::CFields< PacketSchema::String8 > LegacySchema;
+
 		static std::string make( boost::shared_ptr<CPaintUser> user )
 		{
-			int pos = 0;
-			try
-			{
-				std::string body;
-				pos += CPacketBufferUtil::writeString8( body, pos, user->userId() );
-
-				return CommonPacketBuilder::makePacket( CODE_SYSTEM_JOIN, body );
-			}catch(...)
-			{
-			}
-			return "";
+			return Schema::make( user->userId(), user->capabilities() );
 		}
 
-		static boost::shared_ptr<CPaintUser> parse( const std::string &body )
+		static boost::shared_ptr<CPaintUser> parse( const CPacketView &body )
 		{
-			int pos = 0;
-			try
-			{
-				struct SPaintUserInfoData userInfo;
-				pos += CPacketBufferUtil::readString8( body, pos, userInfo.userId );
+			CPacketReader reader( body );
+
+			CPacketView userId;
+			if( !LegacySchema::read( reader, userId ) )
+				return boost::shared_ptr<CPaintUser>();
+
+			struct SPaintUserInfoData userInfo;
+			userInfo.userId = userId.str();
 
-				boost::shared_ptr<CPaintUser> user = boost::shared_ptr<CPaintUser>(new CPaintUser);
-				user->loadData( userInfo );
-				return user;
+			boost::int32_t caps = 0;
+			if( reader.remaining() >= 4 && reader.readInt32( caps ) )
+				userInfo.capabilities = caps;
 
-			}catch(...)
-			{
-			}
-			return boost::shared_ptr<CPaintUser>();
+			boost::shared_ptr<CPaintUser> user = boost::shared_ptr<CPaintUser>(new CPaintUser);
+			user->loadData( userInfo );
+			return user;
 		}
 	};
 
 	class CLeftUser
 	{
 	public:
+		// | userId |
+		typedef PacketSchema::CMessage< CODE_SYSTEM_LEFT, PacketSchema::String8 > Schema;
+
 		static std::string make( const std::string &userId )
 		{
-			int pos = 0;
-			try
-			{
-				std::string body;
-				pos += CPacketBufferUtil::writeString8( body, pos, userId );
+			return Schema::make( userId );
+		}
+
+		static bool parse( const CPacketView &body, std::string &userId )
+		{
+			CPacketView userIdView;
+			if( !Schema::parse( body, userIdView ) )
+				return false;
 
-				return CommonPacketBuilder::makePacket( CODE_SYSTEM_LEFT, body );
-			}catch(...)
-			{
-			}
-			return "";
+			userId = userIdView.str();
+			return true;
 		}
+	};
 
-		static bool parse( const std::string &body, std::string &userId )
+	class CStreamCompression
+	{
+	public:
+		// NOTHING BODY
+		// sent raw, every byte after it is one deflate stream. (see CStreamCompressor)
+		typedef PacketSchema::CMessage< CODE_SYSTEM_STREAM_COMPRESSION > Schema;
+
+		static std::string make( void )
 		{
-			int pos = 0;
-			try
-			{
-				pos += CPacketBufferUtil::readString8( body, pos, userId );
-				return true;
+			return Schema::make();
+		}
 
-			}catch(...)
-			{
-			}
-			return false;
+		static bool parse( const CPacketView &body )
+		{
+			return Schema::parse( body );
 		}
 	};
 };
@@ -0,0 +1,213 @@
+#include "StdAfx.h"
+#include "TileCodec.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2_TILE_HASH 1
+#endif
+
+static inline boost::uint32_t rotateLeft( boost::uint32_t v, int n )
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static boost::uint64_t foldHash( const boost::uint32_t *a, const boost::uint32_t *b )
+{
+	boost::uint32_t lo = 0, hi = 0;
+	for( int i = 0; i < 4; i++ )
+	{
+		lo = rotateLeft( lo, 7 ) ^ a[i];
+		hi = rotateLeft( hi, 7 ) ^ b[i];
+	}
+	return ((boost::uint64_t)hi << 32) | lo;
+}
+
+static bool isPixel32( const QImage &image )
+{
+	return image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32 || image.format() == QImage::Format_ARGB32_Premultiplied;
+}
+
+int CTileCodec::tileCount( int width, int height, int tileSize )
+{
+	if( width <= 0 || height <= 0 || tileSize <= 0 )
+		return 0;
+	return ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+}
+
+QRect CTileCodec::tileRect( int width, int height, int index, int tileSize )
+{
+	int columns = (width + tileSize - 1) / tileSize;
+	int x = (index % columns) * tileSize;
+	int y = (index / columns) * tileSize;
+	return QRect( x, y, std::min( tileSize, width - x ), std::min( tileSize, height - y ) );
+}
+
+//
+// fletcher style sums over 4 lanes of 32bit pixels. a row is padded with 0 to the multiple of 4.
+// a : the sum of the pixels, b : the sum of a. (so b changes when a pixel moves)
+//
+boost::uint64_t CTileCodec::hashPixelsScalar( const uchar *bits, int bytesPerLine, int width, int height )
+{
+	boost::uint32_t a[4] = { 0, 0, 0, 0 };
+	boost::uint32_t b[4] = { 0, 0, 0, 0 };
+
+	for( int y = 0; y < height; y++ )
+	{
+		const boost::uint32_t *row = (const boost::uint32_t *)(bits + y * bytesPerLine);
+		for( int x = 0; x < width; x += 4 )
+		{
+			for( int lane = 0; lane < 4; lane++ )
+			{
+				a[lane] += x + lane < width ? row[x + lane] : 0;
+				b[lane] += a[lane];
+			}
+		}
+	}
+	return foldHash( a, b );
+}
+
+boost::uint64_t CTileCodec::hashPixels( const uchar *bits, int bytesPerLine, int width, int height )
+{
+#ifdef USE_SSE2_TILE_HASH
+	__m128i a = _mm_setzero_si128();
+	__m128i b = _mm_setzero_si128();
+
+	for( int y = 0; y < height; y++ )
+	{
+		const boost::uint32_t *row = (const boost::uint32_t *)(bits + y * bytesPerLine);
+
+		int x = 0;
+		for( ; x + 4 <= width; x += 4 )
+		{
+			a = _mm_add_epi32( a, _mm_loadu_si128( (const __m128i *)(row + x) ) );
+			b = _mm_add_epi32( b, a );
+		}
+
+		if( x < width )
+		{
+			boost::uint32_t rest[4] = { 0, 0, 0, 0 };
+			memcpy( rest, row + x, (width - x) * 4 );
+			a = _mm_add_epi32( a, _mm_loadu_si128( (const __m128i *)rest ) );
+			b = _mm_add_epi32( b, a );
+		}
+	}
+
+	boost::uint32_t sumA[4], sumB[4];
+	_mm_storeu_si128( (__m128i *)sumA, a );
+	_mm_storeu_si128( (__m128i *)sumB, b );
+	return foldHash( sumA, sumB );
+#else
+	return hashPixelsScalar( bits, bytesPerLine, width, height );
+#endif
+}
+
+bool CTileCodec::diff( const QImage &input, std::vector<int> &indexes )
+{
+	indexes.clear();
+
+	QImage frame = isPixel32( input ) ? input : input.convertToFormat( QImage::Format_RGB32 );
+	if( frame.isNull() )
+	{
+		reset();
+		return false;
+	}
+
+	int count = tileCount( frame.width(), frame.height() );
+	bool keyframe = frame.size() != size_ || (int)hashes_.size() != count || frameCount_ % keyFrameInterval_ == 0;
+
+	hashes_.resize( count );
+	size_ = frame.size();
+	frameCount_++;
+
+	for( int i = 0; i < count; i++ )
+	{
+		QRect rect = tileRect( frame.width(), frame.height(), i );
+		boost::uint64_t hash = hashPixels( frame.constScanLine( rect.y() ) + rect.x() * 4, frame.bytesPerLine(), rect.width(), rect.height() );
+
+		if( keyframe || hash != hashes_[i] )
+			indexes.push_back( i );
+		hashes_[i] = hash;
+	}
+
+	// an unchanged frame is not sent, the receivers stay on the last id.
+	if( !indexes.empty() )
+	{
+		baseId_ = frameId_;
+		frameId_++;
+	}
+	return keyframe;
+}
+
+void CTileCodec::encode( const QImage &input, const std::string &owner, bool keyframe, boost::uint32_t frameId, boost::uint32_t baseId, const std::vector<int> &indexes, STileDelta &delta )
+{
+	QImage frame = isPixel32( input ) ? input : input.convertToFormat( QImage::Format_RGB32 );
+
+	delta.owner = owner;
+	delta.width = frame.width();
+	delta.height = frame.height();
+	delta.tileSize = TileSize;
+	delta.keyframe = keyframe;
+	delta.frameId = frameId;
+	delta.baseId = baseId;
+	delta.indexes.clear();
+	delta.tiles.clear();
+
+	int count = tileCount( frame.width(), frame.height() );
+	for( size_t i = 0; i < indexes.size(); i++ )
+	{
+		if( indexes[i] < 0 || indexes[i] >= count )
+			continue;
+
+		QByteArray png;
+		QBuffer buffer( &png );
+		buffer.open( QIODevice::WriteOnly );
+		frame.copy( tileRect( frame.width(), frame.height(), indexes[i] ) ).save( &buffer, "PNG" );
+
+		delta.indexes.push_back( indexes[i] );
+		delta.tiles.push_back( png );
+	}
+}
+
+bool CTileCodec::apply( QImage &frame, const STileDelta &delta, std::vector<QRect> &rects )
+{
+	rects.clear();
+
+	if( delta.width <= 0 || delta.height <= 0 || delta.width > MaxFrameSize || delta.height > MaxFrameSize || delta.tileSize <= 0 )
+		return false;
+	if( delta.indexes.size() != delta.tiles.size() )
+		return false;
+
+	QSize size( delta.width, delta.height );
+	if( frame.isNull() || frame.size() != size )
+	{
+		if( !delta.keyframe )
+			return false;
+
+		frame = QImage( size, QImage::Format_RGB32 );
+		frame.fill( qRgb( 255, 255, 255 ) );
+	}
+	else if( !isPixel32( frame ) )
+	{
+		frame = frame.convertToFormat( QImage::Format_RGB32 );
+	}
+
+	int count = tileCount( delta.width, delta.height, delta.tileSize );
+
+	QPainter painter( &frame );
+	painter.setCompositionMode( QPainter::CompositionMode_Source );
+	for( size_t i = 0; i < delta.indexes.size(); i++ )
+	{
+		if( delta.indexes[i] < 0 || delta.indexes[i] >= count )
+			continue;
+
+		QRect rect = tileRect( delta.width, delta.height, delta.indexes[i], delta.tileSize );
+
+		QImage tile;
+		if( !tile.loadFromData( delta.tiles[i], "PNG" ) || tile.size() != rect.size() )
+			continue;
+
+		painter.drawImage( rect.topLeft(), tile );
+		rects.push_back( rect );
+	}
+	return true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+//---------------------------------------------
+// tile delta encoding of the background image
+//---------------------------------------------
+//
+// | owner | width (2byte) | height (2byte) | tile size (2byte) | keyframe (1byte) | tile count (4byte) |
+// | frame id (4byte) | base id (4byte) | tile index (4byte) | png (string32) | tile index | png | ...
+//
+// The frame is cut into TileSize x TileSize tiles (the right and bottom ones may be smaller).
+// The sender keeps a hash of every tile of the last frame, and sends the tiles whose hash changed.
+// Every keyFrameInterval frames, or when the frame size changes, all the tiles are sent (a keyframe),
+// so a receiver which missed the base, or a hash collision, is repaired.
+// A receiver patches its background in place. a delta for a base it does not have is dropped.
+// The frames of a sender are numbered from 1. a delta makes the frame id of its owner out of the base id,
+// and the receiver keeps the owner and the id of the last applied one (see CBackgroundImageItem::applyDelta).
+// A delta whose base is not that frame (ex: someone else set a background of the same size meanwhile)
+// is dropped until the next keyframe. The bands of one frame (the sync data) have base id == frame id.
+//
+
+struct STileDelta
+{
+	std::string owner;
+	int width;
+	int height;
+	int tileSize;
+	bool keyframe;
+	boost::uint32_t frameId;
+	boost::uint32_t baseId;		// a keyframe : not checked
+	std::vector<int> indexes;
+	std::vector<QByteArray> tiles;	// png
+
+	STileDelta( void ) : width(0), height(0), tileSize(0), keyframe(false), frameId(0), baseId(0) { }
+};
+
+class CTileCodec
+{
+public:
+	static const int TileSize = 64;
+	static const int DefaultKeyFrameInterval = 10;
+	static const int MaxFrameSize = 16384;
+
+	CTileCodec( void ) : frameCount_(0), keyFrameInterval_(DefaultKeyFrameInterval), frameId_(0), baseId_(0) { }
+
+	// 1 : every frame is a keyframe
+	void setKeyFrameInterval( int interval ) { keyFrameInterval_ = interval > 0 ? interval : 1; }
+	int keyFrameInterval( void ) const { return keyFrameInterval_; }
+
+	// forget the last frame. (the background was changed by someone else, the next frame is a keyframe)
+	void reset( void )
+	{
+		hashes_.clear();
+		frameCount_ = 0;
+	}
+
+	// the tiles changed since the last frame, and becomes the last frame.
+	// returns true for a keyframe. (all the tiles)
+	// a frame with a change gets the next frame id, the ids go on over reset().
+	bool diff( const QImage &frame, std::vector<int> &indexes );
+
+	// the frame the last diff made, and the one it was diffed against.
+	boost::uint32_t frameId( void ) const { return frameId_; }
+	boost::uint32_t baseId( void ) const { return baseId_; }
+
+	// the delta of the frame with the given tiles.
+	static void encode( const QImage &frame, const std::string &owner, bool keyframe, boost::uint32_t frameId, boost::uint32_t baseId, const std::vector<int> &indexes, STileDelta &delta );
+
+	// draw the tiles on the frame, a keyframe of another size makes a new frame.
+	// false if the frame can not take it, a delta of another size. (the base id is checked by the item)
+	// rects : the changed area
+	static bool apply( QImage &frame, const STileDelta &delta, std::vector<QRect> &rects );
+
+	static int tileCount( int width, int height, int tileSize = TileSize );
+	static QRect tileRect( int width, int height, int index, int tileSize = TileSize );
+
+	// stages (exposed for checking the simd path against the scalar one)
+public:
+	// a 64bit checksum of 32bit pixels.
+	static boost::uint64_t hashPixels( const uchar *bits, int bytesPerLine, int width, int height );
+	static boost::uint64_t hashPixelsScalar( const uchar *bits, int bytesPerLine, int width, int height );
+
+private:
+	std::vector<boost::uint64_t> hashes_;
+	QSize size_;
+	int frameCount_;
+	int keyFrameInterval_;
+	boost::uint32_t frameId_;
+	boost::uint32_t baseId_;
+};
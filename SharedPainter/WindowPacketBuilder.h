@@ -7,36 +7,22 @@ namespace WindowPacketBuilder
 	class CResizeMainWindow
 	{
 	public:
+		// | width | height |
+		typedef PacketSchema::CMessage< CODE_WINDOW_RESIZE_MAIN_WND, PacketSchema::Int16, PacketSchema::Int16 > Schema;
+
 		static std::string make( int width, int height )
 		{
-			int pos = 0;
-			try
-			{
-				std::string body;
-				pos += CPacketBufferUtil::writeInt16( body, pos, width, true );
-				pos += CPacketBufferUtil::writeInt16( body, pos, height, true );
-
-				return CommonPacketBuilder::makePacket( CODE_WINDOW_RESIZE_MAIN_WND, body );
-			}catch(...)
-			{
-			}
-			return "";
+			return Schema::make( width, height );
 		}
 
-		static bool parse( const std::string &body, int &width, int &height )
+		static bool parse( const CPacketView &body, int &width, int &height )
 		{
-			int pos = 0;
-			try
-			{
-				boost::int16_t w, h;
-				pos += CPacketBufferUtil::readInt16( body, pos, w, true );
-				pos += CPacketBufferUtil::readInt16( body, pos, h, true );
-				width = w;
-				height = h;
-			}catch(...)
-			{
+			boost::int16_t w, h;
+			if( !Schema::parse( body, w, h ) )
 				return false;
-			}
+
+			width = w;
+			height = h;
 			return true;
 		}
 	};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+
+//---------------------------------------------
+// CWorkerPool : a few threads for cpu and disk work off the main thread
+//---------------------------------------------
+//
+// post() runs a job on any thread of the pool, in no particular order.
+// the jobs posted to a strand of the pool (newStrand) run one at a time, in the order they were posted.
+// run() runs a set of jobs in parallel and returns when all of them are done.
+// the caller runs the jobs no thread has taken yet, so it does not wait behind the posted ones.
+//
+
+class CWorkerPool
+{
+public:
+	typedef boost::function< void () > job_t;
+	typedef boost::asio::io_service::strand strand_t;
+
+	static const int MaxThreadCount = 4;
+
+	CWorkerPool( void ) : work_( new boost::asio::io_service::work( io_service_ ) )
+	{
+		int count = (int)boost::thread::hardware_concurrency();
+		if( count < 1 )
+			count = 1;
+		if( count > MaxThreadCount )
+			count = MaxThreadCount;
+
+		for( int i = 0; i < count; i++ )
+			threads_.create_thread( boost::bind( &CWorkerPool::_threadMain, this ) );
+	}
+
+	~CWorkerPool( void )
+	{
+		close();
+	}
+
+	void post( job_t job )
+	{
+		io_service_.post( job );
+	}
+
+	boost::shared_ptr<strand_t> newStrand( void )
+	{
+		return boost::shared_ptr<strand_t>( new strand_t( io_service_ ) );
+	}
+
+	void run( const std::vector<job_t> &jobs )
+	{
+		if( jobs.empty() )
+			return;
+
+		// a thread may take its turn after the caller is done, the batch lives until then.
+		boost::shared_ptr<struct SBatch> batch( new SBatch );
+		batch->jobs = jobs;
+		batch->next = 0;
+		batch->remaining = jobs.size();
+
+		for( size_t i = 1; i < jobs.size(); i++ )
+			io_service_.post( boost::bind( &CWorkerPool::_runBatchJob, batch ) );
+
+		while( _runBatchJob( batch ) )
+			;
+
+		boost::mutex::scoped_lock autolock( batch->mutex );
+		while( batch->remaining > 0 )
+			batch->done.wait( autolock );
+	}
+
+	// the queued jobs are done before it returns.
+	void close( void )
+	{
+		work_.reset();
+		threads_.join_all();
+	}
+
+private:
+	struct SBatch
+	{
+		boost::mutex mutex;
+		boost::condition_variable done;
+		std::vector<job_t> jobs;
+		size_t next;		// the first job nobody has taken
+		size_t remaining;
+	};
+
+	// false : every job is taken
+	static bool _runBatchJob( boost::shared_ptr<struct SBatch> batch )
+	{
+		job_t job;
+		{
+			boost::mutex::scoped_lock autolock( batch->mutex );
+			if( batch->next >= batch->jobs.size() )
+				return false;
+			job = batch->jobs[ batch->next++ ];
+		}
+
+		job();
+
+		boost::mutex::scoped_lock autolock( batch->mutex );
+		if( --batch->remaining == 0 )
+			batch->done.notify_all();
+		return true;
+	}
+
+	void _threadMain( void )
+	{
+		io_service_.run();
+	}
+
+private:
+	boost::asio::io_service io_service_;
+	boost::scoped_ptr< boost::asio::io_service::work > work_;
+	boost::thread_group threads_;
+};